@@ -0,0 +1,470 @@
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "metadata.h"
+#include "algebra.h"
+#include "draw-state.h"
+#include "heightmap.h"
+#include "mapped-memory.h"
+#include "parallel.h"
+#include "png-encoder.h"
+#include "random.h"
+#include "stage-timer.h"
+#include "progress.h"
+
+// Headless front end: runs the same Heightmap operations as the GUI from command-line arguments or a pipeline file,
+// without creating any window or GL context
+
+typedef std::vector<std::string> Tokens;
+typedef std::map<std::string, std::string> Options;
+
+struct Command_Spec {
+	const char *name;
+	size_t num_args;
+	const char *options; // space-separated option keys
+	const char *usage;
+};
+
+static const Command_Spec COMMAND_SPECS[] = {
+	{"new", 2, "", "new WIDTH HEIGHT"},
+	{"open", 1, "seed", "open FILE [seed=N]"},
+	{"save", 1, "colors level filter", "save FILE [colors=grayscale|elevation|hardness|solubility|combination|earth] "
+		"[level=6] [filter=none|sub|up|average|paeth|adaptive]"},
+	{"decimate", 0, "keep percent seed", "decimate [keep=random|edges] [percent=50] [seed=N]"},
+	{"expand", 0, "power", "expand [power=2]"},
+	{"interpolate", 0, "mdbu I md H rt rs seed", "interpolate [mdbu=yes] [I=0.4] [md=yes] [H=1] [rt=0] [rs=1] "
+		"[seed=N]"},
+	{"erode", 0, "mode steps until resume checkpoint every tolerance skip thermal Kt Ka Ki hydraulic Kc Kd Ks Ke W0 "
+		"Wmin droplets lifetime inertia capacity deposition dissolution evaporation seed",
+		"erode [mode=grid|droplets] [steps=100] [until=N] [resume=yes] [checkpoint=FILE.fhm] [every=100] "
+		"[tolerance=0] [skip=no] [thermal=yes] [Kt=0.15] [Ka=0.8] [Ki=0.1] [hydraulic=yes] [Kc=8] [Kd=0.05] "
+		"[Ks=0.1] [Ke=0.01] [W0=1] [Wmin=0.01] [droplets=1] [lifetime=30] [inertia=0.05] [capacity=4] "
+		"[deposition=0.3] [dissolution=0.3] [evaporation=0.01] [seed=N]"}
+};
+
+static const size_t NUM_COMMAND_SPECS = sizeof(COMMAND_SPECS) / sizeof(COMMAND_SPECS[0]);
+
+struct Command {
+	const Command_Spec *spec;
+	Tokens args;
+	Options options;
+};
+
+static void usage(const char *program) {
+	std::cout << TERRAIN_PROGRAM_NAME " " TERRAIN_VERSION_STRING " batch mode\n\n"
+		"Usage: " << program << " [OPTIONS] COMMAND [ARGS...] [COMMAND [ARGS...]]...\n"
+		"       " << program << " [OPTIONS] -f PIPELINE\n\n"
+		"Options:\n"
+		"  -d DIRECTORY directory for scratch files (default: the system's temporary directory)\n"
+		"  -f PIPELINE  read commands from a file (\"quotes\" group words, # starts a comment)\n"
+		"  -j TRACE     write the time each stage took as a Chrome trace (JSON)\n"
+		"  -m MEGABYTES memory to use before spilling to scratch files (default: half of physical memory)\n"
+		"  -p           print the time, throughput and allocations of each stage\n"
+		"  -q           do not print progress\n"
+		"  -s SEED      seed from which each command's default seed= is derived (default: current time)\n"
+		"  -t THREADS   number of worker threads (default: one per core)\n\n"
+		"Commands, run in order:\n";
+	for (size_t i = 0; i < NUM_COMMAND_SPECS; i++) {
+		std::cout << "  " << COMMAND_SPECS[i].usage << "\n";
+	}
+	std::cout << std::flush;
+}
+
+static const Command_Spec *find_command_spec(const std::string &name) {
+	for (size_t i = 0; i < NUM_COMMAND_SPECS; i++) {
+		if (name == COMMAND_SPECS[i].name) { return &COMMAND_SPECS[i]; }
+	}
+	return NULL;
+}
+
+static bool has_option(const Command_Spec *spec, const std::string &key) {
+	std::istringstream ss(spec->options);
+	std::string k;
+	while (ss >> k) {
+		if (k == key) { return true; }
+	}
+	return false;
+}
+
+static bool read_pipeline(const char *filename, Tokens &tokens) {
+	std::ifstream file(filename);
+	if (!file) { return false; }
+	std::string line;
+	while (std::getline(file, line)) {
+		std::string token;
+		bool quoted = false, pending = false;
+		for (size_t i = 0; i < line.size(); i++) {
+			char c = line[i];
+			if (c == '"') { quoted = !quoted; pending = true; }
+			else if (!quoted && c == '#') { break; }
+			else if (!quoted && isspace((unsigned char)c)) {
+				if (pending) { tokens.push_back(token); }
+				token.clear();
+				pending = false;
+			}
+			else { token += c; pending = true; }
+		}
+		if (pending) { tokens.push_back(token); }
+	}
+	return true;
+}
+
+static bool parse_commands(const Tokens &tokens, std::vector<Command> &commands, std::string &error) {
+	// Each command name is followed by its positional arguments, then any number of key=value options
+	size_t i = 0;
+	while (i < tokens.size()) {
+		Command c;
+		c.spec = find_command_spec(tokens[i]);
+		if (!c.spec) {
+			error = "unknown command '" + tokens[i] + "'";
+			return false;
+		}
+		i++;
+		for (size_t a = 0; a < c.spec->num_args; a++, i++) {
+			if (i >= tokens.size()) {
+				error = std::string("missing arguments: ") + c.spec->usage;
+				return false;
+			}
+			c.args.push_back(tokens[i]);
+		}
+		for (; i < tokens.size(); i++) {
+			size_t eq = tokens[i].find('=');
+			if (eq == std::string::npos) { break; }
+			std::string key = tokens[i].substr(0, eq);
+			if (!has_option(c.spec, key)) {
+				error = "unknown option '" + key + "' for " + c.spec->usage;
+				return false;
+			}
+			c.options[key] = tokens[i].substr(eq + 1);
+		}
+		commands.push_back(c);
+	}
+	return true;
+}
+
+static bool parse_size(const std::string &s, size_t &v) {
+	char *end;
+	unsigned long n = strtoul(s.c_str(), &end, 10);
+	if (s.empty() || *end || s[0] == '-') { return false; }
+	v = (size_t)n;
+	return true;
+}
+
+static bool parse_float(const std::string &s, float &v) {
+	char *end;
+	double d = strtod(s.c_str(), &end);
+	if (s.empty() || *end) { return false; }
+	v = (float)d;
+	return true;
+}
+
+static bool parse_bool(const std::string &s, bool &v) {
+	if (s == "yes" || s == "true" || s == "on" || s == "1") { v = true; return true; }
+	if (s == "no" || s == "false" || s == "off" || s == "0") { v = false; return true; }
+	return false;
+}
+
+static bool parse_color_scheme(const std::string &s, Color_Scheme &cs) {
+	if (s == "grayscale") { cs = GRAYSCALE; }
+	else if (s == "elevation") { cs = ELEVATION_RED; }
+	else if (s == "hardness") { cs = HARDNESS_GREEN; }
+	else if (s == "solubility") { cs = SOLUBILITY_BLUE; }
+	else if (s == "combination") { cs = COMBINATION_WHITE; }
+	else if (s == "earth") { cs = ARTIFICIAL_EARTH; }
+	else { return false; }
+	return true;
+}
+
+static bool parse_png_filter(const std::string &s, Png_Filter &f) {
+	if (s == "none") { f = NO_FILTER; }
+	else if (s == "sub") { f = SUB_FILTER; }
+	else if (s == "up") { f = UP_FILTER; }
+	else if (s == "average") { f = AVERAGE_FILTER; }
+	else if (s == "paeth") { f = PAETH_FILTER; }
+	else if (s == "adaptive") { f = ADAPTIVE_FILTER; }
+	else { return false; }
+	return true;
+}
+
+// Option getters leave v at its default when the option is absent
+
+static bool size_option(const Command &c, const char *key, size_t &v, std::string &error) {
+	Options::const_iterator it = c.options.find(key);
+	if (it == c.options.end() || parse_size(it->second, v)) { return true; }
+	error = std::string("invalid ") + key + " '" + it->second + "' for " + c.spec->usage;
+	return false;
+}
+
+static bool float_option(const Command &c, const char *key, float &v, std::string &error) {
+	Options::const_iterator it = c.options.find(key);
+	if (it == c.options.end() || parse_float(it->second, v)) { return true; }
+	error = std::string("invalid ") + key + " '" + it->second + "' for " + c.spec->usage;
+	return false;
+}
+
+static bool bool_option(const Command &c, const char *key, bool &v, std::string &error) {
+	Options::const_iterator it = c.options.find(key);
+	if (it == c.options.end() || parse_bool(it->second, v)) { return true; }
+	error = std::string("invalid ") + key + " '" + it->second + "' for " + c.spec->usage;
+	return false;
+}
+
+static bool run_command(const Command &c, Heightmap *hm, unsigned int seed, Progress *p, std::string &error) {
+	// Parse every argument first; with no heightmap, only validate the command
+	const std::string name = c.spec->name;
+	size_t seed_option = seed;
+	if (!size_option(c, "seed", seed_option, error)) { return false; }
+	seed = (unsigned int)seed_option;
+	if (name == "new") {
+		size_t w, h;
+		if (!parse_size(c.args[0], w) || !parse_size(c.args[1], h) || w < 2 || h < 2) {
+			error = "invalid size for " + std::string(c.spec->usage);
+			return false;
+		}
+		if (!hm) { return true; }
+		if (!hm->create(w, h)) { error = "could not create new DTED"; return false; }
+	}
+	else if (name == "open") {
+		if (!hm) { return true; }
+		if (!hm->open(c.args[0].c_str(), seed)) {
+			error = "could not load " + c.args[0] + " as elevation data";
+			return false;
+		}
+	}
+	else if (name == "save") {
+		Color_Scheme cs = GRAYSCALE;
+		Options::const_iterator it = c.options.find("colors");
+		if (it != c.options.end() && !parse_color_scheme(it->second, cs)) {
+			error = "invalid colors '" + it->second + "' for " + c.spec->usage;
+			return false;
+		}
+		size_t level = PNG_DEFAULT_LEVEL;
+		if (!size_option(c, "level", level, error)) { return false; }
+		if (level > 9) { error = "invalid level for " + std::string(c.spec->usage); return false; }
+		Png_Filter filter = ADAPTIVE_FILTER;
+		it = c.options.find("filter");
+		if (it != c.options.end() && !parse_png_filter(it->second, filter)) {
+			error = "invalid filter '" + it->second + "' for " + c.spec->usage;
+			return false;
+		}
+		if (!hm) { return true; }
+		if (!hm->save(c.args[0].c_str(), cs, (int)level, filter, p)) {
+			error = "could not save " + c.args[0];
+			return false;
+		}
+	}
+	else if (name == "decimate") {
+		bool random = true;
+		float percent = 50.0f;
+		Options::const_iterator it = c.options.find("keep");
+		if (it != c.options.end()) {
+			if (it->second == "random") { random = true; }
+			else if (it->second == "edges") { random = false; }
+			else { error = "invalid keep '" + it->second + "' for " + c.spec->usage; return false; }
+		}
+		if (!float_option(c, "percent", percent, error)) { return false; }
+		if (!hm) { return true; }
+		if (!hm->decimate(random, percent / 100.0, seed, p)) { error = "could not decimate"; return false; }
+	}
+	else if (name == "expand") {
+		size_t power = 2;
+		if (!size_option(c, "power", power, error)) { return false; }
+		if (!hm) { return true; }
+		if (!hm->expand(power, p)) { error = "could not expand"; return false; }
+	}
+	else if (name == "interpolate") {
+		bool mdbu = true, md = true;
+		float I = 0.4f, H = 1.0f, rt = 0.0f, rs = 1.0f;
+		if (!bool_option(c, "mdbu", mdbu, error) || !float_option(c, "I", I, error) ||
+			!bool_option(c, "md", md, error) || !float_option(c, "H", H, error) ||
+			!float_option(c, "rt", rt, error) || !float_option(c, "rs", rs, error)) {
+			return false;
+		}
+		if (!hm) { return true; }
+		if (!hm->interpolate(mdbu, I, md, H, rt, rs, seed, p)) { error = "could not interpolate"; return false; }
+	}
+	else if (name == "erode") {
+		// mode=droplets rolls droplets per known column instead of simulating the grid's water and sediment
+		bool droplets_mode = false;
+		Options::const_iterator mt = c.options.find("mode");
+		if (mt != c.options.end()) {
+			if (mt->second == "grid") { droplets_mode = false; }
+			else if (mt->second == "droplets") { droplets_mode = true; }
+			else { error = "invalid mode '" + mt->second + "' for " + c.spec->usage; return false; }
+		}
+		if (droplets_mode) {
+			size_t lifetime = 30;
+			float droplets = 1.0f, inertia = 0.05f, capacity = 4.0f, deposition = 0.3f, dissolution = 0.3f;
+			float evaporation = 0.01f;
+			if (!float_option(c, "droplets", droplets, error) || !size_option(c, "lifetime", lifetime, error) ||
+				!float_option(c, "inertia", inertia, error) || !float_option(c, "capacity", capacity, error) ||
+				!float_option(c, "deposition", deposition, error) ||
+				!float_option(c, "dissolution", dissolution, error) ||
+				!float_option(c, "evaporation", evaporation, error)) {
+				return false;
+			}
+			// The ranges are written so that not-a-number values fall outside them too
+			const char *invalid = !(droplets >= 0.0f) ? "droplets" : !(capacity >= 0.0f) ? "capacity" :
+				!(inertia >= 0.0f && inertia <= 1.0f) ? "inertia" :
+				!(deposition >= 0.0f && deposition <= 1.0f) ? "deposition" :
+				!(dissolution >= 0.0f && dissolution <= 1.0f) ? "dissolution" :
+				!(evaporation >= 0.0f && evaporation <= 1.0f) ? "evaporation" : NULL;
+			if (invalid) { error = std::string("invalid ") + invalid + " for " + c.spec->usage; return false; }
+			if (!hm) { return true; }
+			if (!hm->erode_droplets(droplets, lifetime, inertia, capacity, deposition, dissolution, evaporation, seed,
+				p)) {
+				error = "could not erode";
+				return false;
+			}
+			return true;
+		}
+		// until= erodes up to a total number of time steps, counting those a resumed map has already had
+		size_t nts = 100, until = 0, every = 100;
+		bool resume = true, skip = false, thermal = true, hydraulic = true;
+		float tolerance = 0.0f, Kt = 0.15f, Ka = 0.8f, Ki = 0.1f;
+		float Kc = 8.0f, Kd = 0.05f, Ks = 0.1f, Ke = 0.01f, W0 = 1.0f, Wmin = 0.01f;
+		if (!size_option(c, "steps", nts, error) || !size_option(c, "until", until, error) ||
+			!bool_option(c, "resume", resume, error) || !size_option(c, "every", every, error) ||
+			!float_option(c, "tolerance", tolerance, error) || !bool_option(c, "skip", skip, error) ||
+			!bool_option(c, "thermal", thermal, error) || !float_option(c, "Kt", Kt, error) ||
+			!float_option(c, "Ka", Ka, error) || !float_option(c, "Ki", Ki, error) ||
+			!bool_option(c, "hydraulic", hydraulic, error) || !float_option(c, "Kc", Kc, error) ||
+			!float_option(c, "Kd", Kd, error) || !float_option(c, "Ks", Ks, error) ||
+			!float_option(c, "Ke", Ke, error) || !float_option(c, "W0", W0, error) ||
+			!float_option(c, "Wmin", Wmin, error)) {
+			return false;
+		}
+		// Settled blocks are only found by measuring each time step against the tolerance
+		if (skip && !(tolerance > 0.0f)) {
+			error = "skip=yes needs a tolerance for " + std::string(c.spec->usage);
+			return false;
+		}
+		// Checkpoints keep the water and sediment levels, which only the native format can hold
+		std::string checkpoint;
+		Options::const_iterator it = c.options.find("checkpoint");
+		if (it != c.options.end()) {
+			checkpoint = it->second;
+			if (checkpoint.size() < 4 || checkpoint.compare(checkpoint.size() - 4, 4, ".fhm") || !every) {
+				error = "invalid checkpoint '" + checkpoint + "' for " + c.spec->usage;
+				return false;
+			}
+		}
+		if (!hm) { return true; }
+		if (!resume) { hm->discard_erosion(); }
+		if (c.options.count("until")) { nts = until > hm->erosion_steps() ? until - hm->erosion_steps() : 0; }
+		// Erosion continues from its own water and sediment, so running it a checkpoint's worth of steps at a time
+		// gives the same map as running it all at once; a map that has already had until= steps is left as it is
+		while (nts) {
+			size_t n = checkpoint.empty() ? nts : MIN(nts, every), steps = hm->erosion_steps();
+			if (!hm->erode(n, thermal, Kt, Ka, Ki, hydraulic, Kc, Kd, Ks, Ke, W0, Wmin, tolerance, skip, p)) {
+				error = "could not erode";
+				return false;
+			}
+			// Adaptive erosion may stop before running all of its steps
+			bool converged = hm->erosion_steps() - steps < n;
+			nts = converged ? 0 : nts - n;
+			if (!checkpoint.empty() && !hm->save(checkpoint.c_str(), GRAYSCALE, p)) {
+				error = "could not save checkpoint " + checkpoint;
+				return false;
+			}
+			if (converged && p) {
+				std::ostringstream ss;
+				ss << "Converged after " << hm->erosion_steps() << " steps (largest change " <<
+					hm->erosion_max_delta() << ", RMS " << hm->erosion_rms_delta() << ")";
+				p->message(ss.str().c_str());
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	std::ios::sync_with_stdio(false);
+	bool quiet = false, report = false;
+	unsigned int seed = (unsigned int)time(NULL);
+	const char *pipeline = NULL, *trace = NULL;
+	int ai = 1;
+	for (; ai < argc && argv[ai][0] == '-'; ai++) {
+		std::string flag = argv[ai];
+		if (flag == "-q") { quiet = true; continue; }
+		if (flag == "-p") { report = true; continue; }
+		if (flag == "-h" || flag == "--help") { usage(argv[0]); return EXIT_SUCCESS; }
+		if (ai + 1 >= argc) { usage(argv[0]); return EXIT_FAILURE; }
+		size_t v;
+		if (flag == "-f") { pipeline = argv[++ai]; }
+		else if (flag == "-d") { scratch_directory(argv[++ai]); }
+		else if (flag == "-j") { trace = argv[++ai]; }
+		else if (flag == "-m" && parse_size(argv[ai + 1], v) && v) { memory_budget(v << 20); ai++; }
+		else if (flag == "-s" && parse_size(argv[ai + 1], v)) { seed = (unsigned int)v; ai++; }
+		else if (flag == "-t" && parse_size(argv[ai + 1], v)) { thread_count(v); ai++; }
+		else { usage(argv[0]); return EXIT_FAILURE; }
+	}
+	Tokens tokens;
+	if (pipeline) {
+		if (ai < argc) { usage(argv[0]); return EXIT_FAILURE; }
+		if (!read_pipeline(pipeline, tokens)) {
+			std::cerr << "Error: could not read " << pipeline << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	else {
+		for (; ai < argc; ai++) { tokens.push_back(argv[ai]); }
+	}
+	if (tokens.empty()) { usage(argv[0]); return EXIT_FAILURE; }
+	// Validate the whole pipeline before running any of it
+	std::vector<Command> commands;
+	std::string error;
+	if (!parse_commands(tokens, commands, error)) {
+		std::cerr << "Error: " << error << std::endl;
+		return EXIT_FAILURE;
+	}
+	bool opened = false;
+	for (std::vector<Command>::const_iterator it = commands.begin(); it != commands.end(); ++it) {
+		std::string name = it->spec->name;
+		if (!run_command(*it, NULL, 0, NULL, error)) {
+			std::cerr << "Error: " << error << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (name == "new" || name == "open") { opened = true; }
+		else if (!opened) {
+			std::cerr << "Error: " << name << " needs a DTED from new or open first" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	Heightmap hm;
+	Console_Progress cp(quiet);
+	for (size_t i = 0; i < commands.size(); i++) {
+		const Command &c = commands[i];
+		if (!quiet) {
+			std::cout << "[" << (i + 1) << "/" << commands.size() << "] " << c.spec->name;
+			for (Tokens::const_iterator it = c.args.begin(); it != c.args.end(); ++it) { std::cout << " " << *it; }
+			for (Options::const_iterator it = c.options.begin(); it != c.options.end(); ++it) {
+				std::cout << " " << it->first << "=" << it->second;
+			}
+			std::cout << std::endl;
+		}
+		// Each command's default seed comes from the run's seed and the command's position in the pipeline
+		if (!run_command(c, &hm, (unsigned int)random_bits(seed, 0, i), &cp, error)) {
+			std::cerr << "Error: " << error << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (!quiet) {
+			std::cout << hm.width() << "x" << hm.height() << ", " << hm.known_elevations() << " known elevations" <<
+				std::endl;
+		}
+	}
+	if (report) { std::cout << stage_report() << std::flush; }
+	if (trace && !save_stage_trace(trace)) {
+		std::cerr << "Error: could not save " << trace << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,344 @@
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+
+#ifdef _WIN32
+#pragma warning(push, 0)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#pragma warning(pop)
+#else
+#include <sys/resource.h>
+#endif
+
+#include "metadata.h"
+#include "algebra.h"
+#include "draw-state.h"
+#include "heightmap.h"
+#include "mapped-memory.h"
+#include "parallel.h"
+#include "stage-timer.h"
+
+// Benchmark front end: runs each Heightmap operation on the bundled input heightmaps and on synthetic maps, across
+// thread counts, and reports every timed stage's throughput along with each case's peak memory. A process's peak
+// memory only ever grows, so each case runs in a child process of its own, started as this program with -c CASE; the
+// child prints its report and writes its stages to the -o file for the parent to collect.
+
+static const char *BUNDLED_INPUTS[] = {
+	"mt-washington-usgs-dem.png", "world.png", "Stewart Island 25m DEM_0.png", "fictional-planet-pern-holes.png",
+	"heightmap.png"
+};
+
+static const size_t NUM_BUNDLED_INPUTS = sizeof(BUNDLED_INPUTS) / sizeof(BUNDLED_INPUTS[0]);
+
+// Synthetic maps are 2^n+1 columns square, the sizes diamond-square interpolates most evenly
+static const size_t SYNTHETIC_SIZES[] = {513, 1025, 2049, 4097, 8193};
+
+static const size_t NUM_SYNTHETIC_SIZES = sizeof(SYNTHETIC_SIZES) / sizeof(SYNTHETIC_SIZES[0]);
+
+// Every operation is seeded the same, so runs are comparable
+static const unsigned int BENCHMARK_SEED = 1;
+
+// A heightmap file to open, or a synthetic size to create and interpolate when the filename is empty
+struct Case {
+	std::string name, filename;
+	size_t size;
+};
+
+struct Result {
+	std::string name;
+	size_t width, height, threads, run;
+	Stage_Record stage;
+	double peak_rss;
+};
+
+static void usage(const char *program) {
+	std::cout << TERRAIN_PROGRAM_NAME " " TERRAIN_VERSION_STRING " benchmark\n\n"
+		"Usage: " << program << " [OPTIONS] [FILE...]\n\n"
+		"Opens each FILE, or the bundled input heightmaps, and creates synthetic maps up to the largest size, then\n"
+		"times each operation on them with each thread count.\n\n"
+		"Options:\n"
+		"  -d DIRECTORY directory for scratch files (default: the system's temporary directory)\n"
+		"  -e STEPS     erosion time steps (default: 10)\n"
+		"  -i DIRECTORY directory of the bundled input heightmaps (default: input)\n"
+		"  -m SIZE      largest synthetic map size (default: 8193; 0 for none)\n"
+		"  -o RESULTS   write the results as CSV, or as JSON if RESULTS ends in .json\n"
+		"  -r RUNS      number of times to run each case (default: 1)\n"
+		"  -t THREADS   comma-separated thread counts (default: 1 and powers of two up to one per core)\n"
+		<< std::flush;
+}
+
+static bool parse_size(const std::string &s, size_t &v) {
+	char *end;
+	unsigned long n = strtoul(s.c_str(), &end, 10);
+	if (s.empty() || *end || s[0] == '-') { return false; }
+	v = (size_t)n;
+	return true;
+}
+
+static bool parse_sizes(const std::string &s, std::vector<size_t> &vs) {
+	std::istringstream ss(s);
+	std::string item;
+	vs.clear();
+	while (std::getline(ss, item, ',')) {
+		size_t v;
+		if (!parse_size(item, v) || !v) { return false; }
+		vs.push_back(v);
+	}
+	return !vs.empty();
+}
+
+static double peak_rss() {
+	// Peak resident memory of the whole process so far, in megabytes
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) { return 0.0; }
+	return counters.PeakWorkingSetSize / 1048576.0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) { return 0.0; }
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1048576.0;
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+static bool run_case(const Case &c, size_t steps, size_t max_size, const std::string &scratch, size_t &w, size_t &h) {
+	// Load or generate the map, then decimate and re-interpolate it, erode it, recalculate its normals, save it,
+	// and expand it if that stays within the largest synthetic size
+	Heightmap hm;
+	unsigned int seed = BENCHMARK_SEED;
+	if (c.filename.empty()) {
+		if (!hm.create(c.size, c.size) || !hm.interpolate(false, 0.4f, true, 1.0f, 0.0f, 1.0f, seed)) { return false; }
+	}
+	else if (!hm.open(c.filename.c_str(), seed)) { return false; }
+	w = hm.width(); h = hm.height();
+	if (!hm.calculate_normals()) { return false; }
+	if (!hm.decimate(true, 0.5, seed)) { return false; }
+	if (!hm.interpolate(true, 0.4f, true, 1.0f, 0.0f, 1.0f, seed)) { return false; }
+	if (!hm.erode(steps, true, 0.15f, 0.8f, 0.1f, true, 8.0f, 0.05f, 0.1f, 0.01f, 1.0f, 0.01f, 0.0f, false)) {
+		return false;
+	}
+	if (!hm.calculate_normals()) { return false; }
+	if (!hm.save(scratch.c_str(), GRAYSCALE)) { return false; }
+	remove(scratch.c_str());
+	if ((2 * w - 1) * (2 * h - 1) <= max_size * max_size && !hm.expand(1)) { return false; }
+	return true;
+}
+
+static std::string quote_argument(const std::string &s) {
+	// Quote an argument for the system's command interpreter
+#ifdef _WIN32
+	return "\"" + s + "\"";
+#else
+	std::string quoted = "'";
+	for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+		if (*it == '\'') { quoted += "'\\''"; }
+		else { quoted += *it; }
+	}
+	return quoted + "'";
+#endif
+}
+
+static bool run_command(const std::string &command) {
+	std::cout << std::flush;
+#ifdef _WIN32
+	// cmd.exe strips the first and last quotes from a command that starts with one
+	return system(("\"" + command + "\"").c_str()) == 0;
+#else
+	return system(command.c_str()) == 0;
+#endif
+}
+
+static bool save_case_records(const char *filename, size_t w, size_t h, double peak) {
+	// The map's size and the peak memory, then one tab-separated line per stage, ending with its name
+	std::ofstream file(filename);
+	if (!file) { return false; }
+	file << std::setprecision(17) << w << " " << h << " " << peak << "\n";
+	std::vector<Stage_Record> records = stage_records();
+	for (std::vector<Stage_Record>::const_iterator it = records.begin(); it != records.end(); ++it) {
+		file << it->start << "\t" << it->duration << "\t" << it->cells << "\t" << it->bytes << "\t" << it->thread <<
+			"\t" << it->depth << "\t" << it->name << "\n";
+	}
+	return !!file;
+}
+
+static bool load_case_records(const char *filename, Result r, std::vector<Result> &results) {
+	std::ifstream file(filename);
+	if (!(file >> r.width >> r.height >> r.peak_rss)) { return false; }
+	std::string line;
+	std::getline(file, line);
+	while (std::getline(file, line)) {
+		std::istringstream ss(line);
+		Stage_Record &s = r.stage;
+		if (!(ss >> s.start >> s.duration >> s.cells >> s.bytes >> s.thread >> s.depth)) { return false; }
+		ss.get();
+		std::getline(ss, s.name);
+		results.push_back(r);
+	}
+	return true;
+}
+
+static std::string csv_string(const std::string &s) {
+	std::string quoted = "\"";
+	for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+		if (*it == '"') { quoted += '"'; }
+		quoted += *it;
+	}
+	return quoted + "\"";
+}
+
+static std::string json_string(const std::string &s) {
+	std::string quoted = "\"";
+	for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+		if (*it == '"' || *it == '\\') { quoted += '\\'; }
+		quoted += *it;
+	}
+	return quoted + "\"";
+}
+
+static double throughput(const Stage_Record &r) {
+	// Millions of columns per second
+	return r.duration > 0.0 ? r.cells / r.duration : 0.0;
+}
+
+static bool save_results(const char *filename, const std::vector<Result> &results) {
+	std::string fn = filename;
+	bool json = fn.size() >= 5 && fn.compare(fn.size() - 5, 5, ".json") == 0;
+	std::ofstream file(filename);
+	if (!file) { return false; }
+	file << std::fixed << std::setprecision(3);
+	if (json) { file << "[\n"; }
+	else { file << "input,width,height,threads,run,stage,depth,ms,columns,mcolumns_per_s,bytes,peak_rss_mb\n"; }
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		const Stage_Record &s = r.stage;
+		if (json) {
+			file << "{\"input\":" << json_string(r.name) << ",\"width\":" << r.width << ",\"height\":" << r.height <<
+				",\"threads\":" << r.threads << ",\"run\":" << r.run << ",\"stage\":" << json_string(s.name) <<
+				",\"depth\":" << s.depth << ",\"ms\":" << s.duration / 1000.0 << ",\"columns\":" << s.cells <<
+				",\"mcolumns_per_s\":" << throughput(s) << ",\"bytes\":" << s.bytes << ",\"peak_rss_mb\":" <<
+				r.peak_rss << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		else {
+			file << csv_string(r.name) << "," << r.width << "," << r.height << "," << r.threads << "," << r.run <<
+				"," << csv_string(s.name) << "," << s.depth << "," << s.duration / 1000.0 << "," << s.cells << "," <<
+				throughput(s) << "," << s.bytes << "," << r.peak_rss << "\n";
+		}
+	}
+	if (json) { file << "]\n"; }
+	return !!file;
+}
+
+int main(int argc, char **argv) {
+	std::ios::sync_with_stdio(false);
+	std::string input_directory = "input";
+	const char *results_filename = NULL;
+	size_t steps = 10, max_size = 8193, runs = 1, child_case = 0;
+	bool child = false;
+	std::vector<size_t> thread_counts;
+	int ai = 1;
+	for (; ai < argc && argv[ai][0] == '-'; ai++) {
+		std::string flag = argv[ai];
+		if (flag == "-h" || flag == "--help") { usage(argv[0]); return EXIT_SUCCESS; }
+		if (ai + 1 >= argc) { usage(argv[0]); return EXIT_FAILURE; }
+		std::string value = argv[++ai];
+		if (flag == "-c" && parse_size(value, child_case)) { child = true; }
+		else if (flag == "-d") { scratch_directory(value.c_str()); }
+		else if (flag == "-e" && parse_size(value, steps)) {}
+		else if (flag == "-i") { input_directory = value; }
+		else if (flag == "-m" && parse_size(value, max_size)) {}
+		else if (flag == "-o") { results_filename = argv[ai]; }
+		else if (flag == "-r" && parse_size(value, runs) && runs) {}
+		else if (flag == "-t" && parse_sizes(value, thread_counts)) {}
+		else { usage(argv[0]); return EXIT_FAILURE; }
+	}
+	if (thread_counts.empty()) {
+		size_t cores = MAX((size_t)std::thread::hardware_concurrency(), (size_t)1);
+		for (size_t n = 1; n < cores; n *= 2) { thread_counts.push_back(n); }
+		thread_counts.push_back(cores);
+	}
+	std::vector<std::string> files;
+	std::vector<Case> cases;
+	for (; ai < argc; ai++) {
+		Case c = {argv[ai], argv[ai], 0};
+		files.push_back(argv[ai]);
+		cases.push_back(c);
+	}
+	if (cases.empty()) {
+		for (size_t i = 0; i < NUM_BUNDLED_INPUTS; i++) {
+			Case c = {BUNDLED_INPUTS[i], input_directory + "/" + BUNDLED_INPUTS[i], 0};
+			cases.push_back(c);
+		}
+	}
+	for (size_t i = 0; i < NUM_SYNTHETIC_SIZES && SYNTHETIC_SIZES[i] <= max_size; i++) {
+		std::ostringstream ss;
+		ss << "synthetic " << SYNTHETIC_SIZES[i];
+		Case c = {ss.str(), "", SYNTHETIC_SIZES[i]};
+		cases.push_back(c);
+	}
+	std::string scratch = scratch_directory();
+	scratch += scratch.empty() ? "frontier-benchmark" : "/frontier-benchmark";
+	if (child) {
+		// Run one case with the first thread count, then report its stages and this process's peak memory
+		if (child_case >= cases.size() || !results_filename) { return EXIT_FAILURE; }
+		const Case &c = cases[child_case];
+		thread_count(thread_counts[0]);
+		size_t w = 0, h = 0;
+		if (!run_case(c, steps, max_size, scratch + ".png", w, h)) {
+			std::cerr << "Error: could not benchmark " << c.name << std::endl;
+			return EXIT_FAILURE;
+		}
+		double peak = peak_rss();
+		std::cout << stage_report() << "peak memory: " << std::fixed << std::setprecision(1) << peak << " MB" <<
+			std::endl;
+		return save_case_records(results_filename, w, h, peak) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	// Children are given the same inputs, so they list the same cases
+	std::string records_filename = scratch + "-records.txt";
+	std::ostringstream common;
+	common << " -e " << steps << " -m " << max_size << " -i " << quote_argument(input_directory) << " -o " <<
+		quote_argument(records_filename);
+	if (*scratch_directory()) { common << " -d " << quote_argument(scratch_directory()); }
+	std::ostringstream inputs;
+	for (std::vector<std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+		inputs << " " << quote_argument(*it);
+	}
+	std::vector<Result> results;
+	bool success = true;
+	for (size_t ci = 0; ci < cases.size(); ci++) {
+		const Case &c = cases[ci];
+		for (size_t ti = 0; ti < thread_counts.size(); ti++) {
+			for (size_t run = 1; run <= runs; run++) {
+				std::cout << c.name << ", " << thread_counts[ti] << (thread_counts[ti] == 1 ? " thread" : " threads");
+				if (runs > 1) { std::cout << ", run " << run; }
+				std::cout << std::endl;
+				std::ostringstream command;
+				command << quote_argument(argv[0]) << " -c " << ci << " -t " << thread_counts[ti] << common.str() <<
+					inputs.str();
+				Result r = {c.name, 0, 0, thread_counts[ti], run, Stage_Record(), 0.0};
+				remove(records_filename.c_str());
+				if (!run_command(command.str()) || !load_case_records(records_filename.c_str(), r, results)) {
+					std::cerr << "Error: could not benchmark " << c.name << std::endl;
+					success = false;
+					break;
+				}
+			}
+		}
+	}
+	remove(records_filename.c_str());
+	if (results_filename && !save_results(results_filename, results)) {
+		std::cerr << "Error: could not save " << results_filename << std::endl;
+		return EXIT_FAILURE;
+	}
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,417 @@
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define EROSION_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include "algebra.h"
+#include "heightmap.h"
+#include "erosion.h"
+
+// Talus slides down any slope whose angle atan2(diff, distance) reaches atan(talus_slope), which is the same as
+// diff >= talus_slope * distance, so no trigonometry is needed per neighbor
+static const float ORTHOGONAL_DISTANCE = 1.0f / 255.0f;
+static const float DIAGONAL_DISTANCE = (float)SQRT_2 / 255.0f; // corners are more distant
+
+static inline float elevation_diff(const Erosion_Buffers &eb, size_t i, size_t j, bool corner, bool &steep) {
+	// How far column i is above column j, and whether talus can slide from i to j
+	float diff = eb.elevations[i] - eb.elevations[j];
+	steep = diff >= eb.talus_slopes[i] * (corner ? DIAGONAL_DISTANCE : ORTHOGONAL_DISTANCE);
+	return diff;
+}
+
+static void outflow_cell(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t x, size_t y) {
+	// Total the elevation differences from a column to its lower neighbors
+	size_t w = eb.width, h = eb.height, i = y * w + x;
+	float total_elevation_diff = 0.0f, total_talus_diff = 0.0f, max_elevation_diff = 0.0f;
+	for (int dy = -1; dy <= 1; dy++) {
+		if ((y == 0 && dy == -1) || (y == h - 1 && dy == 1)) { continue; }
+		for (int dx = -1; dx <= 1; dx++) {
+			if ((x == 0 && dx == -1) || (x == w - 1 && dx == 1) || (dy == 0 && dx == 0)) { continue; }
+			bool steep;
+			float diff = elevation_diff(eb, i, (y + dy) * w + (x + dx), dx && dy, steep);
+			if (diff <= 0.0f) { continue; }
+			total_elevation_diff += diff;
+			if (steep) {
+				if (diff > max_elevation_diff) { max_elevation_diff = diff; }
+				total_talus_diff += diff;
+			}
+		}
+	}
+	eb.total_elevation_diffs[i] = total_elevation_diff;
+	eb.total_talus_diffs[i] = total_talus_diff;
+	eb.taluses[i] = ep.thermal && total_talus_diff > 0.0f ?
+		ep.Kt * (1.0f - eb.hardnesses[i]) * max_elevation_diff / 2.0f : 0.0f;
+}
+
+static void delta_cell(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t x, size_t y) {
+	// Gather the material that a column and its neighbors move into it. Contributions are visited in the order that a
+	// row-major sweep would scatter them, so results do not depend on how rows are divided between threads.
+	size_t w = eb.width, h = eb.height, i = y * w + x;
+	float elevation_delta = 0.0f, water_delta_sum = 0.0f, sediment_delta_sum = 0.0f;
+	for (int sy = -1; sy <= 1; sy++) {
+		if ((y == 0 && sy == -1) || (y == h - 1 && sy == 1)) { continue; }
+		for (int sx = -1; sx <= 1; sx++) {
+			if ((x == 0 && sx == -1) || (x == w - 1 && sx == 1)) { continue; }
+			size_t s = (y + sy) * w + (x + sx);
+			bool deposit = eb.total_elevation_diffs[s] <= 0.0f || eb.water_map[s] == 0.0f;
+			if (s == i) {
+				// Thermal erosion: remove talus from column
+				if (ep.thermal) {
+					elevation_delta -= eb.taluses[i];
+				}
+				// Hydraulic erosion
+				if (!ep.hydraulic) { continue; }
+				if (deposit) {
+					// Deposit sediment on column
+					float sediment_delta = ep.Kd * eb.sediment_map[i];
+					elevation_delta += sediment_delta;
+					sediment_delta_sum -= sediment_delta;
+					continue;
+				}
+				// Move materials to each neighbor
+				for (int dy = -1; dy <= 1; dy++) {
+					if ((y == 0 && dy == -1) || (y == h - 1 && dy == 1)) { continue; }
+					for (int dx = -1; dx <= 1; dx++) {
+						if ((x == 0 && dx == -1) || (x == w - 1 && dx == 1) || (dy == 0 && dx == 0)) { continue; }
+						size_t j = (y + dy) * w + (x + dx);
+						bool steep;
+						float diff = elevation_diff(eb, i, j, dx && dy, steep);
+						if (diff <= 0.0f) { continue; }
+						float water_diff = eb.water_map[i] - eb.water_map[j];
+						float neighbor_proportion = diff / eb.total_elevation_diffs[i];
+						// Flow water to neighbor
+						float water_delta = neighbor_proportion * (diff + water_diff);
+						if (water_delta > eb.water_map[i]) { water_delta = eb.water_map[i]; }
+						water_delta_sum -= water_delta;
+						// Transport and/or deposit sediment
+						float sediment_capacity = ep.Kc * water_delta;
+						if (eb.sediment_map[i] >= sediment_capacity) {
+							// Transport water's capacity of sediment to neighbor; deposit excess on column
+							float sediment_deposited = ep.Kd * (neighbor_proportion * eb.sediment_map[i] - sediment_capacity);
+							elevation_delta += sediment_deposited * HYDRAULIC_CORRECTION;
+							sediment_delta_sum -= sediment_capacity + sediment_deposited;
+						}
+						else {
+							// Transport sediment to neighbor; dissolve soil into water's excess capacity
+							float sediment_transported = neighbor_proportion * eb.sediment_map[i];
+							float soil_dissolved = ep.Ks * eb.solubilities[i] * (sediment_capacity - sediment_transported);
+							elevation_delta -= soil_dissolved * HYDRAULIC_CORRECTION;
+							sediment_delta_sum -= sediment_transported;
+						}
+					}
+				}
+				continue;
+			}
+			bool steep;
+			float diff = elevation_diff(eb, s, i, sx && sy, steep);
+			if (diff <= 0.0f) { continue; }
+			// Thermal erosion: receive talus from neighbor in proportion to its talus differences
+			// (lower neighbors that are not steep enough for talus receive a negative share)
+			if (ep.thermal && eb.total_talus_diffs[s] > 0.0f) {
+				float neighbor_proportion = (steep ? diff : -diff) / eb.total_talus_diffs[s];
+				elevation_delta += eb.taluses[s] * neighbor_proportion;
+			}
+			// Hydraulic erosion: receive water and sediment from neighbor
+			if (!ep.hydraulic || deposit) { continue; }
+			float water_diff = eb.water_map[s] - eb.water_map[i];
+			float neighbor_proportion = diff / eb.total_elevation_diffs[s];
+			float water_delta = neighbor_proportion * (diff + water_diff);
+			if (water_delta > eb.water_map[s]) { water_delta = eb.water_map[s]; }
+			water_delta_sum += water_delta;
+			float sediment_capacity = ep.Kc * water_delta;
+			if (eb.sediment_map[s] >= sediment_capacity) {
+				sediment_delta_sum += sediment_capacity;
+			}
+			else {
+				float sediment_transported = neighbor_proportion * eb.sediment_map[s];
+				float soil_dissolved = ep.Ks * eb.solubilities[s] * (sediment_capacity - sediment_transported);
+				sediment_delta_sum += sediment_transported + soil_dissolved;
+			}
+		}
+	}
+	eb.elevation_deltas[i] = elevation_delta;
+	eb.water_deltas[i] = water_delta_sum;
+	eb.sediment_deltas[i] = sediment_delta_sum;
+}
+
+#ifdef EROSION_SSE2
+
+// The SSE2 kernels below handle four interior columns at once. They perform the same floating-point operations in the
+// same order as the scalar kernels, masking out contributions that the scalar kernels skip, so both produce the same
+// results.
+
+static bool cpu_has_sse2() {
+#if defined(_M_IX86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return true; // SSE2 is part of x86-64, and GCC only defines __SSE2__ when it may be used
+#endif
+}
+
+static const bool _use_sse2 = cpu_has_sse2();
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 negate_ps(__m128 v) {
+	return _mm_xor_ps(v, _mm_set1_ps(-0.0f));
+}
+
+static void outflow_cells_sse2(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t i) {
+	ptrdiff_t w = (ptrdiff_t)eb.width;
+	const float *e = eb.elevations + i;
+	__m128 zero = _mm_setzero_ps();
+	__m128 ch = _mm_loadu_ps(e);
+	__m128 talus_slope = _mm_loadu_ps(eb.talus_slopes + i);
+	__m128 orthogonal = _mm_mul_ps(talus_slope, _mm_set1_ps(ORTHOGONAL_DISTANCE));
+	__m128 diagonal = _mm_mul_ps(talus_slope, _mm_set1_ps(DIAGONAL_DISTANCE));
+	__m128 total_elevation_diff = zero, total_talus_diff = zero, max_elevation_diff = zero;
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			if (dy == 0 && dx == 0) { continue; }
+			__m128 diff = _mm_sub_ps(ch, _mm_loadu_ps(e + dy * w + dx));
+			__m128 lower = _mm_cmpgt_ps(diff, zero);
+			__m128 steep = _mm_and_ps(lower, _mm_cmpge_ps(diff, dx && dy ? diagonal : orthogonal));
+			__m128 talus_diff = _mm_and_ps(steep, diff);
+			total_elevation_diff = _mm_add_ps(total_elevation_diff, _mm_and_ps(lower, diff));
+			total_talus_diff = _mm_add_ps(total_talus_diff, talus_diff);
+			max_elevation_diff = _mm_max_ps(max_elevation_diff, talus_diff);
+		}
+	}
+	_mm_storeu_ps(eb.total_elevation_diffs + i, total_elevation_diff);
+	_mm_storeu_ps(eb.total_talus_diffs + i, total_talus_diff);
+	__m128 talus = zero;
+	if (ep.thermal) {
+		talus = _mm_mul_ps(_mm_set1_ps(ep.Kt), _mm_sub_ps(_mm_set1_ps(1.0f), _mm_loadu_ps(eb.hardnesses + i)));
+		talus = _mm_div_ps(_mm_mul_ps(talus, max_elevation_diff), _mm_set1_ps(2.0f));
+		talus = _mm_and_ps(_mm_cmpgt_ps(total_talus_diff, zero), talus);
+	}
+	_mm_storeu_ps(eb.taluses + i, talus);
+}
+
+static void delta_cells_sse2(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t i) {
+	ptrdiff_t w = (ptrdiff_t)eb.width;
+	const float *e = eb.elevations + i;
+	__m128 zero = _mm_setzero_ps();
+	__m128 orthogonal = _mm_set1_ps(ORTHOGONAL_DISTANCE), diagonal = _mm_set1_ps(DIAGONAL_DISTANCE);
+	__m128 Kc = _mm_set1_ps(ep.Kc), Kd = _mm_set1_ps(ep.Kd), Ks = _mm_set1_ps(ep.Ks);
+	__m128 correction = _mm_set1_ps((float)HYDRAULIC_CORRECTION);
+	__m128 ch = _mm_loadu_ps(e);
+	__m128 water = _mm_loadu_ps(eb.water_map + i);
+	__m128 elevation_delta = zero, water_delta_sum = zero, sediment_delta_sum = zero;
+	for (int sy = -1; sy <= 1; sy++) {
+		for (int sx = -1; sx <= 1; sx++) {
+			if (sy == 0 && sx == 0) {
+				// Thermal erosion: remove talus from columns
+				if (ep.thermal) {
+					elevation_delta = _mm_sub_ps(elevation_delta, _mm_loadu_ps(eb.taluses + i));
+				}
+				// Hydraulic erosion
+				if (!ep.hydraulic) { continue; }
+				__m128 sediment = _mm_loadu_ps(eb.sediment_map + i);
+				__m128 total = _mm_loadu_ps(eb.total_elevation_diffs + i);
+				__m128 deposit = _mm_or_ps(_mm_cmple_ps(total, zero), _mm_cmpeq_ps(water, zero));
+				// Deposit sediment on columns with no outflow
+				__m128 sediment_delta = _mm_and_ps(deposit, _mm_mul_ps(Kd, sediment));
+				elevation_delta = _mm_add_ps(elevation_delta, sediment_delta);
+				sediment_delta_sum = _mm_sub_ps(sediment_delta_sum, sediment_delta);
+				if (_mm_movemask_ps(deposit) == 0xF) { continue; }
+				// Move materials from the other columns to each neighbor
+				__m128 solubility = _mm_loadu_ps(eb.solubilities + i);
+				for (int dy = -1; dy <= 1; dy++) {
+					for (int dx = -1; dx <= 1; dx++) {
+						if (dy == 0 && dx == 0) { continue; }
+						ptrdiff_t o = dy * w + dx;
+						__m128 diff = _mm_sub_ps(ch, _mm_loadu_ps(e + o));
+						__m128 flow = _mm_andnot_ps(deposit, _mm_cmpgt_ps(diff, zero));
+						__m128 water_diff = _mm_sub_ps(water, _mm_loadu_ps(eb.water_map + i + o));
+						__m128 neighbor_proportion = _mm_div_ps(diff, total);
+						__m128 water_delta = _mm_min_ps(_mm_mul_ps(neighbor_proportion, _mm_add_ps(diff, water_diff)), water);
+						water_delta_sum = _mm_sub_ps(water_delta_sum, _mm_and_ps(flow, water_delta));
+						__m128 sediment_capacity = _mm_mul_ps(Kc, water_delta);
+						__m128 transported = _mm_mul_ps(neighbor_proportion, sediment);
+						__m128 deposited = _mm_mul_ps(Kd, _mm_sub_ps(transported, sediment_capacity));
+						__m128 dissolved = _mm_mul_ps(_mm_mul_ps(Ks, solubility), _mm_sub_ps(sediment_capacity, transported));
+						__m128 excess = _mm_cmpge_ps(sediment, sediment_capacity);
+						elevation_delta = _mm_add_ps(elevation_delta, _mm_and_ps(flow, select_ps(excess,
+							_mm_mul_ps(deposited, correction), negate_ps(_mm_mul_ps(dissolved, correction)))));
+						sediment_delta_sum = _mm_sub_ps(sediment_delta_sum, _mm_and_ps(flow, select_ps(excess,
+							_mm_add_ps(sediment_capacity, deposited), transported)));
+					}
+				}
+				continue;
+			}
+			size_t s = i + sy * w + sx;
+			__m128 diff = _mm_sub_ps(_mm_loadu_ps(e + sy * w + sx), ch);
+			__m128 lower = _mm_cmpgt_ps(diff, zero);
+			// Thermal erosion: receive talus from neighbors in proportion to their talus differences
+			if (ep.thermal) {
+				__m128 threshold = _mm_mul_ps(_mm_loadu_ps(eb.talus_slopes + s), sx && sy ? diagonal : orthogonal);
+				__m128 steep = _mm_cmpge_ps(diff, threshold);
+				__m128 total_talus = _mm_loadu_ps(eb.total_talus_diffs + s);
+				__m128 receive = _mm_and_ps(lower, _mm_cmpgt_ps(total_talus, zero));
+				__m128 neighbor_proportion = _mm_div_ps(select_ps(steep, diff, negate_ps(diff)), total_talus);
+				elevation_delta = _mm_add_ps(elevation_delta,
+					_mm_and_ps(receive, _mm_mul_ps(_mm_loadu_ps(eb.taluses + s), neighbor_proportion)));
+			}
+			// Hydraulic erosion: receive water and sediment from neighbors
+			if (!ep.hydraulic) { continue; }
+			__m128 neighbor_water = _mm_loadu_ps(eb.water_map + s);
+			__m128 neighbor_sediment = _mm_loadu_ps(eb.sediment_map + s);
+			__m128 total = _mm_loadu_ps(eb.total_elevation_diffs + s);
+			__m128 deposit = _mm_or_ps(_mm_cmple_ps(total, zero), _mm_cmpeq_ps(neighbor_water, zero));
+			__m128 flow = _mm_andnot_ps(deposit, lower);
+			__m128 water_diff = _mm_sub_ps(neighbor_water, water);
+			__m128 neighbor_proportion = _mm_div_ps(diff, total);
+			__m128 water_delta = _mm_min_ps(_mm_mul_ps(neighbor_proportion, _mm_add_ps(diff, water_diff)),
+				neighbor_water);
+			water_delta_sum = _mm_add_ps(water_delta_sum, _mm_and_ps(flow, water_delta));
+			__m128 sediment_capacity = _mm_mul_ps(Kc, water_delta);
+			__m128 transported = _mm_mul_ps(neighbor_proportion, neighbor_sediment);
+			__m128 dissolved = _mm_mul_ps(_mm_mul_ps(Ks, _mm_loadu_ps(eb.solubilities + s)),
+				_mm_sub_ps(sediment_capacity, transported));
+			__m128 excess = _mm_cmpge_ps(neighbor_sediment, sediment_capacity);
+			sediment_delta_sum = _mm_add_ps(sediment_delta_sum, _mm_and_ps(flow, select_ps(excess, sediment_capacity,
+				_mm_add_ps(transported, dissolved))));
+		}
+	}
+	_mm_storeu_ps(eb.elevation_deltas + i, elevation_delta);
+	_mm_storeu_ps(eb.water_deltas + i, water_delta_sum);
+	_mm_storeu_ps(eb.sediment_deltas + i, sediment_delta_sum);
+}
+
+#endif
+
+typedef void (*Cell_Kernel)(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t x, size_t y);
+typedef void (*Group_Kernel)(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t i);
+
+static void erosion_span(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y, size_t x0, size_t x1,
+	Cell_Kernel cell, Group_Kernel group) {
+	size_t w = eb.width, h = eb.height, x = x0;
+	size_t g0 = MAX(x0, (size_t)1), g1 = MIN(x1, w - 1);
+	if (group && y > 0 && y < h - 1 && g1 >= g0 + 4) {
+		// Border columns need bounds checks; interior columns are handled in groups of four, with the last group
+		// overlapping the previous one instead of leaving a remainder (recomputing a column is harmless)
+		for (; x < g0; x++) {
+			cell(eb, ep, x, y);
+		}
+		for (x = g0; x < g1; x += 4) {
+			group(eb, ep, y * w + MIN(x, g1 - 4));
+		}
+		x = g1;
+	}
+	for (; x < x1; x++) {
+		cell(eb, ep, x, y);
+	}
+}
+
+static void erosion_rows(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y0, size_t y1,
+	unsigned char min_state, Cell_Kernel cell, Group_Kernel group) {
+	size_t w = eb.width, blocks_x = (w + EROSION_BLOCK_SIZE - 1) / EROSION_BLOCK_SIZE;
+	for (size_t y = y0; y < y1; y++) {
+		if (!eb.active_blocks) {
+			erosion_span(eb, ep, y, 0, w, cell, group);
+			continue;
+		}
+		// Each run of neighboring blocks at min_state or above is one span, so groups of four can cross blocks
+		const unsigned char *active = eb.active_blocks + y / EROSION_BLOCK_SIZE * blocks_x;
+		for (size_t b0 = 0, b1; b0 < blocks_x; b0 = b1) {
+			for (b1 = b0; b1 < blocks_x && active[b1] >= min_state; b1++) {}
+			if (b1 > b0) {
+				erosion_span(eb, ep, y, b0 * EROSION_BLOCK_SIZE, MIN(b1 * EROSION_BLOCK_SIZE, w), cell, group);
+			}
+			else { b1++; }
+		}
+	}
+}
+
+void erosion_outflows(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y0, size_t y1) {
+#ifdef EROSION_SSE2
+	erosion_rows(eb, ep, y0, y1, EROSION_BLOCK_ACTIVE, outflow_cell, _use_sse2 ? outflow_cells_sse2 : NULL);
+#else
+	erosion_rows(eb, ep, y0, y1, EROSION_BLOCK_ACTIVE, outflow_cell, NULL);
+#endif
+}
+
+void erosion_deltas(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y0, size_t y1) {
+#ifdef EROSION_SSE2
+	erosion_rows(eb, ep, y0, y1, EROSION_BLOCK_BORDER, delta_cell, _use_sse2 ? delta_cells_sse2 : NULL);
+#else
+	erosion_rows(eb, ep, y0, y1, EROSION_BLOCK_BORDER, delta_cell, NULL);
+#endif
+}
+
+static bool droplet_sample(const float *elevations, size_t w, float x, float y, float &e, float &gx, float &gy) {
+	// Bilinearly interpolate the elevation and its gradient at (x, y) from the four columns around it
+	size_t cx = (size_t)x, cy = (size_t)y, i = cy * w + cx;
+	float u = x - cx, v = y - cy;
+	float nw = elevations[i], ne = elevations[i + 1], sw = elevations[i + w], se = elevations[i + w + 1];
+	if (nw == Heightmap::UNKNOWN_ELEVATION || ne == Heightmap::UNKNOWN_ELEVATION ||
+		sw == Heightmap::UNKNOWN_ELEVATION || se == Heightmap::UNKNOWN_ELEVATION) {
+		return false;
+	}
+	gx = (ne - nw) * (1.0f - v) + (se - sw) * v;
+	gy = (sw - nw) * (1.0f - u) + (se - ne) * u;
+	e = nw * (1.0f - u) * (1.0f - v) + ne * u * (1.0f - v) + sw * (1.0f - u) * v + se * u * v;
+	return true;
+}
+
+void erosion_droplet(float *elevations, size_t w, size_t h, const Droplet_Parameters &dp, float x, float y) {
+	// Droplet erosion after "Implementation of a method for hydraulic erosion" (Beyer, 2015): the droplet rolls
+	// downhill with some inertia, carrying as much sediment as its speed, water and the slope allow, and dissolves
+	// the ground under it when it can carry more, or deposits sediment when it carries too much or climbs
+	float dx = 0.0f, dy = 0.0f, speed = 1.0f, water = 1.0f, sediment = 0.0f;
+	for (size_t step = 0; step < dp.lifetime; step++) {
+		// Sample where the droplet is, which its own deposits or dissolving may have just changed
+		float e, gx, gy;
+		if (x < 0.0f || y < 0.0f || x >= (float)(w - 1) || y >= (float)(h - 1) ||
+			!droplet_sample(elevations, w, x, y, e, gx, gy)) {
+			return;
+		}
+		size_t cx = (size_t)x, cy = (size_t)y, i = cy * w + cx;
+		float u = x - cx, v = y - cy;
+		// Turn downhill, keeping some of the previous direction, and move one column's width
+		dx = dx * dp.inertia - gx * (1.0f - dp.inertia);
+		dy = dy * dp.inertia - gy * (1.0f - dp.inertia);
+		float length = sqrt(dx * dx + dy * dy);
+		if (length == 0.0f) { return; }
+		dx /= length; dy /= length;
+		x += dx; y += dy;
+		if (x < 0.0f || y < 0.0f || x >= (float)(w - 1) || y >= (float)(h - 1)) { return; }
+		float next_e, next_gx, next_gy;
+		if (!droplet_sample(elevations, w, x, y, next_e, next_gx, next_gy)) { return; }
+		float diff = next_e - e;
+		float capacity = MAX(-diff * speed * water * dp.capacity, dp.min_capacity);
+		float weights[4] = {(1.0f - u) * (1.0f - v), u * (1.0f - v), (1.0f - u) * v, u * v};
+		size_t corners[4] = {i, i + 1, i + w, i + w + 1};
+		if (diff > 0.0f || sediment > capacity) {
+			// Fill the pit it climbed out of, or drop a share of the excess, spread over the four columns it left
+			float deposited = diff > 0.0f ? MIN(diff, sediment) : (sediment - capacity) * dp.deposition;
+			sediment -= deposited;
+			for (int c = 0; c < 4; c++) {
+				elevations[corners[c]] += deposited * weights[c];
+			}
+		}
+		else {
+			// Dissolve a share of the spare capacity, never digging deeper than the drop it just made
+			float dissolved = MIN((capacity - sediment) * dp.dissolution, -diff);
+			for (int c = 0; c < 4; c++) {
+				float amount = MIN(dissolved * weights[c], elevations[corners[c]]);
+				elevations[corners[c]] -= amount;
+				sediment += amount;
+			}
+		}
+		speed = sqrt(MAX(speed * speed - diff * dp.gravity, 0.0f));
+		water *= 1.0f - dp.evaporation;
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdlib>
+
+#define HYDRAULIC_CORRECTION 50
+
+// Columns along each side of the square blocks that settled areas are skipped in
+#define EROSION_BLOCK_SIZE 32
+
+// States of those blocks: settled blocks are left alone, border blocks around the active ones only receive material,
+// and active blocks are simulated in full
+#define EROSION_BLOCK_SETTLED 0
+#define EROSION_BLOCK_BORDER 1
+#define EROSION_BLOCK_ACTIVE 2
+
+struct Erosion_Parameters {
+	bool thermal, hydraulic;
+	float Kt, Ka, Ki, Kc, Kd, Ks, Ke, W0, Wmin;
+};
+
+struct Droplet_Parameters {
+	size_t lifetime;
+	float inertia, capacity, min_capacity, deposition, dissolution, evaporation, gravity;
+};
+
+struct Erosion_Buffers {
+	size_t width, height;
+	// Column properties; elevations change every time step
+	float *elevations, *hardnesses, *solubilities, *talus_slopes;
+	// Persistent water and sediment levels
+	float *water_map, *sediment_map;
+	// Each column's outflow totals for the current time step
+	float *total_elevation_diffs, *total_talus_diffs, *taluses;
+	// Material deltas for the current time step
+	float *elevation_deltas, *water_deltas, *sediment_deltas;
+	// One state per block, row by row, of how its columns are simulated, or NULL to simulate every column in full
+	const unsigned char *active_blocks;
+};
+
+// Both passes handle rows [y0, y1) and only write to those rows, so bands of rows can run on separate threads.
+// Within each row, outflows are only found for the columns of active blocks, and deltas for those of active and border
+// blocks. Interior columns are handled four at a time with SSE2 when the CPU supports it.
+void erosion_outflows(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y0, size_t y1);
+void erosion_deltas(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y0, size_t y1);
+
+// Runs one water droplet from (x, y) down a w*h map of elevations until it evaporates, comes to rest, leaves the map
+// or reaches an unknown elevation, dissolving and depositing sediment on the four columns around it as it goes. It
+// moves one column's width per step, so it changes no column more than lifetime + 1 columns from where it started.
+void erosion_droplet(float *elevations, size_t w, size_t h, const Droplet_Parameters &dp, float x, float y);
@@ -6,11 +6,11 @@
 
 Open_DTED_Chooser::Open_DTED_Chooser() : Fl_Native_File_Chooser(Fl_Native_File_Chooser::BROWSE_FILE) {
 	title("Open DTED File");
-	filter("PNG File\t*.png\n");
+	filter("DTED Files\t*.{png,fhm,dem}\nPNG File\t*.png\nFrontier Heightmap\t*.fhm\nUSGS DEM\t*.dem\n");
 }
 
 Save_DTED_Chooser::Save_DTED_Chooser() : Fl_Native_File_Chooser(Fl_Native_File_Chooser::BROWSE_SAVE_FILE) {
 	title("Save DTED File");
-	filter("PNG File\t*.png\n");
+	filter("PNG File\t*.png\nFrontier Heightmap\t*.fhm\n");
 	preset_file("output.png");
 }
@@ -2,22 +2,22 @@
 #include <string>
 #include <algorithm>
 #include <iostream>
-#include <unordered_set>
-#include <unordered_map>
-#include <queue>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
 #include <png.h>
-#include <ZLIB.H>
-
-#pragma warning(push, 0)
-#include <FL/Fl.H>
-#include <FL/Fl_PNG_Image.H>
-#pragma warning(pop)
 
 #include "draw-state.h"
 #include "algebra.h"
 #include "heightmap.h"
-
-#define HYDRAULIC_CORRECTION 50
+#include "erosion.h"
+#include "mapped-memory.h"
+#include "parallel.h"
+#include "png-encoder.h"
+#include "random.h"
+#include "stage-timer.h"
+#include "usgs-dem.h"
 
 const float Heightmap::UNKNOWN_ELEVATION = -1.0f;
 
@@ -27,7 +27,39 @@ const float Heightmap::DERIVED_HARDNESS_VARIANCE = 0.08f;
 const float Heightmap::DEFAULT_SOLUBILITY = 0.04f;
 const float Heightmap::DERIVED_SOLUBILITY_VARIANCE = 0.08f;
 
-void column_color(Column &c, Color_Scheme cs, float *cv) {
+const size_t Heightmap::PLANE_ALIGNMENT = 64;
+const size_t Heightmap::RAW_PAGE_SIZE = 4096;
+
+// Talus slopes, three outflow totals and three material deltas
+static const size_t EROSION_WORK_PLANES = 7;
+// Water and sediment levels, kept between erosions
+static const size_t EROSION_LAYERS = 2;
+// Columns per batch of random decimation
+static const size_t DECIMATE_BATCH_COLUMNS = 1 << 20;
+// Samples per batch of a diamond-square step
+static const size_t DIAMOND_SQUARE_BATCH_SAMPLES = 1 << 20;
+// Columns per batch of normal calculation
+static const size_t NORMALS_BATCH_COLUMNS = 1 << 20;
+// Bytes of planes that each thread's share of an erosion sweep keeps in use at a time, about a core's share of cache
+static const size_t EROSION_SWEEP_BYTES = 2 << 20;
+// Most time steps advanced by each erosion sweep, and how many tiles each step trails the one before it
+static const size_t EROSION_SWEEP_STEPS = 4;
+static const size_t EROSION_STEP_LAG = 6;
+// Rows of each tile that each thread takes when sweeping one step at a time, so threads wait for one another less
+static const size_t EROSION_BAND_ROWS = 8;
+// Blocks settle once they change by less than this fraction of the erosion tolerance in a time step, so the changes
+// they would still have made while skipped stay well below what the tolerance allows
+static const float EROSION_SETTLED_FRACTION = 0.25f;
+// Smallest side of a tile of droplet erosion, and how many rounds the droplets are split into for progress reports
+static const size_t DROPLET_TILE_SIZE = 64;
+static const size_t DROPLET_ROUNDS = 16;
+// Sediment a droplet can always carry, even on flat ground, and how much a drop in elevation speeds it up
+static const float DROPLET_MIN_CAPACITY = 0.0001f;
+static const float DROPLET_GRAVITY = 4.0f;
+// Regions kept in a changed or stale list before it collapses to their bounding box
+static const size_t MAX_TRACKED_REGIONS = 64;
+
+void column_color(const Column &c, Color_Scheme cs, float *cv) {
 	if (c.elevation == Heightmap::UNKNOWN_ELEVATION) {
 		cv[0] = cv[1] = cv[2] = 0.0f;
 	}
@@ -46,45 +78,205 @@ void column_color(Column &c, Color_Scheme cs, float *cv) {
 	}
 }
 
-Heightmap::Heightmap() : _heightmap(NULL), _width(0), _height(0), _known_elevations(0) {}
+Heightmap::Heightmap() : _elevations(NULL), _hardnesses(NULL), _solubilities(NULL), _normals(NULL),
+	_water_levels(NULL), _sediment_levels(NULL), _mapping(NULL), _normals_mapping(NULL), _erosion_mapping(NULL),
+	_width(0), _height(0), _known_elevations(0), _erosion_steps(0), _erosion_max_delta(0.0f),
+	_erosion_rms_delta(0.0f), _normals_valid(false), _dirty_regions(), _stale_normals() {}
 
-static float random01() {
-	// Random float in [0, 1]
-	return (float)rand() / (float)(RAND_MAX - 1);
+Heightmap::~Heightmap() {
+	clear();
 }
 
-static float random11() {
-	// Random float in [-1, 1]
-	return (float)rand() * 2.0f / (float)(RAND_MAX - 1) - 1.0f;
-}
+// Random streams for each use of random numbers, all keyed by column index
+enum Random_Stream {
+	HARDNESS_STREAM, SOLUBILITY_STREAM, DECIMATE_STREAM, CORNER_STREAM, SQUARE_STREAM, DIAMOND_STREAM,
+	DROPLET_X_STREAM, DROPLET_Y_STREAM
+};
 
 static float clamp01(float v) {
 	// Clamp v to within [0, 1]
 	return v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v;
 }
 
+static void *new_plane(size_t n, size_t size) {
+	// Allocate a plane alignment more than needed and start the plane at the first aligned address past the block's
+	// start, which leaves room before it for a pointer to the block, since malloc aligns blocks for pointers
+	void *block = malloc(n * size + Heightmap::PLANE_ALIGNMENT);
+	if (!block) { return NULL; }
+	uintptr_t start = ((uintptr_t)block + Heightmap::PLANE_ALIGNMENT) & ~(uintptr_t)(Heightmap::PLANE_ALIGNMENT - 1);
+	void **plane = (void **)start;
+	plane[-1] = block;
+	count_allocation(n * size);
+	return plane;
+}
+
+static void delete_plane(void *plane) {
+	if (plane) { free(((void **)plane)[-1]); }
+}
+
+static unsigned long long page_align(unsigned long long offset) {
+	return (offset + Heightmap::RAW_PAGE_SIZE - 1) / Heightmap::RAW_PAGE_SIZE * Heightmap::RAW_PAGE_SIZE;
+}
+
+static float *new_work_planes(size_t n, size_t count, size_t &stride, Mapped_Memory &spill) {
+	// Zeroed, page-aligned working planes for one operation, spilled to a scratch file beyond the memory budget
+	stride = (size_t)page_align(n * sizeof(float)) / sizeof(float);
+	size_t bytes = stride * count * sizeof(float);
+	if (bytes <= memory_budget()) {
+		float *planes = (float *)new_plane(stride * count, sizeof(float));
+		if (planes) {
+			memset(planes, 0, bytes);
+			return planes;
+		}
+	}
+	return spill.map_scratch(bytes) ? (float *)spill.data() : NULL;
+}
+
+static void delete_work_planes(float *planes, const Mapped_Memory &spill) {
+	if (planes != spill.data()) { delete_plane(planes); }
+}
+
 void Heightmap::clear() {
-	if (_heightmap) { delete [] _heightmap; }
-	_heightmap = NULL;
+	discard_erosion();
+	if (_normals_mapping) { delete _normals_mapping; }
+	else if (!_mapping) { delete_plane(_normals); }
+	if (_mapping) { delete _mapping; }
+	else {
+		delete_plane(_elevations);
+		delete_plane(_hardnesses);
+		delete_plane(_solubilities);
+	}
+	_elevations = _hardnesses = _solubilities = NULL;
+	_normals = NULL;
+	_mapping = _normals_mapping = NULL;
 	_width = _height = _known_elevations = 0;
+	_normals_valid = false;
+	_dirty_regions.clear();
+	_stale_normals.clear();
 }
 
-bool Heightmap::create(size_t w, size_t h) {
+void Heightmap::discard_erosion() {
+	if (_erosion_mapping) {
+		delete_work_planes(_water_levels, *_erosion_mapping);
+		delete _erosion_mapping;
+	}
+	_water_levels = _sediment_levels = NULL;
+	_erosion_mapping = NULL;
+	_erosion_steps = 0;
+	_erosion_max_delta = _erosion_rms_delta = 0.0f;
+}
+
+bool Heightmap::allocate_erosion() {
+	// Zeroed water and sediment planes, spilled to a scratch file beyond the memory budget like working planes
+	discard_erosion();
+	Mapped_Memory *mapping = new(std::nothrow) Mapped_Memory();
+	if (!mapping) { return false; }
+	size_t stride;
+	float *layers = new_work_planes(_width * _height, EROSION_LAYERS, stride, *mapping);
+	if (!layers) {
+		delete mapping;
+		return false;
+	}
+	_erosion_mapping = mapping;
+	_water_levels = layers;
+	_sediment_levels = layers + stride;
+	return true;
+}
+
+bool Heightmap::allocate(size_t w, size_t h) {
+	// Allocate planes for w*h columns of unknown elevation, default hardness and solubility, and zero normals.
+	// Planes beyond the memory budget share a scratch file, so maps larger than memory page in and out as needed.
 	clear();
 	size_t np = w * h;
 	if (!np) { return false; }
-	_heightmap = new(std::nothrow) Column[np]();
-	if (!_heightmap) { return false; }
-	_width = w; _height = h;
-	for (size_t i = 0; i < np; i++) {
-		_heightmap[i].elevation = UNKNOWN_ELEVATION;
-		_heightmap[i].hardness = DEFAULT_HARDNESS;
-		_heightmap[i].solubility = DEFAULT_SOLUBILITY;
+	size_t plane_bytes = (size_t)page_align(np * sizeof(float));
+	size_t normals_bytes = (size_t)page_align(np * sizeof(Vector3));
+	if (plane_bytes * 3 + normals_bytes <= memory_budget()) {
+		_elevations = (float *)new_plane(np, sizeof(float));
+		_hardnesses = (float *)new_plane(np, sizeof(float));
+		_solubilities = (float *)new_plane(np, sizeof(float));
+		_normals = (Vector3 *)new_plane(np, sizeof(Vector3));
+		if (!_elevations || !_hardnesses || !_solubilities || !_normals) { clear(); }
+		else { memset(_normals, 0, np * sizeof(Vector3)); }
 	}
+	if (!_elevations) {
+		_mapping = new(std::nothrow) Mapped_Memory();
+		if (!_mapping || !_mapping->map_scratch(plane_bytes * 3 + normals_bytes)) {
+			clear();
+			return false;
+		}
+		// A new scratch file is already zeroed
+		char *base = (char *)_mapping->data();
+		_elevations = (float *)base;
+		_hardnesses = (float *)(base + plane_bytes);
+		_solubilities = (float *)(base + plane_bytes * 2);
+		_normals = (Vector3 *)(base + plane_bytes * 3);
+	}
+	_width = w; _height = h;
+	std::fill(_elevations, _elevations + np, UNKNOWN_ELEVATION);
+	std::fill(_hardnesses, _hardnesses + np, DEFAULT_HARDNESS);
+	std::fill(_solubilities, _solubilities + np, DEFAULT_SOLUBILITY);
 	_known_elevations = 0;
+	touch_all();
 	return true;
 }
 
+static bool regions_touch(const Heightmap::Region &a, const Heightmap::Region &b) {
+	return a.x0 <= b.x1 && b.x0 <= a.x1 && a.y0 <= b.y1 && b.y0 <= a.y1;
+}
+
+static void merge_region(Heightmap::Region &a, const Heightmap::Region &b) {
+	a.x0 = MIN(a.x0, b.x0); a.y0 = MIN(a.y0, b.y0);
+	a.x1 = MAX(a.x1, b.x1); a.y1 = MAX(a.y1, b.y1);
+}
+
+static void add_region(std::vector<Heightmap::Region> &regions, const Heightmap::Region &r) {
+	// Edits tend to come in runs, so a region touching the last one is merged into it
+	if (!regions.empty() && regions_touch(regions.back(), r)) {
+		merge_region(regions.back(), r);
+		return;
+	}
+	regions.push_back(r);
+	if (regions.size() <= MAX_TRACKED_REGIONS) { return; }
+	Heightmap::Region bounds = regions[0];
+	for (size_t i = 1; i < regions.size(); i++) { merge_region(bounds, regions[i]); }
+	regions.assign(1, bounds);
+}
+
+void Heightmap::touch(size_t x0, size_t y0, size_t x1, size_t y1) {
+	if (x0 >= x1 || y0 >= y1) { return; }
+	Region r = {x0, y0, x1, y1};
+	add_region(_dirty_regions, r);
+}
+
+void Heightmap::reshape(size_t x0, size_t y0, size_t x1, size_t y1) {
+	if (x0 >= x1 || y0 >= y1) { return; }
+	touch(x0, y0, x1, y1);
+	// A column's normal depends on its neighbors' elevations, so normals one column beyond the region are stale too
+	if (_normals_valid) {
+		Region n = {x0 > 0 ? x0 - 1 : 0, y0 > 0 ? y0 - 1 : 0, MIN(x1 + 1, _width), MIN(y1 + 1, _height)};
+		add_region(_stale_normals, n);
+	}
+}
+
+void Heightmap::touch_all() {
+	Region r = {0, 0, _width, _height};
+	_dirty_regions.assign(1, r);
+	_normals_valid = false;
+	_stale_normals.clear();
+}
+
+void Heightmap::take_dirty_regions(std::vector<Region> &regions) {
+	regions.insert(regions.end(), _dirty_regions.begin(), _dirty_regions.end());
+	_dirty_regions.clear();
+}
+
+bool Heightmap::create(size_t w, size_t h) {
+	Stage_Timer timer("new");
+	timer.cells(w * h);
+	return allocate(w, h);
+}
+
 static std::string file_extension(const char *filename) {
 	std::string ext = filename;
 	size_t last_dot = ext.find_last_of('.');
@@ -94,231 +286,509 @@ static std::string file_extension(const char *filename) {
 	return ext;
 }
 
-bool Heightmap::open(const char *filename) {
+bool Heightmap::open(const char *filename, unsigned int seed) {
+	Stage_Timer timer("open");
 	clear();
 	std::string ext = file_extension(filename);
-	if (ext == "png") { return open_png(filename); }
-	return false;
+	bool success = false;
+	if (ext == "png") { success = open_png(filename, seed); }
+	else if (ext == "fhm") { success = open_raw(filename); }
+	else if (ext == "dem") { success = open_dem(filename, seed); }
+	timer.cells(_width * _height);
+	return success;
 }
 
-static float derive_hardness(float h) {
+static float derive_hardness(float h, unsigned int seed, size_t i) {
 	// Elevation plus noise, scaled lower, yields hardness
 	return h == Heightmap::UNKNOWN_ELEVATION ? Heightmap::DEFAULT_HARDNESS :
-		clamp01(h + random11() * Heightmap::DERIVED_HARDNESS_VARIANCE);
+		clamp01(h + random11(seed, HARDNESS_STREAM, i) * Heightmap::DERIVED_HARDNESS_VARIANCE);
 }
 
-static float derive_solubility(float h) {
+static float derive_solubility(float h, unsigned int seed, size_t i) {
 	// Elevation plus noise, scaled lower, yields solubility
 	return h == Heightmap::UNKNOWN_ELEVATION ? Heightmap::DEFAULT_SOLUBILITY :
-		clamp01(h + random11() * Heightmap::DERIVED_SOLUBILITY_VARIANCE);
+		clamp01(h + random11(seed, SOLUBILITY_STREAM, i) * Heightmap::DERIVED_SOLUBILITY_VARIANCE);
 }
 
-bool Heightmap::open_png(const char *filename) {
-	// PNG channels: red = elevation, green = hardness, blue = solubility; alpha of 0 = unknown elevation 
-	Fl_PNG_Image image(filename);
-	size_t np = image.w() * image.h();
-	if (!np) { return false; }
-	_heightmap = new(std::nothrow) Column[np]();
-	if (!_heightmap) { return false; }
-	_width = image.w(); _height = image.h();
-	const unsigned char *pixels = (const unsigned char *)image.data()[0];
-	int depth = image.d();
-	switch (depth) {
-	case 1: // grayscale
-		for (size_t i = 0; i < np; i++) {
-			const unsigned char *p = pixels + i * depth;
-			_heightmap[i].elevation = (float)p[0] / 255.0f;
-			_heightmap[i].hardness = derive_hardness(_heightmap[i].elevation);
-			_heightmap[i].solubility = derive_solubility(_heightmap[i].elevation);
-		}
-		_known_elevations = np;
-		break;
-	case 2: // grayscale with alpha
-		for (size_t i = 0; i < np; i++) {
-			const unsigned char *p = pixels + i * depth;
-			_heightmap[i].elevation = p[1] ? (float)p[0] / 255.0f : UNKNOWN_ELEVATION;
-			if (_heightmap[i].elevation != UNKNOWN_ELEVATION) { _known_elevations++; }
-			_heightmap[i].hardness = derive_hardness(_heightmap[i].elevation);
-			_heightmap[i].solubility = derive_solubility(_heightmap[i].elevation);
-		}
-		break;
-	case 3: // RGB
-		for (size_t i = 0; i < np; i++) {
-			const unsigned char *p = pixels + i * depth;
-			_heightmap[i].elevation = (float)p[0] / 255.0f;
-			_heightmap[i].hardness = (float)p[1] / 255.0f;
-			_heightmap[i].solubility = (float)p[2] / 255.0f;
-		}
-		_known_elevations = np;
-		break;
-	case 4: // RGBA
-		for (size_t i = 0; i < np; i++) {
-			const unsigned char *p = pixels + i * depth;
-			_heightmap[i].elevation = p[3] ? (float)p[0] / 255.0f : UNKNOWN_ELEVATION;
-			_heightmap[i].hardness = p[3] ? (float)p[1] / 255.0f : DEFAULT_HARDNESS;
-			_heightmap[i].solubility = p[3] ? (float)p[2] / 255.0f : DEFAULT_SOLUBILITY;
-			if (_heightmap[i].elevation != UNKNOWN_ELEVATION) { _known_elevations++; }
-		}
-		break;
-	default:
-		return false;
-	}
-	return true;
+static float png_sample(const unsigned char *p, int c, int depth) {
+	// Channel c of a pixel, scaled to [0, 1]; 16-bit samples are big-endian
+	if (depth == 16) { return (float)((p[2*c] << 8) | p[2*c+1]) / 65535.0f; }
+	return (float)p[c] / 255.0f;
 }
 
-bool Heightmap::save(const char *filename, Color_Scheme cs, Progress_Dialog *pd) const {
-	return save_png(filename, cs, pd);
+void Heightmap::load_png_row(size_t y, const unsigned char *row, int channels, int depth, unsigned int seed) {
+	size_t stride = channels * depth / 8;
+	const unsigned char *p = row;
+	for (size_t x = 0, i = y * _width; x < _width; x++, i++, p += stride) {
+		switch (channels) {
+		case 1: // grayscale
+			_elevations[i] = png_sample(p, 0, depth);
+			_hardnesses[i] = derive_hardness(_elevations[i], seed, i);
+			_solubilities[i] = derive_solubility(_elevations[i], seed, i);
+			break;
+		case 2: // grayscale with alpha
+			_elevations[i] = png_sample(p, 1, depth) ? png_sample(p, 0, depth) : UNKNOWN_ELEVATION;
+			_hardnesses[i] = derive_hardness(_elevations[i], seed, i);
+			_solubilities[i] = derive_solubility(_elevations[i], seed, i);
+			break;
+		case 3: // RGB
+			_elevations[i] = png_sample(p, 0, depth);
+			_hardnesses[i] = png_sample(p, 1, depth);
+			_solubilities[i] = png_sample(p, 2, depth);
+			break;
+		case 4: // RGBA
+			if (png_sample(p, 3, depth)) {
+				_elevations[i] = png_sample(p, 0, depth);
+				_hardnesses[i] = png_sample(p, 1, depth);
+				_solubilities[i] = png_sample(p, 2, depth);
+			}
+			else {
+				_elevations[i] = UNKNOWN_ELEVATION;
+				_hardnesses[i] = DEFAULT_HARDNESS;
+				_solubilities[i] = DEFAULT_SOLUBILITY;
+			}
+			break;
+		}
+		if (_elevations[i] != UNKNOWN_ELEVATION) { _known_elevations++; }
+	}
 }
 
-bool Heightmap::save_png(const char *filename, Color_Scheme cs, Progress_Dialog *pd) const {
-	size_t denom = 1;
-	if (pd) {
-		pd->canceled(false);
-	}
-	FILE *file = fopen(filename, "wb");
+bool Heightmap::open_png(const char *filename, unsigned int seed) {
+	// PNG channels: red = elevation, green = hardness, blue = solubility; alpha of 0 = unknown elevation
+	// Rows are decoded one at a time straight into the planes, and 16-bit channels keep their full precision
+	FILE *file = fopen(filename, "rb");
 	if (!file) { return false; }
-	// Create the necessary PNG structures
-	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_byte signature[8];
+	if (fread(signature, 1, 8, file) != 8 || png_sig_cmp(signature, 0, 8)) {
+		fclose(file);
+		return false;
+	}
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	if (!png) {
 		fclose(file);
 		return false;
 	}
 	png_infop info = png_create_info_struct(png);
 	if (!info) {
-		png_destroy_write_struct(&png, (png_infopp)NULL);
+		png_destroy_read_struct(&png, (png_infopp)NULL, (png_infopp)NULL);
 		fclose(file);
 		return false;
 	}
-	size_t np = _width * _height;
+	// These are modified after setjmp, so they must be volatile to be intact when libpng reports an error
+	png_bytep volatile png_row = NULL;
+	png_bytep volatile png_image = NULL;
+	png_bytepp volatile png_rows = NULL;
+	volatile bool success = false;
+	if (setjmp(png_jmpbuf(png))) { goto cleanup; }
+	png_init_io(png, file);
+	png_set_sig_bytes(png, 8);
+	png_read_info(png, info);
+	{
+		png_uint_32 w, h;
+		int depth, color_type, interlace;
+		png_get_IHDR(png, info, &w, &h, &depth, &color_type, &interlace, NULL, NULL);
+		// Expand palettes, low-bit grayscale and transparency keys, so every row is 8 or 16 bits per channel
+		if (color_type == PNG_COLOR_TYPE_PALETTE) { png_set_palette_to_rgb(png); }
+		if (color_type == PNG_COLOR_TYPE_GRAY && depth < 8) { png_set_expand_gray_1_2_4_to_8(png); }
+		if (png_get_valid(png, info, PNG_INFO_tRNS)) { png_set_tRNS_to_alpha(png); }
+		int passes = png_set_interlace_handling(png);
+		png_read_update_info(png, info);
+		int channels = png_get_channels(png, info);
+		depth = png_get_bit_depth(png, info);
+		size_t row_bytes = png_get_rowbytes(png, info);
+		if (channels < 1 || channels > 4 || !allocate(w, h)) { goto cleanup; }
+		if (passes == 1) {
+			png_row = new(std::nothrow) png_byte[row_bytes];
+			if (!png_row) { goto cleanup; }
+			for (size_t y = 0; y < _height; y++) {
+				png_read_row(png, png_row, NULL);
+				load_png_row(y, png_row, channels, depth, seed);
+			}
+		}
+		else {
+			// Interlaced passes each fill part of every row, so the whole image has to be decoded first
+			png_image = new(std::nothrow) png_byte[row_bytes * _height];
+			png_rows = new(std::nothrow) png_bytep[_height];
+			if (!png_image || !png_rows) { goto cleanup; }
+			for (size_t y = 0; y < _height; y++) {
+				png_rows[y] = png_image + y * row_bytes;
+			}
+			png_read_image(png, png_rows);
+			for (size_t y = 0; y < _height; y++) {
+				load_png_row(y, png_rows[y], channels, depth, seed);
+			}
+		}
+		png_read_end(png, NULL);
+	}
+	success = true;
+cleanup:
+	png_destroy_read_struct(&png, &info, (png_infopp)NULL);
+	fclose(file);
+	delete [] png_row;
+	delete [] png_image;
+	delete [] png_rows;
+	if (!success) { clear(); }
+	return success;
+}
+
+bool Heightmap::save(const char *filename, Color_Scheme cs, Progress *pd) {
+	return save(filename, cs, PNG_DEFAULT_LEVEL, ADAPTIVE_FILTER, pd);
+}
+
+bool Heightmap::save(const char *filename, Color_Scheme cs, int level, Png_Filter filter, Progress *pd) {
+	Stage_Timer timer("save");
+	timer.cells(_width * _height);
+	std::string ext = file_extension(filename);
+	if (ext == "fhm") { return save_raw(filename, pd); }
+	return save_png(filename, cs, level, filter, pd);
+}
+
+bool Heightmap::save_png(const char *filename, Color_Scheme cs, int level, Png_Filter filter, Progress *pd) const {
+	if (pd) {
+		pd->canceled(false);
+	}
 	if (pd) {
-		denom = np / PROGRESS_STEPS;
-		if (!denom) { denom = 1; }
 		pd->message("Saving DTED...");
 		pd->progress(0.0f);
-		Fl::check();
-		if (pd->canceled()) {
-			png_destroy_write_struct(&png, &info);
-			png_free_data(png, info, PNG_FREE_ALL, -1);
-			fclose(file);
+		if (pd->canceled()) { return false; }
+	}
+	// Write the RGBA pixels in row-major order from top to bottom; rows are colored by the encoder's threads
+	bool success = encode_png(filename, _width, _height, [&](size_t y, unsigned char *row) {
+		for (size_t x = 0, i = y * _width; x < _width; x++, i++) {
+			Column c = column(i);
+			float cv[3];
+			column_color(c, cs, cv);
+			size_t j = 4 * x;
+			row[j] =   (unsigned char)(cv[0] * 255.0f);
+			row[j+1] = (unsigned char)(cv[1] * 255.0f);
+			row[j+2] = (unsigned char)(cv[2] * 255.0f);
+			row[j+3] = c.elevation == UNKNOWN_ELEVATION ? 0 : 255;
+		}
+	}, level, filter, pd);
+	if (!success) { return false; }
+	if (pd) {
+		pd->progress(1.0f);
+		if (pd->canceled()) { return false; }
+	}
+	return true;
+}
+
+// Native heightmap format: this header, then planes of elevation, hardness and solubility floats, and optionally
+// normals and erosion's water and sediment levels, each starting on a page boundary so that the whole file can be
+// mapped and used in place. Version 1 files end their header before the erosion fields.
+struct Raw_Header {
+	char magic[8];
+	unsigned int version, byte_order;
+	unsigned long long width, height, known_elevations;
+	unsigned long long elevations_offset, hardnesses_offset, solubilities_offset;
+	unsigned long long normals_offset; // 0 when the file has no normals
+	unsigned long long water_offset, sediment_offset; // 0 when the file has no erosion layers
+	unsigned long long erosion_steps;
+};
+
+static const char RAW_MAGIC[8] = {'F', 'R', 'O', 'N', 'T', 'H', 'M', '\0'};
+static const unsigned int RAW_VERSION = 2;
+static const unsigned int RAW_BYTE_ORDER = 0x01020304;
+
+bool Heightmap::open_dem(const char *filename, unsigned int seed) {
+	// Each profile is a south-to-north column of elevations, scaled from the file's range to [0, 1]; voids and cells
+	// outside the quadrangle are unknown
+	Usgs_Dem dem;
+	if (!dem.open(filename) || !allocate(dem.width(), dem.height())) { return false; }
+	double *profile = new(std::nothrow) double[_height];
+	if (!profile) {
+		clear();
+		return false;
+	}
+	double lo = dem.min_elevation(), range = dem.max_elevation() - lo;
+	for (size_t x = 0; x < _width; x++) {
+		if (!dem.read_profile(x, profile)) {
+			delete [] profile;
+			clear();
 			return false;
 		}
+		size_t y = _height - 1 - dem.profile_first_row(x);
+		for (size_t r = 0; r < dem.profile_rows(x); r++, y--) {
+			if (profile[r] == Usgs_Dem::VOID_ELEVATION) { continue; }
+			size_t i = y * _width + x;
+			_elevations[i] = range > 0.0 ? clamp01((float)((profile[r] - lo) / range)) : 0.0f;
+			_hardnesses[i] = derive_hardness(_elevations[i], seed, i);
+			_solubilities[i] = derive_solubility(_elevations[i], seed, i);
+			_known_elevations++;
+		}
 	}
-	png_init_io(png, file);
-	// Set compression options (commented out for being slow)
-	/*
-	png_set_compression_level(png, Z_BEST_COMPRESSION);
-	png_set_compression_mem_level(png, Z_BEST_COMPRESSION);
-	png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
-	png_set_compression_window_bits(png, 15);
-	png_set_compression_method(png, Z_DEFLATED);
-	png_set_compression_buffer_size(png, 8192);
-	*/
-	// Write the PNG IHDR chunk
-	png_set_IHDR(png, info, (png_uint_32)_width, (png_uint_32)_height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
-		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-	// Write the other PNG header chunks
-	png_write_info(png, info);
-	// Write the RGB pixels in row-major order from top to bottom
-	png_bytep png_row = new(std::nothrow) png_byte[4 * _width];
-	if (!png_row) {
-		png_destroy_write_struct(&png, (png_infopp)NULL);
-		fclose(file);
+	delete [] profile;
+	return true;
+}
+
+static bool raw_plane_fits(unsigned long long offset, unsigned long long bytes, unsigned long long size) {
+	// Whether a plane starts on a page boundary and ends within the file, compared without adding so that no
+	// offset can wrap around
+	return offset % Heightmap::RAW_PAGE_SIZE == 0 && offset <= size && bytes <= size - offset;
+}
+
+bool Heightmap::open_raw(const char *filename) {
+	// The file is mapped copy-on-write, so opening is constant-time, pages are read as they are first touched, and
+	// edits never reach the file
+	Mapped_Memory *mapping = new(std::nothrow) Mapped_Memory();
+	if (!mapping || !mapping->map_file(filename) || mapping->size() < sizeof(Raw_Header)) {
+		delete mapping;
 		return false;
 	}
-	for (size_t y = 0, i = 0; y < _height; y++) {
-		for (size_t x = 0; x < _width; x++, i++) {
-			Column &c = column(x, y);
-			float h = c.elevation;
-			float cv[3];
-			column_color(c, cs, cv);
-			size_t j = 4 * x;
-			png_row[j] =   (png_byte)(cv[0] * 255.0f);
-			png_row[j+1] = (png_byte)(cv[1] * 255.0f);
-			png_row[j+2] = (png_byte)(cv[2] * 255.0f);
-			png_row[j+3] = h == UNKNOWN_ELEVATION ? 0 : 255;
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(i + 1) / np);
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] png_row;
-					png_destroy_write_struct(&png, &info);
-					png_free_data(png, info, PNG_FREE_ALL, -1);
-					fclose(file);
-					return false;
-				}
-			}
-			i++;
+	const char *data = (const char *)mapping->data();
+	Raw_Header header;
+	memcpy(&header, data, sizeof(header));
+	if (header.version == 1) {
+		header.water_offset = header.sediment_offset = header.erosion_steps = 0;
+	}
+	// The dimensions are checked against the file's size before any plane's size is computed from them, so a crafted
+	// header cannot make the sizes wrap around and pass the checks below
+	unsigned long long size = mapping->size();
+	bool valid = !memcmp(header.magic, RAW_MAGIC, sizeof(RAW_MAGIC)) &&
+		(header.version == 1 || header.version == RAW_VERSION) && header.byte_order == RAW_BYTE_ORDER &&
+		header.width && header.height && header.width <= 0xFFFFFFFFull && header.height <= 0xFFFFFFFFull &&
+		header.width * header.height <= size / sizeof(Vector3);
+	unsigned long long np = valid ? header.width * header.height : 0;
+	unsigned long long float_plane = np * sizeof(float), vector_plane = np * sizeof(Vector3);
+	valid = valid && header.known_elevations <= np &&
+		raw_plane_fits(header.elevations_offset, float_plane, size) &&
+		raw_plane_fits(header.hardnesses_offset, float_plane, size) &&
+		raw_plane_fits(header.solubilities_offset, float_plane, size) &&
+		(!header.normals_offset || raw_plane_fits(header.normals_offset, vector_plane, size)) &&
+		(!header.water_offset) == (!header.sediment_offset) &&
+		(!header.water_offset || (raw_plane_fits(header.water_offset, float_plane, size) &&
+		raw_plane_fits(header.sediment_offset, float_plane, size)));
+	if (!valid) {
+		delete mapping;
+		return false;
+	}
+	Mapped_Memory *normals_mapping = NULL;
+	if (!header.normals_offset) {
+		normals_mapping = new(std::nothrow) Mapped_Memory();
+		if (!normals_mapping || !normals_mapping->map_zeroed((size_t)vector_plane)) {
+			delete normals_mapping;
+			delete mapping;
+			return false;
 		}
-		png_write_row(png, png_row);
 	}
-	// Write the end of the PNG
-	png_write_end(png, NULL);
-	delete [] png_row;
-	png_destroy_write_struct(&png, &info);
-	png_free_data(png, info, PNG_FREE_ALL, -1);
-	fclose(file);
+	_mapping = mapping;
+	_normals_mapping = normals_mapping;
+	_elevations = (float *)(data + header.elevations_offset);
+	_hardnesses = (float *)(data + header.hardnesses_offset);
+	_solubilities = (float *)(data + header.solubilities_offset);
+	_normals = normals_mapping ? (Vector3 *)normals_mapping->data() : (Vector3 *)(data + header.normals_offset);
+	if (header.water_offset) {
+		_water_levels = (float *)(data + header.water_offset);
+		_sediment_levels = (float *)(data + header.sediment_offset);
+	}
+	_width = (size_t)header.width;
+	_height = (size_t)header.height;
+	_known_elevations = (size_t)header.known_elevations;
+	_erosion_steps = (size_t)header.erosion_steps;
+	_normals_valid = header.normals_offset != 0;
+	return true;
+}
+
+static bool write_raw_plane(FILE *file, const void *plane, size_t size, unsigned long long &written,
+	unsigned long long total, Progress *pd) {
+	// Write a plane in chunks, reporting progress and checking for cancellation between them
+	static const size_t CHUNK_SIZE = 1 << 22;
+	const char *p = (const char *)plane;
+	for (size_t i = 0; i < size; i += CHUNK_SIZE) {
+		size_t n = MIN(CHUNK_SIZE, size - i);
+		if (fwrite(p + i, 1, n, file) != n) { return false; }
+		written += n;
+		if (pd) {
+			pd->progress((float)written / total);
+			if (pd->canceled()) { return false; }
+		}
+	}
+	return true;
+}
+
+static bool write_raw_padding(FILE *file, unsigned long long &written, unsigned long long offset) {
+	static const char zeros[4096] = {0};
+	while (written < offset) {
+		size_t n = (size_t)MIN(offset - written, (unsigned long long)sizeof(zeros));
+		if (fwrite(zeros, 1, n, file) != n) { return false; }
+		written += n;
+	}
+	return true;
+}
+
+bool Heightmap::save_raw(const char *filename, Progress *pd) {
+	if (pd) {
+		pd->canceled(false);
+	}
+	if (!_width || !_height) { return false; }
+	if (pd) {
+		pd->message("Saving DTED...");
+		pd->progress(0.0f);
+		if (pd->canceled()) { return false; }
+	}
+	unsigned long long np = (unsigned long long)_width * _height;
+	Raw_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RAW_MAGIC, sizeof(RAW_MAGIC));
+	header.version = RAW_VERSION;
+	header.byte_order = RAW_BYTE_ORDER;
+	header.width = _width;
+	header.height = _height;
+	header.known_elevations = _known_elevations;
+	header.elevations_offset = page_align(sizeof(header));
+	header.hardnesses_offset = page_align(header.elevations_offset + np * sizeof(float));
+	header.solubilities_offset = page_align(header.hardnesses_offset + np * sizeof(float));
+	unsigned long long total = header.solubilities_offset + np * sizeof(float);
+	if (normals_valid()) {
+		header.normals_offset = page_align(total);
+		total = header.normals_offset + np * sizeof(Vector3);
+	}
+	if (_water_levels) {
+		header.water_offset = page_align(total);
+		header.sediment_offset = page_align(header.water_offset + np * sizeof(float));
+		total = header.sediment_offset + np * sizeof(float);
+	}
+	header.erosion_steps = _erosion_steps;
+	// Write to a temporary file and then replace the target, since the target may be mapped by this heightmap
+	std::string temp_filename = std::string(filename) + ".tmp";
+	FILE *file = fopen(temp_filename.c_str(), "wb");
+	if (!file) { return false; }
+	unsigned long long written = 0;
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	written = sizeof(header);
+	success = success && write_raw_padding(file, written, header.elevations_offset) &&
+		write_raw_plane(file, _elevations, (size_t)np * sizeof(float), written, total, pd) &&
+		write_raw_padding(file, written, header.hardnesses_offset) &&
+		write_raw_plane(file, _hardnesses, (size_t)np * sizeof(float), written, total, pd) &&
+		write_raw_padding(file, written, header.solubilities_offset) &&
+		write_raw_plane(file, _solubilities, (size_t)np * sizeof(float), written, total, pd);
+	if (normals_valid()) {
+		success = success && write_raw_padding(file, written, header.normals_offset) &&
+			write_raw_plane(file, _normals, (size_t)np * sizeof(Vector3), written, total, pd);
+	}
+	if (_water_levels) {
+		success = success && write_raw_padding(file, written, header.water_offset) &&
+			write_raw_plane(file, _water_levels, (size_t)np * sizeof(float), written, total, pd) &&
+			write_raw_padding(file, written, header.sediment_offset) &&
+			write_raw_plane(file, _sediment_levels, (size_t)np * sizeof(float), written, total, pd);
+	}
+	if (fclose(file)) { success = false; }
+	// Windows cannot replace the file while these planes are mapped from it, so then move them onto the temporary
+	// file, whose contents are the same, and replace the target with it again
+	if (success && !replace_file(temp_filename.c_str(), filename)) {
+		success = _mapping && remap_raw(temp_filename.c_str(), header) &&
+			replace_file(temp_filename.c_str(), filename);
+	}
+	if (!success) {
+		remove(temp_filename.c_str());
+		return false;
+	}
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
 }
 
-bool Heightmap::decimate(bool random, double thresh, Progress_Dialog *pd) {
-	return random ? decimate_random(thresh, pd) : decimate_edges(thresh, pd);
+bool Heightmap::remap_raw(const char *filename, const Raw_Header &header) {
+	// Move the planes mapped from the current file onto the same planes of a copy just saved from them
+	Mapped_Memory *mapping = new(std::nothrow) Mapped_Memory();
+	if (!mapping || !mapping->map_file(filename)) {
+		delete mapping;
+		return false;
+	}
+	const char *begin = (const char *)_mapping->data(), *end = begin + _mapping->size();
+	char *data = (char *)mapping->data();
+	if ((const char *)_normals >= begin && (const char *)_normals < end && !header.normals_offset) {
+		// Normals that were out of date when saved were not written, so they need a plane of their own
+		_normals_mapping = new(std::nothrow) Mapped_Memory();
+		if (!_normals_mapping || !_normals_mapping->map_zeroed(_width * _height * sizeof(Vector3))) {
+			delete _normals_mapping;
+			_normals_mapping = NULL;
+			delete mapping;
+			return false;
+		}
+		_normals = (Vector3 *)_normals_mapping->data();
+	}
+	else if ((const char *)_normals >= begin && (const char *)_normals < end) {
+		_normals = (Vector3 *)(data + header.normals_offset);
+	}
+	if ((const char *)_elevations >= begin && (const char *)_elevations < end) {
+		_elevations = (float *)(data + header.elevations_offset);
+		_hardnesses = (float *)(data + header.hardnesses_offset);
+		_solubilities = (float *)(data + header.solubilities_offset);
+	}
+	if ((const char *)_water_levels >= begin && (const char *)_water_levels < end) {
+		_water_levels = (float *)(data + header.water_offset);
+		_sediment_levels = (float *)(data + header.sediment_offset);
+	}
+	delete _mapping;
+	_mapping = mapping;
+	return true;
+}
+
+bool Heightmap::decimate(bool random, double thresh, unsigned int seed, Progress *pd) {
+	Stage_Timer timer("decimate");
+	timer.cells(_width * _height);
+	touch_all();
+	return random ? decimate_random(thresh, seed, pd) : decimate_edges(thresh, pd);
 }
 
-bool Heightmap::decimate_random(double frac, Progress_Dialog *pd) {
-	size_t denom = 1;
+bool Heightmap::decimate_random(double frac, unsigned int seed, Progress *pd) {
 	if (pd) {
 		pd->canceled(false);
 	}
-	size_t np = _width * _height;
 	if (pd) {
-		denom = np / PROGRESS_STEPS;
-		if (!denom) { denom = 1; }
 		pd->message("Decimating...");
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
-	// For each column, pick whether to remove it
-	for (size_t i = 0; i < np; i++) {
-		double r = random01();
-		if (r < frac && _heightmap[i].elevation != UNKNOWN_ELEVATION) {
-			_heightmap[i].elevation = UNKNOWN_ELEVATION;
-			_known_elevations--;
-		}
-		if (pd && !((i + 1) % denom)) {
-			pd->progress((float)(i + 1) / np);
-			Fl::check();
+	// Removed columns would keep their water and sediment, so erosion starts over
+	discard_erosion();
+	// For each column, pick whether to remove it; each column's choice is independent, so batches of rows are split
+	// between threads
+	size_t batch_rows = MAX(DECIMATE_BATCH_COLUMNS / _width, (size_t)1);
+	for (size_t y0 = 0; y0 < _height; y0 += batch_rows) {
+		size_t y1 = MIN(y0 + batch_rows, _height);
+		std::atomic<size_t> removed(0);
+		parallel_for(y0 * _width, y1 * _width, [&](size_t i0, size_t i1) {
+			size_t n = 0;
+			for (size_t i = i0; i < i1; i++) {
+				if (random01(seed, DECIMATE_STREAM, i) < frac && _elevations[i] != UNKNOWN_ELEVATION) {
+					_elevations[i] = UNKNOWN_ELEVATION;
+					n++;
+				}
+			}
+			removed += n;
+		});
+		_known_elevations -= removed;
+		if (pd) {
+			pd->progress((float)y1 / _height);
 			if (pd->canceled()) { return false; }
 		}
 	}
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
 }
 
-bool Heightmap::decimate_edges(double thresh, Progress_Dialog *pd) {
-	size_t denom = 1;
+bool Heightmap::decimate_edges(double thresh, Progress *pd) {
 	if (pd) {
 		pd->canceled(false);
 	}
 	size_t np = _width * _height;
 	if (pd) {
-		denom = np / PROGRESS_STEPS;
-		if (!denom) { denom = 1; }
 		pd->message("Decimating...");
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
-	float *edgeness_map = new(std::nothrow) float[np]();
+	// Water and sediment sit on columns that are about to become unknown, so erosion starts over
+	discard_erosion();
+	Mapped_Memory spill;
+	size_t stride;
+	float *edgeness_map = new_work_planes(np, 1, stride, spill);
 	if (!edgeness_map) { return false; }
 	// Kernels for Sobel operator
 	double gx[3][3] = {{1.0, 0.0, -1.0}, {2.0, 0.0, -2.0}, {1.0, 0.0, -1.0}};
@@ -342,677 +812,885 @@ bool Heightmap::decimate_edges(double thresh, Progress_Dialog *pd) {
 			}
 			edgeness_map[i] = clamp01((float)edgeness);
 			if (edgeness_map[i] > max_edgeness) { max_edgeness = edgeness_map[i]; }
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(i + 1) / (np * 2));
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] edgeness_map;
-					return false;
-				}
+		}
+		if (pd) {
+			pd->progress((float)(y + 1) / (_height * 2));
+			if (pd->canceled()) {
+				delete_work_planes(edgeness_map, spill);
+				return false;
 			}
 		}
 	}
 	thresh = thresh * max_edgeness;
 	// For each column, remove the columns that are not edgy enough
-	for (size_t i = 0; i < np; i++) {
-		if (edgeness_map[i] < thresh && _heightmap[i].elevation != UNKNOWN_ELEVATION) {
-			_heightmap[i].elevation = UNKNOWN_ELEVATION;
-			_known_elevations--;
+	for (size_t y = 0, i = 0; y < _height; y++) {
+		for (size_t x = 0; x < _width; x++, i++) {
+			if (edgeness_map[i] < thresh && _elevations[i] != UNKNOWN_ELEVATION) {
+				_elevations[i] = UNKNOWN_ELEVATION;
+				_known_elevations--;
+			}
 		}
-		if (pd && !((i + 1) % denom)) {
-			pd->progress(0.5f + (float)(i + 1) / (np * 2));
-			Fl::check();
+		if (pd) {
+			pd->progress(0.5f + (float)(y + 1) / (_height * 2));
 			if (pd->canceled()) {
-				delete [] edgeness_map;
+				delete_work_planes(edgeness_map, spill);
 				return false;
 			}
 		}
 	}
-	delete [] edgeness_map;
+	delete_work_planes(edgeness_map, spill);
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
 }
 
-bool Heightmap::expand(size_t power, Progress_Dialog *pd) {
-	size_t denom = 1;
+bool Heightmap::expand(size_t power, Progress *pd) {
+	Stage_Timer timer("expand");
 	if (pd) {
 		pd->canceled(false);
 	}
 	size_t factor = (size_t)pow(2, power);
-	size_t np = _width * _height;
 	size_t new_width = (_width - 1) * factor + 1, new_height = (_height - 1) * factor + 1;
-	size_t new_np = new_width * new_height;
+	timer.cells(new_width * new_height);
 	if (pd) {
-		denom = new_np / PROGRESS_STEPS;
-		if (!denom) { denom = 1; }
 		pd->message("Expanding...");
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
-	Column *new_heightmap = new(std::nothrow) Column[new_np]();
-	if (!new_heightmap) { return false; }
-	// Initialize expanded heightmap
-	for (size_t i = 0; i < new_np; i++) {
-		new_heightmap[i].elevation = UNKNOWN_ELEVATION;
-		new_heightmap[i].hardness = DEFAULT_HARDNESS;
-		new_heightmap[i].solubility = DEFAULT_SOLUBILITY;
-		if (pd && !((i + 1) % denom)) {
-			pd->progress((float)(i + 1) / new_np / 2.0f);
-			Fl::check();
-			if (pd->canceled()) {
-				delete [] new_heightmap;
-				return false;
-			}
-		}
-	}
-	if (pd) {
-		denom = np / PROGRESS_STEPS;
-		if (!denom) { denom = 1; }
-	}
+	// Allocate the expanded planes in a scratch heightmap, then take them over
+	Heightmap expanded;
+	if (!expanded.allocate(new_width, new_height)) { return false; }
 	// For each column, copy it to the expanded heightmap
 	for (size_t y = 0, i = 0; y < _height; y++) {
 		for (size_t x = 0; x < _width; x++, i++) {
-			Column &c = column(x, y);
 			size_t new_i = y * new_width * factor + x * factor;
-			new_heightmap[new_i].elevation = c.elevation;
-			new_heightmap[new_i].hardness = c.hardness;
-			new_heightmap[new_i].solubility = c.solubility;
-			if (pd && !((i + 1) % denom)) {
-				pd->progress(0.5f + (float)(i + 1) / np / 2.0f);
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] new_heightmap;
-					return false;
-				}
-			}
+			expanded._elevations[new_i] = _elevations[i];
+			expanded._hardnesses[new_i] = _hardnesses[i];
+			expanded._solubilities[new_i] = _solubilities[i];
+		}
+		if (pd) {
+			pd->progress((float)(y + 1) / _height);
+			if (pd->canceled()) { return false; }
 		}
 	}
+	std::swap(_elevations, expanded._elevations);
+	std::swap(_hardnesses, expanded._hardnesses);
+	std::swap(_solubilities, expanded._solubilities);
+	std::swap(_normals, expanded._normals);
+	std::swap(_mapping, expanded._mapping);
+	std::swap(_normals_mapping, expanded._normals_mapping);
+	// Erosion layers have no columns in between to expand into, so erosion starts over
+	discard_erosion();
 	_width = new_width; _height = new_height;
-	delete [] _heightmap; _heightmap = new_heightmap;
+	touch_all();
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
 }
 
-bool Heightmap::interpolate(bool mdbu, float I, bool md, float H, float rt, float rs, Progress_Dialog *pd) {
+bool Heightmap::interpolate(bool mdbu, float I, bool md, float H, float rt, float rs, unsigned int seed,
+	Progress *pd) {
 	// Morphologically Constrained Midpoint Displacement (MCMD) algorithm from
 	// "Terrain Modeling: A Constrained Fractal Model" (Belhadj, 2007)
 	if (_known_elevations == _width * _height) { return true; }
+	Stage_Timer timer("interpolate");
+	timer.cells(_width * _height - _known_elevations);
+	// Only unknown columns are filled in, so the changed region is their bounding box
+	Region unknown = {_width, _height, 0, 0};
+	for (size_t y = 0, i = 0; y < _height; y++) {
+		for (size_t x = 0; x < _width; x++, i++) {
+			if (_elevations[i] != UNKNOWN_ELEVATION) { continue; }
+			unknown.x0 = MIN(unknown.x0, x); unknown.y0 = MIN(unknown.y0, y);
+			unknown.x1 = MAX(unknown.x1, x + 1); unknown.y1 = MAX(unknown.y1, y + 1);
+		}
+	}
+	reshape(unknown.x0, unknown.y0, unknown.x1, unknown.y1);
+	// Erosion's water and sediment only cover the known columns, so erosion starts over on the interpolated map
+	discard_erosion();
 	if (pd) {
 		pd->canceled(false);
 	}
 	if (mdbu && !md_bottom_up_diamond_square(I, pd)) { return false; }
-	if (md && !midpoint_displacement_diamond_square(H, rt, rs, pd)) { return false; }
+	if (md && !midpoint_displacement_diamond_square(H, rt, rs, seed, pd)) { return false; }
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
 }
 
-static float euclidean_distance(Point a, Point b) {
-	size_t dx = a.first > b.first ? a.first - b.first : b.first - a.first;
-	size_t dy = a.second > b.second ? a.second - b.second : b.second - a.second;
+static float euclidean_distance(size_t ax, size_t ay, size_t bx, size_t by) {
+	size_t dx = ax > bx ? ax - bx : bx - ax;
+	size_t dy = ay > by ? ay - by : by - ay;
 	return sqrt((float)(dx * dx + dy * dy));
 }
 
-bool Heightmap::md_bottom_up_diamond_square(float I, Progress_Dialog *pd) {
+bool Heightmap::md_bottom_up_diamond_square(float I, Progress *pd) {
+	Stage_Timer timer("interpolate: MDBU");
+	timer.cells(_width * _height - _known_elevations);
 	// Midpoint Displacement Bottom-Up (MDBU) step of MCMD algorithm, using diamond-square MD
 	size_t np = _width * _height;
 	float sigma = I < 0.0f ? -1.0f : 1.0f;
 	I = fabs(I);
-	size_t denom = 1;
 	if (pd) {
-		denom = (np * 2) / (PROGRESS_STEPS * 1);
-		if (!denom) { denom = 1; }
 		pd->message("Interpolating bottom-up...");
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
-	std::queue<Point> FQ;
-	size_t i = 0;
+	// The frontier holds the known points whose ascendants are visited next. Each wave scans the frontier's rows in
+	// order and adds each point's weighted properties to the sums of its unknown ascendants, so each ascendant's
+	// descendants are summed in index order, then sets every ascendant with sums from its mean and makes it the next
+	// frontier. Each column's state (-1 on the frontier, otherwise its count of descendants so far) and its three
+	// interleaved sums are kept in working planes, which spill to a scratch file like erosion's, so maps larger than
+	// memory interpolate.
+	// Only rows holding frontier points or ascendants are scanned.
+	Mapped_Memory spill;
+	size_t stride;
+	float *state = new_work_planes(np, 4, stride, spill);
+	if (!state) { return false; }
+	float *sums = state + stride;
+	bool success = false;
+	float max_d = sqrt((float)np);
+	std::vector<unsigned char> frontier_rows(_height, 0), next_rows(_height, 0);
 	for (size_t y = 0; y < _height; y++) {
 		for (size_t x = 0; x < _width; x++) {
-			float h = elevation(x, y);
-			if (h != UNKNOWN_ELEVATION) {
-				Point C(x, y);
-				FQ.push(C);
-				if (pd && !((i + 1) % denom)) {
-					pd->progress((float)(i + 1) / (np * 2));
-					Fl::check();
-					if (pd->canceled()) { return false; }
-				}
-				i++;
-			}
+			if (_elevations[y * _width + x] == UNKNOWN_ELEVATION) { continue; }
+			state[y * _width + x] = -1.0f;
+			frontier_rows[y] = 1;
 		}
 	}
-	float max_d = sqrt((float)np);
-	while (!FQ.empty()) {
-		Point_to_Points T;
-		while (!FQ.empty()) {
-			Point E = FQ.front();
-			size_t Ex = E.first, Ey = E.second;
-			Points As = ascendants(Ex, Ey);
-			for (Points::const_iterator As_it = As.begin(); As_it != As.end(); ++As_it) {
-				Point A = *As_it;
-				size_t Ax = A.first, Ay = A.second;
-				float Ah = elevation(Ax, Ay);
-				if (Ah == UNKNOWN_ELEVATION) {
-					T[A].insert(E);
+	// Progress counts each known point once when it joins the frontier and once when its ascendants are visited
+	size_t i = _known_elevations;
+	if (pd) {
+		pd->progress((float)i / (np * 2));
+		if (pd->canceled()) { goto cleanup; }
+	}
+	for (bool waves = true; waves;) {
+		for (size_t Ey = 0; Ey < _height; Ey++) {
+			if (!frontier_rows[Ey]) { continue; }
+			for (size_t Ex = 0, E = Ey * _width; Ex < _width; Ex++, E++) {
+				if (state[E] != -1.0f) { continue; }
+				state[E] = 0.0f;
+				i++;
+				size_t As[4];
+				size_t nas = ascendants(Ex, Ey, As);
+				for (size_t a = 0; a < nas; a++) {
+					size_t A = As[a];
+					if (_elevations[A] != UNKNOWN_ELEVATION) { continue; }
+					size_t Ax = A % _width, Ay = A / _width;
+					float d = euclidean_distance(Ax, Ay, Ex, Ey);
+					float weight = 1.0f - sigma * (1.0f - pow(1.0f - d / max_d, I));
+					float *sum = sums + A * 3;
+					sum[0] += _elevations[E] * weight;
+					sum[1] += _hardnesses[E] * weight;
+					sum[2] += _solubilities[E] * weight;
+					state[A] += 1.0f;
+					next_rows[Ay] = 1;
 				}
 			}
-			FQ.pop();
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(i + 1) / (np * 2));
-				Fl::check();
-				if (pd->canceled()) { return false; }
-			}
-			i++;
 		}
-		for (Point_to_Points::iterator T_it = T.begin(); T_it != T.end(); ++T_it) {
-			Point A = (*T_it).first;
-			Points Cs = (*T_it).second;
-			float ce = 0.0f, ch = 0.0f, cs = 0.0f;
-			size_t n = 0;
-			for (Points::const_iterator Cs_it = Cs.begin(); Cs_it != Cs.end(); ++Cs_it) {
-				Point C = *Cs_it;
-				float weight = 1.0f - sigma * (1.0f - pow(1.0f - euclidean_distance(A, C) / max_d, I));
-				Column c = column(C.first, C.second);
-				ce += c.elevation * weight;
-				ch += c.hardness * weight;
-				cs += c.solubility * weight;
-				n++;
-			}
-			Column &c = column(A.first, A.second);
-			c.elevation = ce / n;
-			c.hardness = ch / n;
-			c.solubility = cs / n;
-			_known_elevations++;
-			FQ.push(A);
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(i + 1) / (np * 2));
-				Fl::check();
-				if (pd->canceled()) { return false; }
+		waves = false;
+		for (size_t y = 0; y < _height; y++) {
+			if (!next_rows[y]) { continue; }
+			for (size_t A = y * _width; A < (y + 1) * _width; A++) {
+				if (state[A] <= 0.0f) { continue; }
+				const float *sum = sums + A * 3;
+				_elevations[A] = sum[0] / state[A];
+				_hardnesses[A] = sum[1] / state[A];
+				_solubilities[A] = sum[2] / state[A];
+				_known_elevations++;
+				state[A] = -1.0f;
+				waves = true;
+				i++;
 			}
-			i++;
+		}
+		frontier_rows.swap(next_rows);
+		std::fill(next_rows.begin(), next_rows.end(), 0);
+		if (pd) {
+			pd->progress((float)i / (np * 2));
+			if (pd->canceled()) { goto cleanup; }
 		}
 	}
-	return true;
+	success = true;
+cleanup:
+	delete_work_planes(state, spill);
+	return success;
+}
+
+static bool grid_index(size_t v, double d, size_t &k) {
+	// Smallest k such that floor(k * d) == v, if one exists
+	k = (size_t)ceil(v / d);
+	return k * d < v + 1.0;
+}
+
+static bool midpoint_index(size_t v, double d, double hd, size_t &k) {
+	// Smallest k such that floor(hd + k * d) == v, if one exists
+	k = v < hd ? 0 : (size_t)ceil((v - hd) / d);
+	double p = hd + k * d;
+	return p >= v && p < v + 1.0;
 }
 
-Points Heightmap::ascendants(size_t mx, size_t my) const {
-	Points as;
+static size_t add_ascendant(size_t *as, size_t n, size_t a) {
+	// Parents can coincide once the level spacing drops below one column
+	for (size_t i = 0; i < n; i++) {
+		if (as[i] == a) { return n; }
+	}
+	as[n] = a;
+	return n + 1;
+}
+
+size_t Heightmap::ascendants(size_t mx, size_t my, size_t as[4]) const {
+	// The diamond-square steps at each subdivision level place their midpoints at floor(hd + k * d) and their
+	// corners at floor(k * d) along each axis, so the level and parents of a point follow directly from its
+	// coordinates instead of from scanning every square and diamond. Level spacings are exact dyadic fractions of
+	// the heightmap dimensions, so they are computed in double precision. The ascendants' column indexes are
+	// stored in as, and their count is returned.
+	size_t n = 0;
+	if (_width < 2 || _height < 2) { return n; }
 	if ((mx == 0 || mx == _width - 1) && (my == 0 || my == _height - 1)) {
-		return as;
+		return n;
 	}
-	for (float dx = (float)(_width - 1), dy = (float)(_height - 1); /*true*/; dx /= 2.0f, dy /= 2.0f) {
-		float hdx = dx / 2.0f, hdy = dy / 2.0f;
+	for (double dx = (double)(_width - 1), dy = (double)(_height - 1); dx >= 0.25 || dy >= 0.25; dx /= 2.0, dy /= 2.0) {
+		double hdx = dx / 2.0, hdy = dy / 2.0;
+		size_t kx, ky;
 		// square
-		for (float py = hdy; py < _height; py += dy) {
-			if ((size_t)floor(py) != my) { continue; }
-			for (float px = hdx; px < _width; px += dx) {
-				if ((size_t)floor(px) != mx) { continue; }
-				size_t x0 = (size_t)floor(px - hdx), x1 = (size_t)floor(px + hdx);
-				size_t y0 = (size_t)floor(py - hdy), y1 = (size_t)floor(py + hdy);
-				if (px >= hdx && py >= hdy) { as.insert(std::make_pair(x0, y0)); }
-				if (x1 < _width && py >= hdy) { as.insert(std::make_pair(x1, y0)); }
-				if (px >= hdx && y1 < _height) { as.insert(std::make_pair(x0, y1)); }
-				if (x1 < _width && y1 < _height) { as.insert(std::make_pair(x1, y1)); }
-				return as;
-			}
+		bool mid_x = midpoint_index(mx, dx, hdx, kx), mid_y = midpoint_index(my, dy, hdy, ky);
+		if (mid_x && mid_y) {
+			double px = hdx + kx * dx, py = hdy + ky * dy;
+			size_t x0 = (size_t)floor(px - hdx), x1 = (size_t)floor(px + hdx);
+			size_t y0 = (size_t)floor(py - hdy), y1 = (size_t)floor(py + hdy);
+			n = add_ascendant(as, n, y0 * _width + x0);
+			if (x1 < _width) { n = add_ascendant(as, n, y0 * _width + x1); }
+			if (y1 < _height) { n = add_ascendant(as, n, y1 * _width + x0); }
+			if (x1 < _width && y1 < _height) { n = add_ascendant(as, n, y1 * _width + x1); }
+			return n;
 		}
-		// diamond
-		for (float py = 0.0f; py < _height; py += dy) {
-			float bdx = hdx, bdy = 0.0f;
-			if ((size_t)floor(py + bdy) != my) { bdx = 0.0f; bdy = hdy; }
-			if ((size_t)floor(py + bdy) != my) { continue; }
-			for (float px = 0.0f; px < _width; px += dx) {
-				if ((size_t)floor(px + bdx) != mx) { continue; }
-				size_t x0 = (size_t)floor(px + bdx - hdx), x1 = (size_t)floor(px + bdx + hdx);
-				size_t y0 = (size_t)floor(py + bdy - hdy), y1 = (size_t)floor(py + bdy + hdy);
-				if (px + bdx >= hdx) { as.insert(std::make_pair(x0, my)); }
-				if (x1 < _width) { as.insert(std::make_pair(x1, my)); }
-				if (py + bdy >= hdy) { as.insert(std::make_pair(mx, y0)); }
-				if (y1 < _height) { as.insert(std::make_pair(mx, y1)); }
-				return as;
-			}
+		// diamond, centered either on a horizontal edge (row on the grid, column at a midpoint) or a vertical edge
+		// (row at a midpoint, column on the grid); of the two, the one whose row comes first is taken
+		size_t jh, jv, gx;
+		bool horizontal = mid_x && grid_index(my, dy, jh);
+		bool vertical = midpoint_index(my, dy, hdy, jv) && jv * dy < my && grid_index(mx, dx, gx);
+		if (horizontal && (!vertical || jh <= jv)) {
+			double px = hdx + kx * dx, py = jh * dy;
+			size_t x0 = (size_t)floor(px - hdx), x1 = (size_t)floor(px + hdx);
+			size_t y0 = (size_t)floor(py - hdy), y1 = (size_t)floor(py + hdy);
+			n = add_ascendant(as, n, my * _width + x0);
+			if (x1 < _width) { n = add_ascendant(as, n, my * _width + x1); }
+			if (py >= hdy) { n = add_ascendant(as, n, y0 * _width + mx); }
+			if (y1 < _height) { n = add_ascendant(as, n, y1 * _width + mx); }
+			return n;
+		}
+		if (vertical) {
+			double px = gx * dx, py = hdy + jv * dy;
+			size_t x0 = (size_t)floor(px - hdx), x1 = (size_t)floor(px + hdx);
+			size_t y0 = (size_t)floor(py - hdy), y1 = (size_t)floor(py + hdy);
+			if (px >= hdx) { n = add_ascendant(as, n, my * _width + x0); }
+			if (x1 < _width) { n = add_ascendant(as, n, my * _width + x1); }
+			n = add_ascendant(as, n, y0 * _width + mx);
+			if (y1 < _height) { n = add_ascendant(as, n, y1 * _width + mx); }
+			return n;
 		}
 	}
+	return n;
 }
 
-bool Heightmap::midpoint_displacement_diamond_square(float H, float rt, float rs, Progress_Dialog *pd) {
-	// Midpoint Displacement (MD) step of MCMD algorithm, using diamond-square MD
-	size_t denom = 1;
-	size_t np = _width * _height;
+// Marks a neighbor past the edge of the heightmap
+static const size_t NO_CELL = (size_t)-1;
+
+struct Level_Axis {
+	// One axis of a diamond-square subdivision level: the cells of its midpoints (at hd + k * d) and grid points (at
+	// k * d), their neighbors half a spacing away (or NO_CELL past an edge), whether each is the first point of its
+	// kind to land on its cell, and the index of the first point of the other kind on the same cell (or NO_CELL)
+	std::vector<size_t> mid, mid_lo, mid_hi, mid_to_grid;
+	std::vector<size_t> grid, grid_lo, grid_hi, grid_to_mid;
+	std::vector<char> mid_first, grid_first;
+};
+
+static void level_axis(size_t n, double d, double hd, Level_Axis &a) {
+	for (size_t k = 0; hd + k * d < n; k++) {
+		double p = hd + k * d;
+		size_t v = (size_t)floor(p), hi = (size_t)floor(p + hd), km, kg;
+		a.mid.push_back(v);
+		a.mid_lo.push_back((size_t)floor(p - hd));
+		a.mid_hi.push_back(hi < n ? hi : NO_CELL);
+		a.mid_first.push_back(midpoint_index(v, d, hd, km) && km == k);
+		a.mid_to_grid.push_back(grid_index(v, d, kg) ? kg : NO_CELL);
+	}
+	for (size_t k = 0; k * d < n; k++) {
+		double p = k * d;
+		size_t v = (size_t)floor(p), hi = (size_t)floor(p + hd), km, kg;
+		a.grid.push_back(v);
+		a.grid_lo.push_back(p >= hd ? (size_t)floor(p - hd) : NO_CELL);
+		a.grid_hi.push_back(hi < n ? hi : NO_CELL);
+		a.grid_first.push_back(grid_index(v, d, kg) && kg == k);
+		a.grid_to_mid.push_back(midpoint_index(v, d, hd, km) ? km : NO_CELL);
+	}
+}
+
+bool Heightmap::midpoint_displacement_diamond_square(float H, float rt, float rs, unsigned int seed, Progress *pd) {
+	Stage_Timer timer("interpolate: MD");
+	timer.cells(_width * _height - _known_elevations);
+	// Midpoint Displacement (MD) step of MCMD algorithm, using diamond-square MD.
+	// Each level's squares only read cells known before the level, and its diamonds only read those and the squares'
+	// cells, so each step runs across threads. When several points of a step land on the same cell, as they can once
+	// the spacing drops below two columns, only the one that a row-major sweep would reach first samples it, so the
+	// results match a serial sweep.
+	std::vector<Level_Axis> xs, ys;
+	size_t ns = 0;
+	for (double dx = (double)(_width - 1), dy = (double)(_height - 1); dx > 0.5 && dy > 0.5; dx /= 2.0, dy /= 2.0) {
+		xs.push_back(Level_Axis());
+		ys.push_back(Level_Axis());
+		level_axis(_width, dx, dx / 2.0, xs.back());
+		level_axis(_height, dy, dy / 2.0, ys.back());
+		ns += xs.back().mid.size() * ys.back().mid.size() + xs.back().mid.size() * ys.back().grid.size() +
+			xs.back().grid.size() * ys.back().mid.size();
+	}
 	if (pd) {
-		denom = np / PROGRESS_STEPS;
-		if (!denom) { denom = 1; }
 		pd->message("Interpolating top-down...");
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	// Ensure that corners exist
 	for (size_t cy = 0; cy < _height; cy += _height - 1) {
 		for (size_t cx = 0; cx < _width; cx += _width - 1) {
-			if (elevation(cx, cy) == UNKNOWN_ELEVATION) { elevation(cx, cy, (float)random01()); }
+			size_t c = cy * _width + cx;
+			if (_elevations[c] != UNKNOWN_ELEVATION) { continue; }
+			_elevations[c] = random01(seed, CORNER_STREAM, c);
+			_known_elevations++;
 		}
 	}
 	// Diamond-square algorithm
-	float dx = (float)(_width - 1), dy = (float)(_height - 1);
 	size_t i = 0;
-	while (dx > 0.5f && dy > 0.5f) {
-		float hdx = dx / 2.0f, hdy = dy / 2.0f;
-		// Squares
-		for (float py = hdy; py < _height; py += dy) {
-			for (float px = hdx; px < _width; px += dx) {
-				sample_square(px, py, hdx, hdy, rt, rs);
-				if (pd && !((i + 1) % denom)) {
-					pd->progress((float)(i + 1) / np);
-					Fl::check();
-					if (pd->canceled()) { return false; }
+	for (size_t l = 0; l < xs.size(); l++) {
+		const Level_Axis &x = xs[l], &y = ys[l];
+		// Squares, centered on midpoints of both axes
+		size_t batch_rows = MAX(DIAMOND_SQUARE_BATCH_SAMPLES / MAX(x.mid.size(), (size_t)1), (size_t)1);
+		for (size_t j0 = 0; j0 < y.mid.size(); j0 += batch_rows) {
+			size_t j1 = MIN(j0 + batch_rows, y.mid.size());
+			std::atomic<size_t> sampled(0);
+			parallel_for(j0, j1, [&](size_t r0, size_t r1) {
+				size_t n = 0;
+				for (size_t j = r0; j < r1; j++) {
+					if (!y.mid_first[j]) { continue; }
+					size_t my = y.mid[j], y0 = y.mid_lo[j], y1 = y.mid_hi[j];
+					for (size_t k = 0; k < x.mid.size(); k++) {
+						if (!x.mid_first[k]) { continue; }
+						size_t mx = x.mid[k], x0 = x.mid_lo[k], x1 = x.mid_hi[k];
+						size_t neighbors[4] = {
+							y0 * _width + x0,
+							x1 != NO_CELL ? y0 * _width + x1 : NO_CELL,
+							y1 != NO_CELL ? y1 * _width + x0 : NO_CELL,
+							x1 != NO_CELL && y1 != NO_CELL ? y1 * _width + x1 : NO_CELL
+						};
+						if (displace(my * _width + mx, neighbors, rt, rs, seed, SQUARE_STREAM)) { n++; }
+					}
 				}
-				i++;
+				sampled += n;
+			});
+			_known_elevations += sampled;
+			i += (j1 - j0) * x.mid.size();
+			if (pd) {
+				pd->progress((float)i / ns);
+				if (pd->canceled()) { return false; }
 			}
 		}
-		// Diamonds
-		for (float py = 0.0f; py < _height; py += dy) {
-			for (float px = 0.0f; px < _width; px += dx) {
-				sample_diamond(px + hdx, py, hdx, hdy, rt, rs);
-				if (pd && !((i + 1) % denom)) {
-					pd->progress((float)(i + 1) / np);
-					Fl::check();
-					if (pd->canceled()) { return false; }
-				}
-				i++;
-				sample_diamond(px, py + hdy, hdx, hdy, rt, rs);
-				if (pd && !((i + 1) % denom)) {
-					pd->progress((float)(i + 1) / np);
-					Fl::check();
-					if (pd->canceled()) { return false; }
+		// Diamonds, centered either on horizontal edges (row j on the grid, column k at a midpoint) or on vertical
+		// edges (row j at a midpoint, column k on the grid); a row-major sweep reaches both for row j before row j + 1,
+		// and the horizontal one first for the same k
+		size_t diamond_rows = MAX(y.grid.size(), y.mid.size());
+		batch_rows = MAX(DIAMOND_SQUARE_BATCH_SAMPLES / (x.mid.size() + x.grid.size()), (size_t)1);
+		for (size_t j0 = 0; j0 < diamond_rows; j0 += batch_rows) {
+			size_t j1 = MIN(j0 + batch_rows, diamond_rows);
+			std::atomic<size_t> sampled(0);
+			parallel_for(j0, j1, [&](size_t r0, size_t r1) {
+				size_t n = 0;
+				for (size_t j = r0; j < r1; j++) {
+					if (j < y.grid.size() && y.grid_first[j]) {
+						size_t my = y.grid[j], y0 = y.grid_lo[j], y1 = y.grid_hi[j], jv = y.grid_to_mid[j];
+						for (size_t k = 0; k < x.mid.size(); k++) {
+							if (!x.mid_first[k]) { continue; }
+							size_t kv = x.mid_to_grid[k];
+							// A vertical edge diamond reached earlier samples the same cell
+							if (jv != NO_CELL && kv != NO_CELL && (jv < j || (jv == j && kv < k))) { continue; }
+							size_t mx = x.mid[k];
+							size_t neighbors[4] = {
+								my * _width + x.mid_lo[k],
+								x.mid_hi[k] != NO_CELL ? my * _width + x.mid_hi[k] : NO_CELL,
+								y0 != NO_CELL ? y0 * _width + mx : NO_CELL,
+								y1 != NO_CELL ? y1 * _width + mx : NO_CELL
+							};
+							if (displace(my * _width + mx, neighbors, rt, rs, seed, DIAMOND_STREAM)) { n++; }
+						}
+					}
+					if (j < y.mid.size() && y.mid_first[j]) {
+						size_t my = y.mid[j], y0 = y.mid_lo[j], y1 = y.mid_hi[j], jh = y.mid_to_grid[j];
+						for (size_t k = 0; k < x.grid.size(); k++) {
+							if (!x.grid_first[k]) { continue; }
+							size_t kh = x.grid_to_mid[k];
+							// A horizontal edge diamond reached earlier samples the same cell
+							if (jh != NO_CELL && kh != NO_CELL && (jh < j || (jh == j && kh <= k))) { continue; }
+							size_t mx = x.grid[k];
+							size_t neighbors[4] = {
+								x.grid_lo[k] != NO_CELL ? my * _width + x.grid_lo[k] : NO_CELL,
+								x.grid_hi[k] != NO_CELL ? my * _width + x.grid_hi[k] : NO_CELL,
+								y0 * _width + mx,
+								y1 != NO_CELL ? y1 * _width + mx : NO_CELL
+							};
+							if (displace(my * _width + mx, neighbors, rt, rs, seed, DIAMOND_STREAM)) { n++; }
+						}
+					}
 				}
-				i++;
+				sampled += n;
+			});
+			_known_elevations += sampled;
+			i += (MIN(j1, y.grid.size()) - MIN(j0, y.grid.size())) * x.mid.size() +
+				(MIN(j1, y.mid.size()) - MIN(j0, y.mid.size())) * x.grid.size();
+			if (pd) {
+				pd->progress((float)i / ns);
+				if (pd->canceled()) { return false; }
 			}
 		}
-		dx = hdx; dy = hdy;
 		rs *= pow(2.0f, -H);
 	}
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
 }
 
-void Heightmap::sample_square(float px, float py, float hdx, float hdy, float rt, float rs) {
-	size_t mx = (size_t)floor(px), my = (size_t)floor(py);
-	if (px < 0.0f || mx >= _width || py < 0.0f || my >= _height) { return; }
-	if (elevation(mx, my) != UNKNOWN_ELEVATION) { return; }
-	size_t x0 = (size_t)floor(px - hdx), x1 = (size_t)floor(px + hdx);
-	size_t y0 = (size_t)floor(py - hdy), y1 = (size_t)floor(py + hdy);
-	size_t denom = 0;
-	float mean = 0.0f;
-	if (px >= hdx && py >= hdy) { mean += elevation(x0, y0); denom++; }
-	if (x1 < _width && py >= hdy) { mean += elevation(x1, y0); denom++; }
-	if (px >= hdx && y1 < _height) { mean += elevation(x0, y1); denom++; }
-	if (x1 < _width && y1 < _height) { mean += elevation(x1, y1); denom++; }
-	mean /= denom;
-	float noise = (random11() + rt) * rs;
-	float value = clamp01(mean + noise);
-	Column &c = column(mx, my);
-	c.elevation = value;
-	c.hardness = derive_hardness(c.elevation);
-	c.solubility = derive_solubility(c.elevation);
-	_known_elevations++;
-}
-
-void Heightmap::sample_diamond(float px, float py, float hdx, float hdy, float rt, float rs) {
-	size_t mx = (size_t)floor(px), my = (size_t)floor(py);
-	if (px < 0.0f || mx >= _width || py < 0.0f || my >= _height) { return; }
-	if (elevation(mx, my) != UNKNOWN_ELEVATION) { return; }
-	size_t x0 = (size_t)floor(px - hdx), x1 = (size_t)floor(px + hdx);
-	size_t y0 = (size_t)floor(py - hdy), y1 = (size_t)floor(py + hdy);
+bool Heightmap::displace(size_t i, const size_t neighbors[4], float rt, float rs, unsigned int seed,
+	unsigned int stream) {
+	// Set an unknown column to the mean of its known neighbors plus noise, returning whether it was set
+	if (_elevations[i] != UNKNOWN_ELEVATION) { return false; }
 	size_t denom = 0;
 	float mean = 0.0f;
-	if (px >= hdx) { mean += elevation(x0, my); denom++; }
-	if (x1 < _width) { mean += elevation(x1, my); denom++; }
-	if (py >= hdy) { mean += elevation(mx, y0); denom++; }
-	if (y1 < _height) { mean += elevation(mx, y1); denom++; }
+	for (int n = 0; n < 4; n++) {
+		if (neighbors[n] != NO_CELL) { mean += _elevations[neighbors[n]]; denom++; }
+	}
 	mean /= denom;
-	float noise = (random11() + rt) * rs;
+	float noise = (random11(seed, stream, i) + rt) * rs;
 	float value = clamp01(mean + noise);
-	Column &c = column(mx, my);
-	c.elevation = value;
-	c.hardness = derive_hardness(c.elevation);
-	c.solubility = derive_solubility(c.elevation);
-	_known_elevations++;
+	_elevations[i] = value;
+	_hardnesses[i] = derive_hardness(value, seed, i);
+	_solubilities[i] = derive_solubility(value, seed, i);
+	return true;
+}
+
+static void distribute_erosion_row(const Erosion_Buffers &eb, const Erosion_Parameters &ep, size_t y,
+	float *block_changes, double &sum_squares, float &max_delta) {
+	// Add a row's material deltas to its simulated columns, then evaporate, settled columns included. When measuring,
+	// also total the squares and find the largest of the elevation changes, and each simulated block's largest change
+	// in elevation, water or sediment.
+	size_t w = eb.width, blocks_x = (w + EROSION_BLOCK_SIZE - 1) / EROSION_BLOCK_SIZE;
+	const unsigned char *active = eb.active_blocks ? eb.active_blocks + y / EROSION_BLOCK_SIZE * blocks_x : NULL;
+	for (size_t b = 0; b < blocks_x; b++) {
+		size_t i0 = y * w + b * EROSION_BLOCK_SIZE, i1 = y * w + MIN((b + 1) * EROSION_BLOCK_SIZE, w);
+		if (active && active[b] == EROSION_BLOCK_SETTLED) {
+			if (ep.hydraulic) {
+				for (size_t i = i0; i < i1; i++) { eb.water_map[i] *= ep.Ke; }
+			}
+			continue;
+		}
+		float change = 0.0f;
+		for (size_t i = i0; i < i1; i++) {
+			float water = eb.water_map[i];
+			if (eb.elevations[i] != Heightmap::UNKNOWN_ELEVATION) {
+				float elevation_delta = eb.elevation_deltas[i];
+				eb.elevations[i] += elevation_delta;
+				eb.water_map[i] += eb.water_deltas[i];
+				eb.sediment_map[i] += eb.sediment_deltas[i];
+				if (block_changes) {
+					float d = (float)fabs(elevation_delta);
+					sum_squares += (double)d * d;
+					max_delta = MAX(max_delta, d);
+					change = MAX(change, MAX(d, (float)fabs(eb.sediment_deltas[i])));
+				}
+			}
+			if (ep.hydraulic) { eb.water_map[i] *= ep.Ke; }
+			if (block_changes) { change = MAX(change, (float)fabs(eb.water_map[i] - water)); }
+		}
+		if (block_changes) { block_changes[b] = change; }
+	}
+}
+
+static size_t settle_blocks(const Erosion_Buffers &eb, std::vector<unsigned char> &active_blocks,
+	const std::vector<float> &block_changes, float tolerance) {
+	// A block stays active while it or a neighbor changed by tolerance or more in the last time step, and the blocks
+	// around the active ones border them; returns how many columns the active and border blocks hold. A block that
+	// stops being active has its outflows cleared, so its neighbors take no material from it and only the border
+	// blocks' deltas can change it, which keeps the material that crosses into the border.
+	size_t w = eb.width, h = eb.height;
+	size_t blocks_x = (w + EROSION_BLOCK_SIZE - 1) / EROSION_BLOCK_SIZE;
+	size_t blocks_y = (h + EROSION_BLOCK_SIZE - 1) / EROSION_BLOCK_SIZE;
+	std::vector<unsigned char> changed(active_blocks.size(), 0), was_active(active_blocks.size(), 0);
+	for (size_t by = 0, b = 0; by < blocks_y; by++) {
+		for (size_t bx = 0; bx < blocks_x; bx++, b++) {
+			was_active[b] = active_blocks[b] == EROSION_BLOCK_ACTIVE;
+			if (active_blocks[b] == EROSION_BLOCK_SETTLED) { continue; }
+			for (size_t y = by * EROSION_BLOCK_SIZE; y < MIN((by + 1) * EROSION_BLOCK_SIZE, h) && !changed[b]; y++) {
+				changed[b] = block_changes[y * blocks_x + bx] >= tolerance;
+			}
+		}
+	}
+	for (size_t by = 0, b = 0; by < blocks_y; by++) {
+		for (size_t bx = 0; bx < blocks_x; bx++, b++) {
+			bool active = false;
+			for (size_t ny = by > 0 ? by - 1 : 0; ny <= MIN(by + 1, blocks_y - 1) && !active; ny++) {
+				for (size_t nx = bx > 0 ? bx - 1 : 0; nx <= MIN(bx + 1, blocks_x - 1) && !active; nx++) {
+					active = changed[ny * blocks_x + nx] != 0;
+				}
+			}
+			active_blocks[b] = active ? EROSION_BLOCK_ACTIVE : EROSION_BLOCK_SETTLED;
+		}
+	}
+	size_t columns = 0;
+	for (size_t by = 0, b = 0; by < blocks_y; by++) {
+		for (size_t bx = 0; bx < blocks_x; bx++, b++) {
+			if (active_blocks[b] != EROSION_BLOCK_ACTIVE) {
+				for (size_t ny = by > 0 ? by - 1 : 0; ny <= MIN(by + 1, blocks_y - 1); ny++) {
+					for (size_t nx = bx > 0 ? bx - 1 : 0; nx <= MIN(bx + 1, blocks_x - 1); nx++) {
+						if (active_blocks[ny * blocks_x + nx] == EROSION_BLOCK_ACTIVE) {
+							active_blocks[b] = EROSION_BLOCK_BORDER;
+						}
+					}
+				}
+			}
+			size_t x0 = bx * EROSION_BLOCK_SIZE, x1 = MIN(x0 + EROSION_BLOCK_SIZE, w);
+			size_t y0 = by * EROSION_BLOCK_SIZE, y1 = MIN(y0 + EROSION_BLOCK_SIZE, h);
+			if (was_active[b] && active_blocks[b] != EROSION_BLOCK_ACTIVE) {
+				for (size_t y = y0; y < y1; y++) {
+					for (size_t i = y * w + x0; i < y * w + x1; i++) {
+						eb.total_elevation_diffs[i] = eb.total_talus_diffs[i] = eb.taluses[i] = 0.0f;
+					}
+				}
+			}
+			if (active_blocks[b] != EROSION_BLOCK_SETTLED) { columns += (x1 - x0) * (y1 - y0); }
+		}
+	}
+	return columns;
 }
 
 bool Heightmap::erode(size_t nts, bool thermal, float Kt, float Ka, float Ki, bool hydraulic, float Kc, float Kd,
-	float Ks, float Ke, float W0, float Wmin, Progress_Dialog *pd) {
+	float Ks, float Ke, float W0, float Wmin, float tolerance, bool skip_settled, Progress *pd) {
 	// Thermal and hydraulic erosion algorithms from
 	// "Fast Hydraulic and Thermal Erosion on the GPU" (Jako, 2011),
 	// "Physically Based Hydraulic Erosion Simulation on Graphics Processing Unit" (Anh et al., 2007), and
 	// "The Synthesis and Rendering of Eroded Fractal Terrains" (Musgrave, 1989)
+	Stage_Timer timer("erode");
+	touch_all();
 	if (pd) {
 		pd->canceled(false);
 	}
 	bool success = false;
-	size_t denom = 1;
 	size_t np = _width * _height;
 	if (pd) {
-		denom = np * nts / (PROGRESS_STEPS * 10);
-		if (!denom) { denom = 1; }
 		char *message = thermal ?
 			(hydraulic ? "Applying hydraulic and thermal erosion..." : "Applying thermal erosion...") :
 			(hydraulic ? "Applying hydraulic erosion..." : "No erosion");
 		pd->message(message);
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
-	float *elevation_deltas = new(std::nothrow) float[np]();
-	float *water_deltas = new(std::nothrow) float[np]();
-	float *sediment_deltas = new(std::nothrow) float[np]();
-	float *water_map = new(std::nothrow) float[np]();
-	float *sediment_map = new(std::nothrow) float[np]();
-	float *min_talus_angles = new(std::nothrow) float[np]();
-	if (!elevation_deltas || !water_deltas || !sediment_deltas || !water_map || !sediment_map || !min_talus_angles) {
-		goto cleanup;
+	Erosion_Parameters ep;
+	ep.thermal = thermal;
+	ep.hydraulic = hydraulic;
+	ep.Kt = Kt; ep.Ka = Ka; ep.Ki = Ki;
+	ep.Kc = Kc; ep.Kd = Kd; ep.Ks = Ks; ep.Ke = Ke;
+	ep.W0 = W0; ep.Wmin = Wmin;
+	Erosion_Buffers eb;
+	eb.width = _width;
+	eb.height = _height;
+	// The kernels work on the heightmap's own planes, so elevations change in place
+	eb.elevations = _elevations;
+	eb.hardnesses = _hardnesses;
+	eb.solubilities = _solubilities;
+	// Rain only falls when erosion starts; later erosions continue with the water and sediment already there
+	bool rain = !_water_levels;
+	if (rain && !allocate_erosion()) { return false; }
+	eb.water_map = _water_levels;
+	eb.sediment_map = _sediment_levels;
+	Mapped_Memory spill;
+	size_t stride;
+	float *work_planes = new_work_planes(np, EROSION_WORK_PLANES, stride, spill);
+	if (!work_planes) {
+		if (rain) { discard_erosion(); }
+		return false;
 	}
-	// Rainfall
+	eb.talus_slopes = work_planes;
+	eb.total_elevation_diffs = work_planes + stride;
+	eb.total_talus_diffs = work_planes + stride * 2;
+	eb.taluses = work_planes + stride * 3;
+	eb.elevation_deltas = work_planes + stride * 4;
+	eb.water_deltas = work_planes + stride * 5;
+	eb.sediment_deltas = work_planes + stride * 6;
+	// Talus slopes and rainfall
 	for (size_t i = 0; i < np; i++) {
-		water_map[i] = Wmin + W0 * elevation(i);
-		min_talus_angles[i] = atan(_heightmap[i].hardness * Ka + Ki);
+		eb.talus_slopes[i] = eb.hardnesses[i] * Ka + Ki;
+		if (rain) { eb.water_map[i] = Wmin + W0 * eb.elevations[i]; }
 	}
-	// Iterate erosion over time
-	size_t ti = 0;
-	for (size_t t = 0; t < nts; t++) {
-		// Reset material deltas
-		for (size_t i = 0; i < np; i++) {
-			elevation_deltas[i] = water_deltas[i] = sediment_deltas[i] = 0.0f;
-		}
-		// For each column, handle erosion processes
-		for (size_t y = 0; y < _height; y++) {
-			for (size_t x = 0; x < _width; x++) {
-				size_t i = y * _width + x;
-				float min_talus_angle = min_talus_angles[i];
-				Column &c = column(i);
-				float local_elevation_diffs[3][3] = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
-				float total_elevation_diff = 0.0f, total_talus_diff = 0.0f, max_elevation_diff = 0.0f;
-				// For each neighbor, find their elevation difference
-				for (int dy = -1; dy <= 1; dy++) {
-					if ((y == 0 && dy == -1) || (y == _height - 1 && dy == 1)) { continue; }
-					size_t oy = y + dy;
-					for (int dx = -1; dx <= 1; dx++) {
-						if ((x == 0 && dx == -1) || (x == _width - 1 && dx == 1) || (dy == 0 && dx == 0)) { continue; }
-						size_t ox = x + dx;
-						float oh = elevation(ox, oy);
-						float elevation_diff = c.elevation - oh;
-						if (elevation_diff <= 0.0f) { continue; }
-						local_elevation_diffs[dy + 1][dx + 1] = elevation_diff;
-						total_elevation_diff += elevation_diff;
-						float distance = (dx != 0 && dy != 0 ? (float)SQRT_2 : 1.0f) / 255.0f; // corners are more distant
-						float talus_angle = atan2(elevation_diff, distance);
-						if (talus_angle >= min_talus_angle) {
-							local_elevation_diffs[dy + 1][dx + 1] *= -1; // negative differences indicate use for thermal erosion
-							if (elevation_diff > max_elevation_diff) { max_elevation_diff = elevation_diff; }
-							total_talus_diff += elevation_diff;
-						}
+	// Adaptive erosion measures each row's changes as it is distributed, then sums the rows in order, so the result
+	// is the same on any number of threads. Blocks start out active, since the last erosion's changes are unknown.
+	bool measure = tolerance > 0.0f, converged = false;
+	size_t blocks_x = (_width + EROSION_BLOCK_SIZE - 1) / EROSION_BLOCK_SIZE;
+	size_t blocks_y = (_height + EROSION_BLOCK_SIZE - 1) / EROSION_BLOCK_SIZE;
+	std::vector<double> row_squares(measure ? _height : 0);
+	std::vector<float> row_max_deltas(measure ? _height : 0), block_changes(measure ? _height * blocks_x : 0);
+	std::vector<unsigned char> active_blocks(measure && skip_settled ? blocks_x * blocks_y : 0, EROSION_BLOCK_ACTIVE);
+	eb.active_blocks = active_blocks.empty() ? NULL : &active_blocks[0];
+	size_t active_columns = np;
+	// Each sweep advances several time steps across the map, a tile of rows at a time. Within a step, tile j's
+	// outflows are found while tile j - 2's deltas are gathered and tile j - 4's are distributed, so each pass only
+	// reads rows that the earlier passes have finished. Each step follows EROSION_STEP_LAG tiles behind the one before
+	// it, past the rows whose last step it reads, so only the tiles between the first step and the last stay in use.
+	// Each thread keeps its band of rows from each of those tiles in use, so a sweep advances as many steps as fit
+	// that many one-row bands in EROSION_SWEEP_BYTES, and each band is brought into cache once per sweep instead of
+	// once per step. Maps too wide for two steps to fit (about 4000 columns), and adaptive erosion, which measures
+	// each step as a whole, sweep one step at a time with no reuse between steps.
+	size_t row_bytes = _width * (EROSION_WORK_PLANES + EROSION_LAYERS + 3) * sizeof(float);
+	size_t fit_tiles = EROSION_SWEEP_BYTES / row_bytes;
+	size_t sweep_steps = measure || fit_tiles < EROSION_STEP_LAG + 5 ? 1 :
+		MIN((fit_tiles - 5) / EROSION_STEP_LAG + 1, EROSION_SWEEP_STEPS);
+	size_t sweep_tiles = EROSION_STEP_LAG * (sweep_steps - 1) + 5;
+	size_t tile_rows = (sweep_steps > 1 ? fit_tiles / sweep_tiles : EROSION_BAND_ROWS) * thread_count();
+	size_t num_tiles = (_height + tile_rows - 1) / tile_rows;
+	for (size_t t = 0, n = 0; t < nts; t += n) {
+		n = MIN(sweep_steps, nts - t);
+		// Each thread handles the same share of rows from each of the tiles, and the threads wait for one another
+		// before moving on to the next tiles
+		Barrier barrier(MIN(thread_count(), tile_rows));
+		parallel_for(0, tile_rows, [&](size_t r0, size_t r1) {
+			for (size_t k = 0; k < num_tiles + EROSION_STEP_LAG * (n - 1) + 4; k++) {
+				for (size_t s = 0; s < n && k >= s * EROSION_STEP_LAG; s++) {
+					size_t j = k - s * EROSION_STEP_LAG;
+					if (j < num_tiles) {
+						// For each column, find its elevation differences to its neighbors
+						erosion_outflows(eb, ep, MIN(j * tile_rows + r0, _height), MIN(j * tile_rows + r1, _height));
 					}
-				}
-				// Thermal erosion
-				if (thermal && total_talus_diff > 0.0) {
-					float talus = Kt * (1.0f - c.hardness) * max_elevation_diff / 2.0f;
-					// Remove talus from column
-					elevation_deltas[i] -= talus;
-					// Move talus proportionally to each neighbor
-					for (int dy = -1; dy <= 1; dy++) {
-						if ((y == 0 && dy == -1) || (y == _height - 1 && dy == 1)) { continue; }
-						size_t oy = y + dy;
-						for (int dx = -1; dx <= 1; dx++) {
-							if ((x == 0 && dx == -1) || (x == _width - 1 && dx == 1) || (dy == 0 && dx == 0)) { continue; }
-							size_t ox = x + dx;
-							float elevation_diff = -local_elevation_diffs[dy + 1][dx + 1]; // re-negate difference
-							if (elevation_diff == 0.0f) { continue; }
-							float neighbor_proportion = elevation_diff / total_talus_diff;
-							float talus_delta = talus * neighbor_proportion;
-							elevation_deltas[oy * _width + ox] += talus_delta;
-						}
+					if (j >= 2 && j - 2 < num_tiles) {
+						// For each column, handle erosion processes
+						size_t y0 = (j - 2) * tile_rows;
+						erosion_deltas(eb, ep, MIN(y0 + r0, _height), MIN(y0 + r1, _height));
 					}
-				}
-				// Hydraulic erosion
-				if (hydraulic) {
-					if (total_elevation_diff <= 0.0 || water_map[i] == 0.0) {
-						// Deposit sediment on column
-						float sediment_delta = Kd * sediment_map[i];
-						elevation_deltas[i] += sediment_delta;
-						sediment_deltas[i] -= sediment_delta;
-					}
-					else {
-						// Move materials to each neighbor
-						for (int dy = -1; dy <= 1; dy++) {
-							if ((y == 0 && dy == -1) || (y == _height - 1 && dy == 1)) { continue; }
-							size_t oy = y + dy;
-							for (int dx = -1; dx <= 1; dx++) {
-								if ((x == 0 && dx == -1) || (x == _width - 1 && dx == 1) || (dy == 0 && dx == 0)) { continue; }
-								size_t ox = x + dx;
-								size_t j = oy * _width + ox;
-								float elevation_diff = fabs(local_elevation_diffs[dy + 1][dx + 1]); // undo negation
-								if (elevation_diff == 0.0f) { continue; }
-								float water_diff = water_map[i] - water_map[j];
-								float neighbor_proportion = elevation_diff / total_elevation_diff;
-								// Flow water to neighbor
-								float water_delta = neighbor_proportion * (elevation_diff + water_diff);
-								if (water_delta > water_map[i]) { water_delta = water_map[i]; }
-								water_deltas[i] -= water_delta;
-								water_deltas[j] += water_delta;
-								// Transport and/or deposit sediment
-								float sediment_capacity = Kc * water_delta;
-								if (sediment_map[i] >= sediment_capacity) {
-									// Transport water's capacity of sediment to neighbor; deposit excess on column
-									sediment_deltas[j] += sediment_capacity;
-									float sediment_deposited = Kd * (neighbor_proportion * sediment_map[i] - sediment_capacity);
-									elevation_deltas[i] += sediment_deposited * HYDRAULIC_CORRECTION;
-									sediment_deltas[i] -= sediment_capacity + sediment_deposited;
-								}
-								else {
-									// Transport sediment to neighbor; dissolve soil into water's excess capacity
-									float sediment_transported = neighbor_proportion * sediment_map[i];
-									float soil_dissolved = Ks * c.solubility * (sediment_capacity - sediment_transported);
-									sediment_deltas[j] += sediment_transported + soil_dissolved;
-									elevation_deltas[i] -= soil_dissolved * HYDRAULIC_CORRECTION;
-									sediment_deltas[i] -= sediment_transported;
-								}
-							}
+					if (j >= 4 && j - 4 < num_tiles) {
+						// Distribute material deltas, then evaporate
+						size_t y0 = (j - 4) * tile_rows;
+						for (size_t y = MIN(y0 + r0, _height); y < MIN(y0 + r1, _height); y++) {
+							double squares = 0.0;
+							float max_delta = 0.0f;
+							distribute_erosion_row(eb, ep, y, measure ? &block_changes[y * blocks_x] : NULL,
+								squares, max_delta);
+							if (measure) { row_squares[y] = squares; row_max_deltas[y] = max_delta; }
 						}
 					}
 				}
-				if (pd && !((ti + 1) % denom)) {
-					pd->progress((float)(ti + 1) / (np * nts));
-					Fl::check();
-					if (pd->canceled()) { goto cleanup; }
-				}
-				ti++;
+				barrier.wait();
 			}
-		}
-		// Distribute material deltas
-		for (size_t i = 0; i < np; i++) {
-			if (_heightmap[i].elevation == UNKNOWN_ELEVATION) { continue; }
-			_heightmap[i].elevation += elevation_deltas[i];
-			water_map[i] += water_deltas[i];
-			sediment_map[i] += sediment_deltas[i];
-		}
-		if (hydraulic) {
-			// Evaporation
-			for (size_t i = 0; i < np; i++) {
-				water_map[i] *= Ke;
+		});
+		_erosion_steps += n;
+		timer.cells((unsigned long long)active_columns * n);
+		if (measure) {
+			double squares = 0.0;
+			float max_delta = 0.0f;
+			for (size_t y = 0; y < _height; y++) {
+				squares += row_squares[y];
+				max_delta = MAX(max_delta, row_max_deltas[y]);
 			}
+			_erosion_max_delta = max_delta;
+			_erosion_rms_delta = (float)sqrt(squares / MAX(_known_elevations, (size_t)1));
+			converged = max_delta < tolerance;
+			if (eb.active_blocks) {
+				active_columns = settle_blocks(eb, active_blocks, block_changes, tolerance * EROSION_SETTLED_FRACTION);
+			}
+		}
+		if (pd) {
+			pd->progress((float)(t + n) / nts);
+			if (pd->canceled()) { goto cleanup; }
 		}
+		if (converged) { break; }
 	}
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { goto cleanup; }
 	}
 	success = true;
 cleanup:
-	delete [] elevation_deltas;
-	delete [] water_deltas;
-	delete [] sediment_deltas;
-	delete [] water_map;
-	delete [] sediment_map;
-	delete [] min_talus_angles;
+	// The elevations, water and sediment from every completed time step are kept
+	delete_work_planes(work_planes, spill);
 	return success;
 }
 
-bool Heightmap::calculate_normals(Progress_Dialog *pd) {
-	size_t denom = 1;
+bool Heightmap::erode_droplets(double density, size_t lifetime, float inertia, float capacity, float deposition,
+	float dissolution, float evaporation, unsigned int seed, Progress *pd) {
+	Stage_Timer timer("erode: droplets");
+	// Negative, infinite or not-a-number densities, and more droplets than can be counted, are rejected
+	if (!(density >= 0.0) || !(density * _known_elevations < 1e18)) { return false; }
+	touch_all();
+	// Droplets reshape the terrain under grid erosion's water and sediment, so grid erosion starts over
+	discard_erosion();
 	if (pd) {
 		pd->canceled(false);
 	}
-	size_t np = _width * _height;
-	size_t nt = (_width - 1) * (_height - 1) * 2;
 	if (pd) {
-		denom = (nt + nt + np) / (PROGRESS_STEPS * 10);
-		if (!denom) { denom = 1; }
-		pd->message("Calculating face normals...");
+		pd->message("Applying droplet erosion...");
 		pd->progress(0.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
-	Vector3 *face_normals = new(std::nothrow) Vector3[nt]();
-	if (!face_normals) { return false; }
-	size_t i = 0;
-	// For each triangle, calculate the normal of its face
-	for (size_t y = 0; y < _height - 1; y++) {
-		for (size_t x = 0; x < _width - 1; x++) {
-			float ha = elevation(x, y);
-			float hb = elevation(x + 1, y);
-			float hc = elevation(x + 1, y + 1);
-			float hd = elevation(x, y + 1);
-			// triangle made of <x, y, ha>, <x, y+1, hd>, <x+1, y, hb>
-			// V = <x, y+1, hd> - <x, y, ha> = <0, 1, hd-ha>
-			// W = <x+1, y, hb> - <x, y, ha> = <1, 0, hb-ha>
-			// N = V x W = <hb-ha, hd-ha, -1>
-			face_normals[i].x = hb - ha;
-			face_normals[i].y = hd - ha;
-			face_normals[i].z = -1.0f;
-			i++;
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(i + 1) / (nt + nt + np));
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] face_normals;
-					return false;
-				}
+	Droplet_Parameters dp;
+	dp.lifetime = lifetime;
+	dp.inertia = inertia; dp.capacity = capacity; dp.min_capacity = DROPLET_MIN_CAPACITY;
+	dp.deposition = deposition; dp.dissolution = dissolution; dp.evaporation = evaporation;
+	dp.gravity = DROPLET_GRAVITY;
+	// Droplets start in square tiles over twice as wide as a droplet can reach, colored like a checkerboard with
+	// four colors. Droplets from tiles of the same color can never change the same columns, so the tiles of each
+	// color run in parallel and the droplets within a tile run in order, and the result is the same on any number
+	// of threads without any locking.
+	size_t tile = MAX(DROPLET_TILE_SIZE, 2 * (lifetime + 2));
+	size_t tiles_x = (_width + tile - 1) / tile, tiles_y = (_height + tile - 1) / tile;
+	std::vector<size_t> colored_tiles[4];
+	for (size_t ty = 0; ty < tiles_y; ty++) {
+		for (size_t tx = 0; tx < tiles_x; tx++) {
+			colored_tiles[(ty % 2) * 2 + tx % 2].push_back(ty * tiles_x + tx);
+		}
+	}
+	// Each tile gets a share of the droplets in proportion to its known columns, so clipped tiles along the right
+	// and bottom edges are no denser than the rest. Droplets are numbered across the tiles in order, each at its own
+	// random position in its tile.
+	std::vector<size_t> tile_known(tiles_x * tiles_y, 0);
+	parallel_for(0, tiles_y, [&](size_t ty0, size_t ty1) {
+		for (size_t y = ty0 * tile; y < MIN(ty1 * tile, _height); y++) {
+			for (size_t x = 0; x < _width; x++) {
+				if (_elevations[y * _width + x] != UNKNOWN_ELEVATION) { tile_known[y / tile * tiles_x + x / tile]++; }
 			}
-			// triangle made of <x+1, y+1, hc>, <x+1, y, hb>, <x, y+1, hd>
-			// V = <x+1, y, hb> - <x+1, y+1, hc> = <0, -1, hb-hc>
-			// W = <x, y+1, hd> - <x+1, y+1, hc> = <-1, 0, hd-hc>
-			// N = V x W = <hc-hd, hd-hc, -1>
-			face_normals[i].x = hc - hd;
-			face_normals[i].y = hd - hc;
-			face_normals[i].z = -1.0f;
-			i++;
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(i + 1) / (nt + nt + np));
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] face_normals;
-					return false;
+		}
+	});
+	std::vector<unsigned long long> first_droplets(tile_known.size() + 1, 0);
+	size_t known = 0;
+	for (size_t t = 0; t < tile_known.size(); t++) {
+		known += tile_known[t];
+		first_droplets[t + 1] = (unsigned long long)(density * known);
+	}
+	timer.cells(first_droplets.back());
+	for (size_t r = 0; r < DROPLET_ROUNDS; r++) {
+		for (size_t c = 0; c < 4; c++) {
+			const std::vector<size_t> &tiles = colored_tiles[c];
+			parallel_for(0, tiles.size(), [&](size_t k0, size_t k1) {
+				for (size_t k = k0; k < k1; k++) {
+					size_t t = tiles[k], x0 = t % tiles_x * tile, y0 = t / tiles_x * tile;
+					float tw = (float)(MIN(x0 + tile, _width) - x0), th = (float)(MIN(y0 + tile, _height) - y0);
+					unsigned long long first = first_droplets[t], count = first_droplets[t + 1] - first;
+					unsigned long long d0 = first + count * r / DROPLET_ROUNDS;
+					unsigned long long d1 = first + count * (r + 1) / DROPLET_ROUNDS;
+					for (unsigned long long n = d0; n < d1; n++) {
+						float x = x0 + random01(seed, DROPLET_X_STREAM, n) * tw;
+						float y = y0 + random01(seed, DROPLET_Y_STREAM, n) * th;
+						erosion_droplet(_elevations, _width, _height, dp, x, y);
+					}
 				}
-			}
+			});
+		}
+		if (pd) {
+			pd->progress((float)(r + 1) / DROPLET_ROUNDS);
+			if (pd->canceled()) { return false; }
+		}
+	}
+	return true;
+}
+
+void Heightmap::edge_normal(size_t x, size_t y) {
+	// Each grid square is split into triangles <a, b, d> and <c, b, d>, where a is its top-left corner, b top-right,
+	// c bottom-right and d bottom-left. Triangle <a, b, d> has face normal <hb-ha, hd-ha, -1> and <c, b, d> has
+	// <hc-hd, hc-hb, -1>, and a column's normal is the mean of those of the triangles it is a vertex of.
+	float nx = 0.0f, ny = 0.0f;
+	size_t n = 0;
+	for (size_t qy = y > 0 ? y - 1 : 0; qy <= y && qy < _height - 1; qy++) {
+		for (size_t qx = x > 0 ? x - 1 : 0; qx <= x && qx < _width - 1; qx++) {
+			float ha = elevation(qx, qy), hb = elevation(qx + 1, qy);
+			float hc = elevation(qx + 1, qy + 1), hd = elevation(qx, qy + 1);
+			// The column is a vertex of <a, b, d> unless it is c, and of <c, b, d> unless it is a
+			if (qx != x - 1 || qy != y - 1) { nx += hb - ha; ny += hd - ha; n++; }
+			if (qx != x || qy != y) { nx += hc - hd; ny += hc - hb; n++; }
 		}
 	}
+	Vector3 &v = _normals[y * _width + x];
+	v.x = n ? nx / n : 0.0f;
+	v.y = n ? ny / n : 0.0f;
+	v.z = -1.0f;
+}
+
+void Heightmap::row_normals(size_t y, size_t x0, size_t x1) {
+	// Calculate the normals of columns x0 up to x1 in row y
+	if (y == 0 || y == _height - 1 || _width < 3) {
+		for (size_t x = x0; x < x1; x++) { edge_normal(x, y); }
+		return;
+	}
+	const float *up = _elevations + (y - 1) * _width, *row = up + _width, *down = row + _width;
+	Vector3 *normals = _normals + y * _width;
+	if (x0 == 0) { edge_normal(0, y); }
+	for (size_t x = MAX(x0, (size_t)1), xe = MIN(x1, _width - 1); x < xe; x++) {
+		float nx = 2.0f * (row[x+1] - row[x-1]) + (down[x] - down[x-1]) + (up[x+1] - up[x]);
+		float ny = 2.0f * (down[x] - up[x]) + (down[x-1] - row[x-1]) + (row[x+1] - up[x+1]);
+		normals[x].x = nx / 6.0f;
+		normals[x].y = ny / 6.0f;
+		normals[x].z = -1.0f;
+	}
+	if (x1 == _width) { edge_normal(_width - 1, y); }
+}
+
+bool Heightmap::calculate_normals(Progress *pd) {
 	if (pd) {
-		pd->message("Adding face normals...");
-		pd->progress((float)nt / (nt + nt + np));
-		Fl::check();
-		if (pd->canceled()) { return false; }
+		pd->canceled(false);
 	}
-	i = 0;
-	// For each column, add the normals of the triangles for which it is a vertex
-	for (size_t y = 0; y < _height - 1; y++) {
-		for (size_t x = 0; x < _width - 1; x++) {
-			Column &ca = column(x, y);
-			ca.normal.x += face_normals[i].x;
-			ca.normal.y += face_normals[i].y;
-			ca.normal.z += face_normals[i].z;
-			Column cb = column(x + 1, y);
-			cb.normal.x += face_normals[i].x;
-			cb.normal.y += face_normals[i].y;
-			cb.normal.z += face_normals[i].z;
-			Column &cd = column(x, y + 1);
-			cd.normal.x += face_normals[i].x;
-			cd.normal.y += face_normals[i].y;
-			cd.normal.z += face_normals[i].z;
-			i++;
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(nt + i + 1) / (nt + nt + np));
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] face_normals;
-					return false;
-				}
-			}
-			Column cc = column(x + 1, y + 1);
-			cc.normal.x += face_normals[i].x;
-			cc.normal.y += face_normals[i].y;
-			cc.normal.z += face_normals[i].z;
-			cb.normal.x += face_normals[i].x;
-			cb.normal.y += face_normals[i].y;
-			cb.normal.z += face_normals[i].z;
-			cd.normal.x += face_normals[i].x;
-			cd.normal.y += face_normals[i].y;
-			cd.normal.z += face_normals[i].z;
-			i++;
-			if (pd && !((i + 1) % denom)) {
-				pd->progress((float)(nt + i + 1) / (nt + nt + np));
-				Fl::check();
-				if (pd->canceled()) {
-					delete [] face_normals;
-					return false;
-				}
-			}
-		}
+	// While the normals are current outside some stale regions, only those regions are recalculated
+	std::vector<Region> regions;
+	if (_normals_valid) { regions = _stale_normals; }
+	else {
+		Region all = {0, 0, _width, _height};
+		regions.assign(1, all);
 	}
 	if (pd) {
-		pd->message("Averaging face normals...");
-		pd->progress((float)(nt + nt) / (nt + nt + np));
-		Fl::check();
+		pd->message("Calculating normals...");
+		pd->progress(0.0f);
 		if (pd->canceled()) { return false; }
 	}
-	// For each column, normalize its normal
-	for (i = 0; i < np; i++) {
-		float triangles = -_heightmap[i].normal.z; // all face normals have z = -1, so summing n of them gives z = -n
-		_heightmap[i].normal.x /= triangles;
-		_heightmap[i].normal.y /= triangles;
-		_heightmap[i].normal.z /= triangles;
-		if (pd && !((i + 1) % denom)) {
-			pd->progress((float)(nt + nt + i + 1) / (nt + nt + np));
-			Fl::check();
-			if (pd->canceled()) {
-				delete [] face_normals;
-				return false;
+	// Each column's normal is gathered straight from its neighbors' elevations, so rows are independent and no
+	// per-triangle normals are stored. An interior column is a vertex of six triangles, and the sum of their face
+	// normals reduces to differences of its six neighbors (see edge_normal), which the inner loop computes with no
+	// branches.
+	Stage_Timer timer("normals");
+	size_t total_rows = 0, done_rows = 0;
+	for (size_t k = 0; k < regions.size(); k++) {
+		total_rows += regions[k].y1 - regions[k].y0;
+		timer.cells((regions[k].x1 - regions[k].x0) * (regions[k].y1 - regions[k].y0));
+	}
+	for (size_t k = 0; k < regions.size(); k++) {
+		const Region &r = regions[k];
+		if (r.x0 >= r.x1) { continue; }
+		size_t batch_rows = MAX(NORMALS_BATCH_COLUMNS / (r.x1 - r.x0), (size_t)1);
+		for (size_t y0 = r.y0; y0 < r.y1; y0 += batch_rows) {
+			size_t y1 = MIN(y0 + batch_rows, r.y1);
+			parallel_for(y0, y1, [&](size_t r0, size_t r1) {
+				for (size_t y = r0; y < r1; y++) { row_normals(y, r.x0, r.x1); }
+			});
+			done_rows += y1 - y0;
+			if (pd) {
+				pd->progress((float)done_rows / total_rows);
+				if (pd->canceled()) { return false; }
 			}
 		}
 	}
-	delete [] face_normals;
+	_normals_valid = true;
+	_stale_normals.clear();
+	// Views drawing the normals must update the recalculated regions
+	for (size_t k = 0; k < regions.size(); k++) {
+		touch(regions[k].x0, regions[k].y0, regions[k].x1, regions[k].y1);
+	}
 	if (pd) {
 		pd->progress(1.0f);
-		Fl::check();
 		if (pd->canceled()) { return false; }
 	}
 	return true;
@@ -1,27 +1,14 @@
 #pragma once
 
 #include <cstdlib>
-#include <unordered_set>
-#include <unordered_map>
-#include <queue>
+#include <vector>
 
 #include "draw-state.h"
-#include "modal-dialogs.h"
+#include "png-encoder.h"
+#include "progress.h"
 
-// std::pair lacks a std::hash definition, so it cannot be used as a std::unordered_set key
-// <http://stackoverflow.com/questions/15160889/how-to-make-unordered-set-of-pairs-of-integers-in-c>
-namespace std {
-	template <> struct hash<std::pair<size_t, size_t>> {
-		inline size_t operator()(const std::pair<size_t, size_t> &v) const {
-			std::hash<size_t> h;
-			return h(v.first) ^ h(v.second);
-		}
-	};
-}
-
-typedef std::pair<size_t, size_t> Point;
-typedef std::unordered_set<Point> Points;
-typedef std::unordered_map<Point, Points> Point_to_Points;
+class Mapped_Memory;
+struct Raw_Header;
 
 struct Vector3 {
 	union {
@@ -32,55 +19,121 @@ struct Vector3 {
 	};
 };
 
+// A snapshot of one column's properties, gathered from the heightmap's planes
 struct Column {
 	float elevation, hardness, solubility;
 	Vector3 normal;
 };
 
-void column_color(Column &c, Color_Scheme cs, float *cv);
+void column_color(const Column &c, Color_Scheme cs, float *cv);
 
 class Heightmap {
 public:
 	static const float UNKNOWN_ELEVATION;
 	static const float DEFAULT_HARDNESS, DERIVED_HARDNESS_VARIANCE;
 	static const float DEFAULT_SOLUBILITY, DERIVED_SOLUBILITY_VARIANCE;
+	static const size_t PLANE_ALIGNMENT;
+	static const size_t RAW_PAGE_SIZE;
+	// A rectangle of columns, from (x0, y0) up to but not including (x1, y1)
+	struct Region {
+		size_t x0, y0, x1, y1;
+	};
 private:
-	Column *_heightmap;
-	size_t _width, _height, _known_elevations;
+	// Column properties are stored as separate aligned planes, so passes that only need elevations stream only them
+	float *_elevations, *_hardnesses, *_solubilities;
+	Vector3 *_normals;
+	// Water and sediment levels left by erosion, so later erosion continues from them; NULL until the first erosion
+	float *_water_levels, *_sediment_levels;
+	// Planes opened from a native file belong to its mapping; missing normals get a zeroed mapping of their own
+	Mapped_Memory *_mapping, *_normals_mapping;
+	// Erosion layers in memory or a scratch file; layers opened from a native file belong to its mapping instead
+	Mapped_Memory *_erosion_mapping;
+	size_t _width, _height, _known_elevations, _erosion_steps;
+	float _erosion_max_delta, _erosion_rms_delta;
+	bool _normals_valid;
+	// Regions changed since the views last took them, and regions whose normals are out of date while the rest are
+	// current. Each list merges neighboring regions and collapses to its bounding box when it grows long.
+	std::vector<Region> _dirty_regions, _stale_normals;
 public:
 	Heightmap();
-	inline Column &column(size_t i) const { return _heightmap[i]; }
-	inline Column &column(size_t x, size_t y) const { return _heightmap[y * _width + x]; }
-	inline float elevation(size_t i) const { return _heightmap[i].elevation; }
-	inline float elevation(size_t x, size_t y) const { return _heightmap[y * _width + x].elevation; }
-	inline float hardness(size_t i) const { return _heightmap[i].hardness; }
-	inline float hardness(size_t x, size_t y) const { return _heightmap[y * _width + x].hardness; }
-	inline float solubility(size_t i) const { return _heightmap[i].solubility; }
-	inline float solubility(size_t x, size_t y) const { return _heightmap[y * _width + x].solubility; }
-	inline void elevation(size_t x, size_t y, float e) { _heightmap[y * _width + x].elevation = e; }
-	inline void hardness(size_t x, size_t y, float v) { _heightmap[y * _width + x].hardness = v; }
-	inline void solubility(size_t x, size_t y, float s) { _heightmap[y * _width + x].solubility = s; }
+	~Heightmap();
+	inline Column column(size_t i) const {
+		Column c = {_elevations[i], _hardnesses[i], _solubilities[i], _normals[i]};
+		return c;
+	}
+	inline Column column(size_t x, size_t y) const { return column(y * _width + x); }
+	inline float elevation(size_t i) const { return _elevations[i]; }
+	inline float elevation(size_t x, size_t y) const { return _elevations[y * _width + x]; }
+	inline float hardness(size_t i) const { return _hardnesses[i]; }
+	inline float hardness(size_t x, size_t y) const { return _hardnesses[y * _width + x]; }
+	inline float solubility(size_t i) const { return _solubilities[i]; }
+	inline float solubility(size_t x, size_t y) const { return _solubilities[y * _width + x]; }
+	inline const Vector3 &normal(size_t i) const { return _normals[i]; }
+	inline const Vector3 &normal(size_t x, size_t y) const { return _normals[y * _width + x]; }
+	inline void elevation(size_t x, size_t y, float e) { _elevations[y * _width + x] = e; reshape(x, y, x + 1, y + 1); }
+	inline void hardness(size_t x, size_t y, float v) { _hardnesses[y * _width + x] = v; touch(x, y, x + 1, y + 1); }
+	inline void solubility(size_t x, size_t y, float s) { _solubilities[y * _width + x] = s; touch(x, y, x + 1, y + 1); }
+	inline const float *elevations(void) const { return _elevations; }
+	inline const float *hardnesses(void) const { return _hardnesses; }
+	inline const float *solubilities(void) const { return _solubilities; }
+	inline const float *water_levels(void) const { return _water_levels; }
+	inline const float *sediment_levels(void) const { return _sediment_levels; }
 	inline size_t width(void) const { return _width; }
 	inline size_t height(void) const { return _height; }
 	inline size_t known_elevations(void) const { return _known_elevations; }
+	inline bool normals_valid(void) const { return _normals_valid && _stale_normals.empty(); }
+	// Time steps of erosion the water and sediment levels have built up over
+	inline bool eroding(void) const { return _water_levels != NULL; }
+	inline size_t erosion_steps(void) const { return _erosion_steps; }
+	// The largest and root-mean-square elevation changes in the last time step of adaptive erosion
+	inline float erosion_max_delta(void) const { return _erosion_max_delta; }
+	inline float erosion_rms_delta(void) const { return _erosion_rms_delta; }
+	// Appends the regions changed since the last call to regions, and forgets them
+	void take_dirty_regions(std::vector<Region> &regions);
 	void clear(void);
 	bool create(size_t w, size_t h);
-	bool open(const char *filename);
-	bool save(const char *filename, Color_Scheme cs, Progress_Dialog *pd = NULL) const;
-	bool decimate(bool random, double thresh, Progress_Dialog *pd = NULL);
-	bool decimate_random(double frac, Progress_Dialog *pd = NULL);
-	bool decimate_edges(double thresh, Progress_Dialog *pd = NULL);
-	bool expand(size_t power, Progress_Dialog *pd = NULL);
-	bool interpolate(bool mdbu, float I, bool md, float H, float rt, float rs, Progress_Dialog *pd = NULL);
+	// Operations that draw random numbers take a seed, and give the same results for it on any number of threads
+	bool open(const char *filename, unsigned int seed);
+	// Saving a native file over the one the planes are mapped from may move them onto the saved copy
+	bool save(const char *filename, Color_Scheme cs, Progress *pd = NULL);
+	bool save(const char *filename, Color_Scheme cs, int level, Png_Filter filter, Progress *pd = NULL);
+	bool decimate(bool random, double thresh, unsigned int seed, Progress *pd = NULL);
+	bool decimate_random(double frac, unsigned int seed, Progress *pd = NULL);
+	bool decimate_edges(double thresh, Progress *pd = NULL);
+	bool expand(size_t power, Progress *pd = NULL);
+	bool interpolate(bool mdbu, float I, bool md, float H, float rt, float rs, unsigned int seed,
+		Progress *pd = NULL);
+	// Erosion rains W0 and Wmin on the map the first time, then continues from the water and sediment levels left by
+	// earlier erosion until they are discarded, so n runs of k time steps give the same map as one run of n*k. Every
+	// other operation that changes elevations discards them, since they belong to the terrain erosion left behind.
+	// A positive tolerance stops erosion early once no elevation changes by that much in a time step, and with
+	// skip_settled, also stops simulating blocks of columns whose neighborhoods changed by a fraction of that.
 	bool erode(size_t nts, bool thermal, float Kt, float Ka, float Ki, bool hydraulic, float Kc, float Kd, float Ks,
-		float Ke, float W0, float Wmin, Progress_Dialog *pd = NULL);
-	bool calculate_normals(Progress_Dialog *pd = NULL);
+		float Ke, float W0, float Wmin, float tolerance, bool skip_settled, Progress *pd = NULL);
+	// Droplet erosion rolls density droplets per known column downhill from random positions, each dissolving and
+	// depositing sediment along its path for up to lifetime steps; it keeps no water or sediment levels of its own
+	bool erode_droplets(double density, size_t lifetime, float inertia, float capacity, float deposition,
+		float dissolution, float evaporation, unsigned int seed, Progress *pd = NULL);
+	void discard_erosion(void);
+	bool calculate_normals(Progress *pd = NULL);
 private:
-	bool open_png(const char *filename);
-	bool save_png(const char *filename, Color_Scheme cs, Progress_Dialog *pd = NULL) const;
-	bool md_bottom_up_diamond_square(float I, Progress_Dialog *pd = NULL);
-	bool midpoint_displacement_diamond_square(float H, float rt, float rs, Progress_Dialog *pd = NULL);
-	Points ascendants(size_t mx, size_t my) const;
-	void sample_square(float px, float py, float hdx, float hdy, float rt, float rs);
-	void sample_diamond(float px, float py, float hdx, float hdy, float rt, float rs);
+	bool allocate(size_t w, size_t h);
+	bool allocate_erosion(void);
+	// Mark a region as changed for the views, or its elevations as changed, which also makes nearby normals stale
+	void touch(size_t x0, size_t y0, size_t x1, size_t y1);
+	void reshape(size_t x0, size_t y0, size_t x1, size_t y1);
+	void touch_all(void);
+	bool open_png(const char *filename, unsigned int seed);
+	void load_png_row(size_t y, const unsigned char *row, int channels, int depth, unsigned int seed);
+	bool save_png(const char *filename, Color_Scheme cs, int level, Png_Filter filter, Progress *pd = NULL) const;
+	bool open_raw(const char *filename);
+	bool open_dem(const char *filename, unsigned int seed);
+	bool save_raw(const char *filename, Progress *pd = NULL);
+	bool remap_raw(const char *filename, const Raw_Header &header);
+	bool md_bottom_up_diamond_square(float I, Progress *pd = NULL);
+	bool midpoint_displacement_diamond_square(float H, float rt, float rs, unsigned int seed, Progress *pd = NULL);
+	size_t ascendants(size_t mx, size_t my, size_t as[4]) const;
+	void edge_normal(size_t x, size_t y);
+	void row_normals(size_t y, size_t x0, size_t x1);
+	bool displace(size_t i, const size_t neighbors[4], float rt, float rs, unsigned int seed, unsigned int stream);
 };
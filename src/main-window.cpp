@@ -11,6 +11,7 @@
 #include "menu-bar.h"
 #include "toolbar.h"
 #include "status-bar.h"
+#include "stage-timer.h"
 #include "workspace.h"
 #include "file-choosers.h"
 #include "main-window.h"
@@ -93,7 +94,7 @@ void Main_Window::refresh_file(const char *filename) {
 void Main_Window::refresh_status() {
 	const Heightmap &hm = _workspace->heightmap();
 	size_t ww = hm.width(), hh = hm.height(), n = hm.known_elevations();
-	_status_bar->status(ww, hh, n);
+	_status_bar->status(ww, hh, n, operation_stage_summary().c_str());
 	redraw();
 }
 
@@ -266,6 +267,7 @@ void Main_Window::erode_cb(Fl_Widget *, Main_Window *mw) {
 	mw->_erosion_dialog->show(mw);
 	if (mw->_erosion_dialog->canceled()) { return; }
 	size_t nts = mw->_erosion_dialog->param_nts();
+	bool resume = mw->_erosion_dialog->resume_erosion();
 	bool thermal = mw->_erosion_dialog->thermal_erosion();
 	float Kt = mw->_erosion_dialog->param_Kt();
 	float Ka = mw->_erosion_dialog->param_Ka();
@@ -277,9 +279,20 @@ void Main_Window::erode_cb(Fl_Widget *, Main_Window *mw) {
 	float Ke = mw->_erosion_dialog->param_Ke();
 	float W0 = mw->_erosion_dialog->param_W0();
 	float Wmin = mw->_erosion_dialog->param_Wmin();
+	float tolerance = mw->_erosion_dialog->param_tolerance();
+	bool skip_settled = mw->_erosion_dialog->skip_settled();
 	mw->_progress_dialog->title("Eroding...");
 	mw->_progress_dialog->show(mw);
-	mw->_workspace->erode(nts, thermal, Kt, Ka, Ki, hydraulic, Kc, Kd, Ks, Ke, W0, Wmin, mw->_progress_dialog);
+	if (mw->_erosion_dialog->droplet_erosion()) {
+		mw->_workspace->erode_droplets(mw->_erosion_dialog->param_density(), mw->_erosion_dialog->param_lifetime(),
+			mw->_erosion_dialog->param_inertia(), mw->_erosion_dialog->param_capacity(),
+			mw->_erosion_dialog->param_deposition(), mw->_erosion_dialog->param_dissolution(),
+			mw->_erosion_dialog->param_evaporation(), mw->_progress_dialog);
+	}
+	else {
+		mw->_workspace->erode(nts, resume, thermal, Kt, Ka, Ki, hydraulic, Kc, Kd, Ks, Ke, W0, Wmin, tolerance,
+			skip_settled, mw->_progress_dialog);
+	}
 	mw->_progress_dialog->hide();
 	if (mw->_progress_dialog->canceled()) {
 		std::ostringstream ss;
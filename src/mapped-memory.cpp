@@ -0,0 +1,236 @@
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#pragma warning(push, 0)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#pragma warning(pop)
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "algebra.h"
+#include "mapped-memory.h"
+#include "stage-timer.h"
+
+static size_t _memory_budget = 0;
+static std::string _scratch_directory;
+
+void memory_budget(size_t bytes) {
+	_memory_budget = bytes;
+}
+
+const char *scratch_directory() {
+	return _scratch_directory.c_str();
+}
+
+void scratch_directory(const char *directory) {
+	_scratch_directory = directory ? directory : "";
+}
+
+#ifdef _WIN32
+
+size_t memory_budget() {
+	if (!_memory_budget) {
+		MEMORYSTATUSEX status;
+		status.dwLength = sizeof(status);
+		unsigned long long physical = GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0x80000000ULL;
+		_memory_budget = (size_t)MIN(physical / 2, (unsigned long long)(size_t)-1);
+	}
+	return _memory_budget;
+}
+
+bool replace_file(const char *from, const char *to) {
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+Mapped_Memory::Mapped_Memory() : _data(NULL), _size(0), _anonymous(false), _file(NULL), _mapping(NULL) {}
+
+bool Mapped_Memory::map_file(const char *filename) {
+	// Sharing deletion lets the mapped file be renamed, as it can be on POSIX
+	unmap();
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return false; }
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || !size.QuadPart || (unsigned long long)size.QuadPart > (size_t)-1) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+	void *data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	if (!data) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	_file = file;
+	_mapping = mapping;
+	_data = data;
+	_size = (size_t)size.QuadPart;
+	_anonymous = false;
+	return true;
+}
+
+bool Mapped_Memory::map_zeroed(size_t size) {
+	unmap();
+	if (!size) { return false; }
+	// Committed pages are zero-filled by the system on first access
+	_data = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!_data) { return false; }
+	_size = size;
+	_anonymous = true;
+	count_allocation(size);
+	return true;
+}
+
+bool Mapped_Memory::map_scratch(size_t size) {
+	unmap();
+	if (!size) { return false; }
+	char directory[MAX_PATH + 1], filename[MAX_PATH + 1];
+	if (!_scratch_directory.empty() && _scratch_directory.size() <= MAX_PATH) {
+		_scratch_directory.copy(directory, _scratch_directory.size());
+		directory[_scratch_directory.size()] = '\0';
+	}
+	else if (!GetTempPathA(sizeof(directory), directory)) { return false; }
+	if (!GetTempFileNameA(directory, "fhm", 0, filename)) { return false; }
+	// The file is deleted as soon as its last handle is closed
+	HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		DeleteFileA(filename);
+		return false;
+	}
+	// Mapping more than the file's size extends it with zeros
+	unsigned long long size64 = size;
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size64 >> 32), (DWORD)size64, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+	void *data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!data) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	_file = file;
+	_mapping = mapping;
+	_data = data;
+	_size = size;
+	_anonymous = false;
+	count_allocation(size);
+	return true;
+}
+
+void Mapped_Memory::unmap() {
+	if (_data) {
+		if (_anonymous) { VirtualFree(_data, 0, MEM_RELEASE); }
+		else { UnmapViewOfFile(_data); }
+	}
+	if (_mapping) { CloseHandle((HANDLE)_mapping); }
+	if (_file) { CloseHandle((HANDLE)_file); }
+	_data = NULL;
+	_mapping = _file = NULL;
+	_size = 0;
+}
+
+#else
+
+size_t memory_budget() {
+	if (!_memory_budget) {
+		long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGE_SIZE);
+		unsigned long long physical = pages > 0 && page_size > 0 ? (unsigned long long)pages * page_size :
+			0x80000000ULL;
+		_memory_budget = (size_t)MIN(physical / 2, (unsigned long long)(size_t)-1);
+	}
+	return _memory_budget;
+}
+
+bool replace_file(const char *from, const char *to) {
+	return !rename(from, to);
+}
+
+Mapped_Memory::Mapped_Memory() : _data(NULL), _size(0), _anonymous(false) {}
+
+bool Mapped_Memory::map_file(const char *filename) {
+	unmap();
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0) { return false; }
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file's pages available after the descriptor is closed
+	::close(fd);
+	if (data == MAP_FAILED) { return false; }
+	_data = data;
+	_size = (size_t)st.st_size;
+	_anonymous = false;
+	return true;
+}
+
+bool Mapped_Memory::map_zeroed(size_t size) {
+	unmap();
+	if (!size) { return false; }
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) { return false; }
+	_data = data;
+	_size = size;
+	_anonymous = true;
+	count_allocation(size);
+	return true;
+}
+
+bool Mapped_Memory::map_scratch(size_t size) {
+	unmap();
+	if (!size) { return false; }
+	std::string directory = _scratch_directory;
+	if (directory.empty()) {
+		const char *tmpdir = getenv("TMPDIR");
+		directory = tmpdir && *tmpdir ? tmpdir : "/tmp";
+	}
+	std::string pattern = directory + "/frontier-XXXXXX";
+	std::vector<char> filename(pattern.begin(), pattern.end());
+	filename.push_back('\0');
+	int fd = mkstemp(&filename[0]);
+	if (fd < 0) { return false; }
+	// The file has no name once it is unlinked, so it is deleted when the mapping goes away
+	unlink(&filename[0]);
+	if (ftruncate(fd, (off_t)size)) {
+		::close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) { return false; }
+	_data = data;
+	_size = size;
+	_anonymous = false;
+	count_allocation(size);
+	return true;
+}
+
+void Mapped_Memory::unmap() {
+	if (_data) { munmap(_data, _size); }
+	_data = NULL;
+	_size = 0;
+}
+
+#endif
+
+Mapped_Memory::~Mapped_Memory() {
+	unmap();
+}
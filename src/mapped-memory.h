@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdlib>
+
+// Blocks larger than the memory budget (half of physical memory by default) are backed by scratch files, which are
+// created in the scratch directory (the system's temporary directory by default)
+size_t memory_budget(void);
+void memory_budget(size_t bytes);
+const char *scratch_directory(void);
+void scratch_directory(const char *directory);
+
+// Replace a file with another in one step, so the target is never missing. POSIX also replaces a mapped target, whose
+// mappings stay valid; Windows refuses to replace a file that is still mapped, but can rename a mapped source.
+bool replace_file(const char *from, const char *to);
+
+// A private, copy-on-write view of a file, or a block of anonymous zeroed memory. Either way, pages are only read or
+// zeroed when first touched, and writes never reach the file. A scratch block is a shared view of a new temporary file
+// that is deleted when unmapped, so the system can write its least recently used pages back to the file instead of
+// holding them in memory or swap.
+class Mapped_Memory {
+private:
+	void *_data;
+	size_t _size;
+	bool _anonymous;
+#ifdef _WIN32
+	void *_file, *_mapping;
+#endif
+public:
+	Mapped_Memory();
+	~Mapped_Memory();
+	bool map_file(const char *filename);
+	bool map_zeroed(size_t size);
+	bool map_scratch(size_t size);
+	void unmap(void);
+	inline void *data(void) const { return _data; }
+	inline size_t size(void) const { return _size; }
+};
@@ -205,7 +205,10 @@ void Alert_Dialog::refresh() {
 	_dialog->redraw();
 }
 
-Progress_Dialog::Progress_Dialog(const char *t) : Modal_Dialog(t, CANCEL_DIALOG), _body(NULL), _progress(NULL) {}
+const double Progress_Dialog::POLL_INTERVAL = 0.05;
+
+Progress_Dialog::Progress_Dialog(const char *t) : Modal_Dialog(t, CANCEL_DIALOG), _body(NULL), _progress(NULL),
+	_message(NULL), _value(0.0f), _cancel_requested(false), _shown_message(NULL) {}
 
 Progress_Dialog::~Progress_Dialog() {
 	delete _body;
@@ -230,6 +233,29 @@ void Progress_Dialog::on_initialize() {
 	_progress->value(0.0f);
 }
 
+void Progress_Dialog::on_show(const Fl_Widget *) {
+	_message = NULL;
+	_value = 0.0f;
+	_cancel_requested = false;
+	fl_cursor(FL_CURSOR_WAIT);
+	Fl::add_timeout(POLL_INTERVAL, (Fl_Timeout_Handler)poll_cb, this);
+}
+
+void Progress_Dialog::on_hide() {
+	Fl::remove_timeout((Fl_Timeout_Handler)poll_cb, this);
+	fl_cursor(FL_CURSOR_DEFAULT);
+}
+
+void Progress_Dialog::poll_cb(Progress_Dialog *pd) {
+	const char *m = pd->_message;
+	if (m && m != pd->_shown_message) {
+		pd->_body->copy_label(m);
+		pd->_shown_message = m;
+	}
+	pd->_progress->value(pd->_value);
+	Fl::repeat_timeout(POLL_INTERVAL, (Fl_Timeout_Handler)poll_cb, pd);
+}
+
 void Progress_Dialog::refresh() {
 	// Refresh widget labels
 	_dialog->label(_title);
@@ -474,13 +500,17 @@ void Interpolation_Dialog::refresh() {
 }
 
 Erosion_Dialog::Erosion_Dialog(const char *t) : Modal_Dialog(t, OK_CANCEL_DIALOG), _time_step_spinner(NULL),
-	_thermal(NULL), _Kt_spinner(NULL), _Ka_spinner(NULL), _Ki_spinner(NULL), _hydraulic(NULL), _Kc_spinner(NULL),
-	_Kd_spinner(NULL), _Ks_spinner(NULL), _Ke_spinner(NULL), _W0_spinner(NULL), _Wmin_spinner(NULL) {
-	min_size(_min_w, 206);
+	_resume(NULL), _thermal(NULL), _Kt_spinner(NULL), _Ka_spinner(NULL), _Ki_spinner(NULL), _hydraulic(NULL),
+	_Kc_spinner(NULL), _Kd_spinner(NULL), _Ks_spinner(NULL), _Ke_spinner(NULL), _W0_spinner(NULL), _Wmin_spinner(NULL),
+	_tolerance_spinner(NULL), _skip_settled(NULL), _droplets(NULL), _density_spinner(NULL), _lifetime_spinner(NULL),
+	_inertia_spinner(NULL), _capacity_spinner(NULL), _deposition_spinner(NULL), _dissolution_spinner(NULL),
+	_evaporation_spinner(NULL) {
+	min_size(_min_w, 336);
 }
 
 Erosion_Dialog::~Erosion_Dialog() {
 	delete _time_step_spinner;
+	delete _resume;
 	delete _thermal;
 	delete _Kt_spinner;
 	delete _Ka_spinner;
@@ -492,10 +522,21 @@ Erosion_Dialog::~Erosion_Dialog() {
 	delete _Ke_spinner;
 	delete _W0_spinner;
 	delete _Wmin_spinner;
+	delete _tolerance_spinner;
+	delete _skip_settled;
+	delete _droplets;
+	delete _density_spinner;
+	delete _lifetime_spinner;
+	delete _inertia_spinner;
+	delete _capacity_spinner;
+	delete _deposition_spinner;
+	delete _dissolution_spinner;
+	delete _evaporation_spinner;
 }
 
 void Erosion_Dialog::on_initialize() {
 	_time_step_spinner = new Fl_Spinner(0, 0, 0, 0, "Time steps:");
+	_resume = new Fl_Check_Button(0, 0, 0, 0, "Continue erosion:");
 	_thermal = new Fl_Check_Button(0, 0, 0, 0, "Thermal erosion:");
 	_Kt_spinner = new Fl_Spinner(0, 0, 0, 0, "Kt:");
 	_Ka_spinner = new Fl_Spinner(0, 0, 0, 0, "Ka:");
@@ -507,6 +548,16 @@ void Erosion_Dialog::on_initialize() {
 	_Ke_spinner = new Fl_Spinner(0, 0, 0, 0, "Ke:");
 	_W0_spinner = new Fl_Spinner(0, 0, 0, 0, "W0:");
 	_Wmin_spinner = new Fl_Spinner(0, 0, 0, 0, "Wmin:");
+	_tolerance_spinner = new Fl_Spinner(0, 0, 0, 0, "Tolerance:");
+	_skip_settled = new Fl_Check_Button(0, 0, 0, 0, "Skip settled areas:");
+	_droplets = new Fl_Check_Button(0, 0, 0, 0, "Droplet erosion:");
+	_density_spinner = new Fl_Spinner(0, 0, 0, 0, "Per column:");
+	_lifetime_spinner = new Fl_Spinner(0, 0, 0, 0, "Lifetime:");
+	_inertia_spinner = new Fl_Spinner(0, 0, 0, 0, "Inertia:");
+	_capacity_spinner = new Fl_Spinner(0, 0, 0, 0, "Capacity:");
+	_deposition_spinner = new Fl_Spinner(0, 0, 0, 0, "Deposition:");
+	_dissolution_spinner = new Fl_Spinner(0, 0, 0, 0, "Dissolution:");
+	_evaporation_spinner = new Fl_Spinner(0, 0, 0, 0, "Evaporation:");
 	// Initialize parameter controls
 	_time_step_spinner->labelfont(OS_FONT);
 	_time_step_spinner->labelsize(OS_FONT_SIZE);
@@ -517,6 +568,10 @@ void Erosion_Dialog::on_initialize() {
 	_time_step_spinner->range(1.0, 2000.0);
 	_time_step_spinner->step(1.0);
 	_time_step_spinner->value(100.0);
+	_resume->labelfont(OS_FONT);
+	_resume->labelsize(OS_FONT_SIZE);
+	_resume->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
+	_resume->set();
 	_thermal->labelfont(OS_FONT);
 	_thermal->labelsize(OS_FONT_SIZE);
 	_thermal->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
@@ -606,6 +661,88 @@ void Erosion_Dialog::on_initialize() {
 	_Wmin_spinner->range(0.0, 1.0);
 	_Wmin_spinner->step(0.01);
 	_Wmin_spinner->value(0.01);
+	_tolerance_spinner->labelfont(OS_FONT);
+	_tolerance_spinner->labelsize(OS_FONT_SIZE);
+	_tolerance_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_tolerance_spinner->textfont(OS_FONT);
+	_tolerance_spinner->textsize(OS_FONT_SIZE);
+	_tolerance_spinner->type(FL_FLOAT_INPUT);
+	_tolerance_spinner->range(0.0, 0.01);
+	_tolerance_spinner->step(0.0001);
+	_tolerance_spinner->value(0.0);
+	_tolerance_spinner->callback((Fl_Callback *)tolerance_cb, this);
+	_skip_settled->labelfont(OS_FONT);
+	_skip_settled->labelsize(OS_FONT_SIZE);
+	_skip_settled->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
+	_skip_settled->clear();
+	_skip_settled->deactivate();
+	_droplets->labelfont(OS_FONT);
+	_droplets->labelsize(OS_FONT_SIZE);
+	_droplets->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
+	_droplets->clear();
+	_density_spinner->labelfont(OS_FONT);
+	_density_spinner->labelsize(OS_FONT_SIZE);
+	_density_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_density_spinner->textfont(OS_FONT);
+	_density_spinner->textsize(OS_FONT_SIZE);
+	_density_spinner->type(FL_FLOAT_INPUT);
+	_density_spinner->range(0.01, 16.0);
+	_density_spinner->step(0.25);
+	_density_spinner->value(1.0);
+	_lifetime_spinner->labelfont(OS_FONT);
+	_lifetime_spinner->labelsize(OS_FONT_SIZE);
+	_lifetime_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_lifetime_spinner->textfont(OS_FONT);
+	_lifetime_spinner->textsize(OS_FONT_SIZE);
+	_lifetime_spinner->type(FL_INT_INPUT);
+	_lifetime_spinner->range(1.0, 256.0);
+	_lifetime_spinner->step(1.0);
+	_lifetime_spinner->value(30.0);
+	_inertia_spinner->labelfont(OS_FONT);
+	_inertia_spinner->labelsize(OS_FONT_SIZE);
+	_inertia_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_inertia_spinner->textfont(OS_FONT);
+	_inertia_spinner->textsize(OS_FONT_SIZE);
+	_inertia_spinner->type(FL_FLOAT_INPUT);
+	_inertia_spinner->range(0.0, 1.0);
+	_inertia_spinner->step(0.05);
+	_inertia_spinner->value(0.05);
+	_capacity_spinner->labelfont(OS_FONT);
+	_capacity_spinner->labelsize(OS_FONT_SIZE);
+	_capacity_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_capacity_spinner->textfont(OS_FONT);
+	_capacity_spinner->textsize(OS_FONT_SIZE);
+	_capacity_spinner->type(FL_FLOAT_INPUT);
+	_capacity_spinner->range(0.0, 64.0);
+	_capacity_spinner->step(0.5);
+	_capacity_spinner->value(4.0);
+	_deposition_spinner->labelfont(OS_FONT);
+	_deposition_spinner->labelsize(OS_FONT_SIZE);
+	_deposition_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_deposition_spinner->textfont(OS_FONT);
+	_deposition_spinner->textsize(OS_FONT_SIZE);
+	_deposition_spinner->type(FL_FLOAT_INPUT);
+	_deposition_spinner->range(0.0, 1.0);
+	_deposition_spinner->step(0.05);
+	_deposition_spinner->value(0.3);
+	_dissolution_spinner->labelfont(OS_FONT);
+	_dissolution_spinner->labelsize(OS_FONT_SIZE);
+	_dissolution_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_dissolution_spinner->textfont(OS_FONT);
+	_dissolution_spinner->textsize(OS_FONT_SIZE);
+	_dissolution_spinner->type(FL_FLOAT_INPUT);
+	_dissolution_spinner->range(0.0, 1.0);
+	_dissolution_spinner->step(0.05);
+	_dissolution_spinner->value(0.3);
+	_evaporation_spinner->labelfont(OS_FONT);
+	_evaporation_spinner->labelsize(OS_FONT_SIZE);
+	_evaporation_spinner->align(FL_ALIGN_LEFT | FL_ALIGN_CLIP);
+	_evaporation_spinner->textfont(OS_FONT);
+	_evaporation_spinner->textsize(OS_FONT_SIZE);
+	_evaporation_spinner->type(FL_FLOAT_INPUT);
+	_evaporation_spinner->range(0.0, 1.0);
+	_evaporation_spinner->step(0.01);
+	_evaporation_spinner->value(0.01);
 }
 
 void Erosion_Dialog::refresh() {
@@ -613,6 +750,7 @@ void Erosion_Dialog::refresh() {
 	_dialog->label(_title);
 	// Refresh widget positions and sizes
 	_time_step_spinner->resize(75, 10, 48, 22);
+	_resume->resize(140, 10, 130, 22);
 	_thermal->resize(10, 36, 150, 22);
 	_Kt_spinner->resize(30, 62, 48, 22);
 	_Ka_spinner->resize(108, 62, 48, 22);
@@ -624,7 +762,17 @@ void Erosion_Dialog::refresh() {
 	_Ke_spinner->resize(30, 140, 48, 22);
 	_W0_spinner->resize(113, 140, 48, 22);
 	_Wmin_spinner->resize(211, 140, 48, 22);
-	_min_h = 206;
+	_tolerance_spinner->resize(75, 166, 60, 22);
+	_skip_settled->resize(145, 166, 130, 22);
+	_droplets->resize(10, 192, 130, 22);
+	_density_spinner->resize(211, 192, 48, 22);
+	_lifetime_spinner->resize(75, 218, 48, 22);
+	_capacity_spinner->resize(211, 218, 48, 22);
+	_inertia_spinner->resize(75, 244, 48, 22);
+	_deposition_spinner->resize(211, 244, 48, 22);
+	_evaporation_spinner->resize(75, 270, 48, 22);
+	_dissolution_spinner->resize(211, 270, 48, 22);
+	_min_h = 336;
 	_ok_button->resize(_min_w-180, _min_h-34, 80, 24);
 	_cancel_button->resize(_min_w-90, _min_h-34, 80, 24);
 	_spacer->resize(9, _min_h-44, 1, 1);
@@ -632,3 +780,9 @@ void Erosion_Dialog::refresh() {
 	_dialog->size(_min_w, _min_h);
 	_dialog->redraw();
 }
+
+void Erosion_Dialog::tolerance_cb(Fl_Widget *, Erosion_Dialog *ed) {
+	// Settled areas are only found by measuring against a tolerance, so skipping them needs one
+	if (ed->_tolerance_spinner->value() > 0.0) { ed->_skip_settled->activate(); }
+	else { ed->_skip_settled->deactivate(); }
+}
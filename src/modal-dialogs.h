@@ -1,8 +1,10 @@
 #pragma once
 
 #include <cstdlib>
+#include <atomic>
 
 #pragma warning(push, 0)
+#include <FL/Fl.H>
 #include <FL/Fl_Double_Window.H>
 #include <FL/Fl_Widget.H>
 #include <FL/Fl_Box.H>
@@ -16,8 +18,7 @@
 
 #include "os-font.h"
 #include "widgets.h"
-
-#define PROGRESS_STEPS 100
+#include "progress.h"
 
 class Modal_Dialog {
 public:
@@ -42,8 +43,8 @@ protected:
 public:
 	inline void title(const char *t, bool del = false) { if (del) { delete _title; } _title = t; }
 	inline void min_size(int w, int h) { _min_w = w; _min_h = h; }
-	inline bool canceled(void) const { return _canceled; }
-	inline void canceled(bool c) { _canceled = c; }
+	virtual bool canceled(void) const { return _canceled; }
+	virtual void canceled(bool c) { _canceled = c; }
 	void show(const Fl_Widget *p, bool wait);
 	void hide(void) { _dialog->hide(); on_hide(); }
 private:
@@ -76,22 +77,34 @@ public:
 	void show(const Fl_Widget *p) { Modal_Dialog::show(p, true); }
 };
 
-class Progress_Dialog : public Modal_Dialog {
+class Progress_Dialog : public Modal_Dialog, public Progress {
+private:
+	static const double POLL_INTERVAL;
 private:
 	Fl_Box *_body;
 	Fl_Progress *_progress;
+	// Written by the thread running an operation and polled by the UI thread, which alone touches the widgets
+	std::atomic<const char *> _message;
+	std::atomic<float> _value;
+	std::atomic<bool> _cancel_requested;
+	const char *_shown_message;
 public:
 	Progress_Dialog(const char *t = NULL);
 	~Progress_Dialog();
 protected:
 	void on_initialize(void);
 	void refresh(void);
-	void on_show(const Fl_Widget *) { fl_cursor(FL_CURSOR_WAIT); }
-	void on_hide(void) { fl_cursor(FL_CURSOR_DEFAULT); }
+	void on_show(const Fl_Widget *);
+	void on_hide(void);
 public:
-	inline void message(const char *m) { _body->copy_label(m); }
-	inline void progress(float p) { _progress->value(p); }
+	// Messages are not copied until the next poll, so they must outlive the operation (e.g. string literals)
+	inline void message(const char *m) { _message = m; }
+	inline void progress(float p) { _value = p; }
+	inline bool canceled(void) const { return _cancel_requested; }
+	inline void canceled(bool c) { _cancel_requested = c; }
 	void show(const Fl_Widget *p) { Modal_Dialog::show(p, false); }
+private:
+	static void poll_cb(Progress_Dialog *pd);
 };
 
 class New_DTED_Dialog : public Modal_Dialog {
@@ -178,6 +191,7 @@ public:
 class Erosion_Dialog : public Modal_Dialog {
 private:
 	Fl_Spinner *_time_step_spinner; // number of time steps (1-1000)
+	Fl_Check_Button *_resume; // continue from the water and sediment left by the last erosion
 	Fl_Check_Button *_thermal;
 	Fl_Spinner *_Kt_spinner; // thermal erosion rate (0-3)
 	Fl_Spinner *_Ka_spinner; // talus angle tangent coefficient (0-1)
@@ -189,6 +203,16 @@ private:
 	Fl_Spinner *_Ke_spinner; // evaporation rate for water (0-1) [0.01]
 	Fl_Spinner *_W0_spinner; // maximum amount of rain per column (0-1) [1]
 	Fl_Spinner *_Wmin_spinner; // minimum amount of rain per column (0-1) [0.01]
+	Fl_Spinner *_tolerance_spinner; // elevation change below which erosion stops early, or 0 to run every step [0]
+	Fl_Check_Button *_skip_settled; // skip areas that changed less than the tolerance; only with a tolerance
+	Fl_Check_Button *_droplets; // roll droplets instead of simulating water and sediment over the grid
+	Fl_Spinner *_density_spinner; // droplets per column (0.01-16) [1]
+	Fl_Spinner *_lifetime_spinner; // most steps each droplet takes (1-256) [30]
+	Fl_Spinner *_inertia_spinner; // share of a droplet's direction kept each step (0-1) [0.05]
+	Fl_Spinner *_capacity_spinner; // most sediment per unit of speed, water and drop (0-64) [4]
+	Fl_Spinner *_deposition_spinner; // share of excess sediment deposited each step (0-1) [0.3]
+	Fl_Spinner *_dissolution_spinner; // share of spare capacity dissolved each step (0-1) [0.3]
+	Fl_Spinner *_evaporation_spinner; // share of a droplet's water evaporated each step (0-1) [0.01]
 public:
 	Erosion_Dialog(const char *t = NULL);
 	~Erosion_Dialog();
@@ -198,6 +222,8 @@ protected:
 public:
 	inline size_t param_nts(void) const { return (size_t)_time_step_spinner->value(); }
 	inline void param_nts(size_t nts) const { _time_step_spinner->value((double)nts); }
+	inline bool resume_erosion(void) const { return _resume->value() != 0.0; }
+	inline void resume_erosion(bool r) { if (r) { _resume->set(); } else { _resume->clear(); } }
 	inline bool thermal_erosion(void) const { return _thermal->value() != 0.0; }
 	inline void thermal_erosion(bool e) { if (e) { _thermal->set(); } else { _thermal->clear(); } }
 	inline float param_Kt(void) const { return (float)_Kt_spinner->value(); }
@@ -208,17 +234,39 @@ public:
 	inline void param_Ki(float Ki) { _Ki_spinner->value((double)Ki); }
 	inline bool hydraulic_erosion(void) const { return _hydraulic->value() != 0.0; }
 	inline void hydraulic_erosion(bool e) { if (e) { _hydraulic->set(); } else { _hydraulic->clear(); } }
-	inline float param_Kc(void) const { return (float)_Ki_spinner->value(); }
+	inline float param_Kc(void) const { return (float)_Kc_spinner->value(); }
 	inline void param_Kc(float Kc) { _Kc_spinner->value((double)Kc); }
-	inline float param_Kd(void) const { return (float)_Ki_spinner->value(); }
+	inline float param_Kd(void) const { return (float)_Kd_spinner->value(); }
 	inline void param_Kd(float Kd) { _Kd_spinner->value((double)Kd); }
-	inline float param_Ks(void) const { return (float)_Ki_spinner->value(); }
+	inline float param_Ks(void) const { return (float)_Ks_spinner->value(); }
 	inline void param_Ks(float Ks) { _Ks_spinner->value((double)Ks); }
-	inline float param_Ke(void) const { return (float)_Ki_spinner->value(); }
+	inline float param_Ke(void) const { return (float)_Ke_spinner->value(); }
 	inline void param_Ke(float Ke) { _Ke_spinner->value((double)Ke); }
 	inline float param_W0(void) const { return (float)_W0_spinner->value(); }
 	inline void param_W0(float W0) { _W0_spinner->value((double)W0); }
 	inline float param_Wmin(void) const { return (float)_Wmin_spinner->value(); }
 	inline void param_Wmin(float Wmin) { _Wmin_spinner->value((double)Wmin); }
+	inline float param_tolerance(void) const { return (float)_tolerance_spinner->value(); }
+	inline void param_tolerance(float t) { _tolerance_spinner->value((double)t); tolerance_cb(NULL, this); }
+	inline bool skip_settled(void) const { return _skip_settled->active() && _skip_settled->value() != 0.0; }
+	inline void skip_settled(bool s) { if (s) { _skip_settled->set(); } else { _skip_settled->clear(); } }
+	inline bool droplet_erosion(void) const { return _droplets->value() != 0.0; }
+	inline void droplet_erosion(bool e) { if (e) { _droplets->set(); } else { _droplets->clear(); } }
+	inline float param_density(void) const { return (float)_density_spinner->value(); }
+	inline void param_density(float d) { _density_spinner->value((double)d); }
+	inline size_t param_lifetime(void) const { return (size_t)_lifetime_spinner->value(); }
+	inline void param_lifetime(size_t l) { _lifetime_spinner->value((double)l); }
+	inline float param_inertia(void) const { return (float)_inertia_spinner->value(); }
+	inline void param_inertia(float i) { _inertia_spinner->value((double)i); }
+	inline float param_capacity(void) const { return (float)_capacity_spinner->value(); }
+	inline void param_capacity(float c) { _capacity_spinner->value((double)c); }
+	inline float param_deposition(void) const { return (float)_deposition_spinner->value(); }
+	inline void param_deposition(float d) { _deposition_spinner->value((double)d); }
+	inline float param_dissolution(void) const { return (float)_dissolution_spinner->value(); }
+	inline void param_dissolution(float d) { _dissolution_spinner->value((double)d); }
+	inline float param_evaporation(void) const { return (float)_evaporation_spinner->value(); }
+	inline void param_evaporation(float e) { _evaporation_spinner->value((double)e); }
 	void show(const Fl_Widget *p) { Modal_Dialog::show(p, true); }
+private:
+	static void tolerance_cb(Fl_Widget *w, Erosion_Dialog *ed);
 };
@@ -0,0 +1,108 @@
+#include <cstdlib>
+#include <thread>
+
+#include "parallel.h"
+
+static size_t _thread_count = 0;
+
+size_t thread_count() {
+	// Default to one thread per hardware core
+	if (!_thread_count) {
+		_thread_count = std::thread::hardware_concurrency();
+		if (!_thread_count) { _thread_count = 1; }
+	}
+	return _thread_count;
+}
+
+void thread_count(size_t n) {
+	// A count of 0 restores the default
+	_thread_count = n;
+}
+
+Barrier::Barrier(size_t count) : _mutex(), _released(), _count(count), _waiting(0), _generation(0) {}
+
+void Barrier::wait() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	size_t generation = _generation;
+	if (++_waiting == _count) {
+		_waiting = 0;
+		_generation++;
+		_released.notify_all();
+		return;
+	}
+	while (generation == _generation) { _released.wait(lock); }
+}
+
+// Worker threads wait for each new set of bands, and each one handles the band numbered after it, if there is one
+class Thread_Pool {
+private:
+	std::mutex _mutex;
+	std::condition_variable _started, _finished;
+	bool _busy;
+	size_t _workers, _generation, _remaining;
+	size_t _begin, _end, _nt;
+	void (*_band)(void *, size_t, size_t);
+	void *_context;
+	void work(size_t k, size_t generation);
+public:
+	Thread_Pool();
+	bool run(size_t begin, size_t end, size_t nt, void (*band)(void *, size_t, size_t), void *context);
+};
+
+Thread_Pool::Thread_Pool() : _mutex(), _started(), _finished(), _busy(false), _workers(0), _generation(0),
+	_remaining(0), _begin(0), _end(0), _nt(0), _band(NULL), _context(NULL) {}
+
+void Thread_Pool::work(size_t k, size_t generation) {
+	// Starts from the generation before the one it was created for, so it handles that one's bands too
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (;;) {
+		while (generation == _generation) { _started.wait(lock); }
+		generation = _generation;
+		if (k >= _nt) { continue; }
+		size_t n = _end - _begin, b0 = _begin + n * k / _nt, b1 = _begin + n * (k + 1) / _nt;
+		lock.unlock();
+		_band(_context, b0, b1);
+		lock.lock();
+		if (--_remaining == 0) { _finished.notify_one(); }
+	}
+}
+
+bool Thread_Pool::run(size_t begin, size_t end, size_t nt, void (*band)(void *, size_t, size_t), void *context) {
+	// Returns false without running anything if the pool is already handling other bands
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_busy) { return false; }
+	_busy = true;
+	// Worker k handles band k, so there are as many workers as the most bands beyond the first ever run at once;
+	// they are detached and never stopped, since they only ever wait while no bands are running
+	for (; _workers < nt - 1; _workers++) {
+		std::thread(&Thread_Pool::work, this, _workers + 1, _generation).detach();
+	}
+	_begin = begin; _end = end; _nt = nt;
+	_band = band; _context = context;
+	_remaining = nt - 1;
+	_generation++;
+	_started.notify_all();
+	lock.unlock();
+	band(context, begin, begin + (end - begin) / nt);
+	lock.lock();
+	while (_remaining) { _finished.wait(lock); }
+	_busy = false;
+	return true;
+}
+
+// The pool is never destroyed, so its workers can outlive static destruction at exit
+static Thread_Pool *_pool = new Thread_Pool();
+
+void run_bands(size_t begin, size_t end, size_t nt, void (*band)(void *, size_t, size_t), void *context) {
+	if (_pool->run(begin, end, nt, band, context)) { return; }
+	size_t n = end - begin;
+	std::vector<std::thread> threads;
+	threads.reserve(nt - 1);
+	for (size_t t = 1; t < nt; t++) {
+		threads.push_back(std::thread(band, context, begin + n * t / nt, begin + n * (t + 1) / nt));
+	}
+	band(context, begin, begin + n / nt);
+	for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it) {
+		it->join();
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+size_t thread_count(void);
+void thread_count(size_t n);
+
+// Holds each of a fixed number of threads at wait() until all of them have arrived, then releases them together, so
+// threads that persist across the stages of a parallel_for band can keep in step; it can be waited on repeatedly
+class Barrier {
+private:
+	std::mutex _mutex;
+	std::condition_variable _released;
+	size_t _count, _waiting, _generation;
+public:
+	Barrier(size_t count);
+	void wait(void);
+};
+
+// Calls band(context, band_begin, band_end) on each of nt contiguous bands of [begin, end) at once and returns once
+// all of them are done. The calling thread handles the first band itself and a persistent pool of worker threads
+// handles the rest; while the pool is in use, as by a parallel_for inside another, the bands get new threads instead.
+void run_bands(size_t begin, size_t end, size_t nt, void (*band)(void *, size_t, size_t), void *context);
+
+template <typename F>
+void call_band(void *f, size_t band_begin, size_t band_end) {
+	(*(F *)f)(band_begin, band_end);
+}
+
+// Split [begin, end) into one contiguous band per thread and call f(band_begin, band_end) on each band, returning
+// once all of them are done. Every band runs at the same time as the others, so they can wait on a shared Barrier.
+template <typename F>
+void parallel_for(size_t begin, size_t end, F f) {
+	if (end <= begin) { return; }
+	size_t n = end - begin;
+	size_t nt = thread_count();
+	if (nt > n) { nt = n; }
+	if (nt <= 1) {
+		f(begin, end);
+		return;
+	}
+	run_bands(begin, end, nt, call_band<F>, &f);
+}
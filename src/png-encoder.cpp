@@ -0,0 +1,221 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <ZLIB.H>
+
+#include "algebra.h"
+#include "parallel.h"
+#include "png-encoder.h"
+
+// Bytes per RGBA pixel
+static const size_t PIXEL_BYTES = 4;
+// Uncompressed bytes per strip, so strips are large enough to compress well but numerous enough to share out
+static const size_t STRIP_BYTES = 1 << 20;
+// Deflate's window, primed for each strip from the end of the previous one
+static const size_t WINDOW_BYTES = 32768;
+
+struct Png_Strip {
+	size_t y0, y1;
+	std::vector<unsigned char> data;
+	uLong adler;
+	size_t length;
+	bool ok;
+};
+
+static int paeth_predictor(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) { return a; }
+	return pb <= pc ? b : c;
+}
+
+static size_t apply_filter(Png_Filter filter, const unsigned char *row, const unsigned char *prev, size_t n,
+	unsigned char *out) {
+	// Filter n bytes of row against the previous row, returning the sum of the filtered bytes as signed values
+	size_t sum = 0;
+	for (size_t i = 0; i < n; i++) {
+		int a = i >= PIXEL_BYTES ? row[i - PIXEL_BYTES] : 0;
+		int b = prev[i];
+		int c = i >= PIXEL_BYTES ? prev[i - PIXEL_BYTES] : 0;
+		int predicted = 0;
+		switch (filter) {
+		case SUB_FILTER: predicted = a; break;
+		case UP_FILTER: predicted = b; break;
+		case AVERAGE_FILTER: predicted = (a + b) / 2; break;
+		case PAETH_FILTER: predicted = paeth_predictor(a, b, c); break;
+		default: break;
+		}
+		unsigned char v = (unsigned char)(row[i] - predicted);
+		out[i] = v;
+		sum += v < 128 ? v : 256 - v;
+	}
+	return sum;
+}
+
+static void filter_line(Png_Filter filter, const unsigned char *row, const unsigned char *prev, size_t n,
+	unsigned char *line, unsigned char *scratch) {
+	// A filtered line is the filter type byte followed by the filtered row
+	if (filter != ADAPTIVE_FILTER) {
+		line[0] = (unsigned char)filter;
+		apply_filter(filter, row, prev, n, line + 1);
+		return;
+	}
+	size_t best_sum = (size_t)-1;
+	for (int f = NO_FILTER; f <= PAETH_FILTER; f++) {
+		size_t sum = apply_filter((Png_Filter)f, row, prev, n, scratch);
+		if (sum < best_sum) {
+			best_sum = sum;
+			line[0] = (unsigned char)f;
+			memcpy(line + 1, scratch, n);
+		}
+	}
+}
+
+static bool encode_strip(Png_Strip &strip, size_t width, const Png_Row_Source &source, int level,
+	Png_Filter filter, bool last) {
+	// Filter the strip's rows, along with enough preceding rows to fill deflate's window, then compress them
+	size_t row_bytes = width * PIXEL_BYTES, line_bytes = row_bytes + 1;
+	size_t window_rows = MIN(strip.y0, (WINDOW_BYTES + line_bytes - 1) / line_bytes);
+	size_t y_start = strip.y0 - window_rows;
+	size_t n = (strip.y1 - y_start) * line_bytes;
+	strip.ok = false;
+	unsigned char *lines = new(std::nothrow) unsigned char[n];
+	unsigned char *prev = new(std::nothrow) unsigned char[row_bytes]();
+	unsigned char *row = new(std::nothrow) unsigned char[row_bytes];
+	unsigned char *scratch = new(std::nothrow) unsigned char[row_bytes];
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	bool initialized = false;
+	if (!lines || !prev || !row || !scratch) { goto cleanup; }
+	if (y_start > 0) { source(y_start - 1, prev); }
+	for (size_t y = y_start; y < strip.y1; y++) {
+		source(y, row);
+		filter_line(filter, row, prev, row_bytes, lines + (y - y_start) * line_bytes, scratch);
+		std::swap(row, prev);
+	}
+	{
+		const unsigned char *input = lines + window_rows * line_bytes;
+		size_t dictionary_bytes = window_rows * line_bytes;
+		strip.length = n - dictionary_bytes;
+		strip.adler = adler32(adler32(0L, Z_NULL, 0), input, (uInt)strip.length);
+		// Raw deflate, since the strips are joined under a single zlib header and checksum
+		if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) { goto cleanup; }
+		initialized = true;
+		if (dictionary_bytes) {
+			size_t d = MIN(dictionary_bytes, WINDOW_BYTES);
+			if (deflateSetDictionary(&z, input - d, (uInt)d) != Z_OK) { goto cleanup; }
+		}
+		strip.data.resize(deflateBound(&z, (uLong)strip.length) + 16);
+		z.next_in = (Bytef *)input;
+		z.avail_in = (uInt)strip.length;
+		z.next_out = &strip.data[0];
+		z.avail_out = (uInt)strip.data.size();
+		// Every strip but the last ends on a byte boundary with a sync flush, so the next can be appended to it
+		int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+		for (;;) {
+			int result = deflate(&z, flush);
+			if (result == Z_STREAM_ERROR) { goto cleanup; }
+			if (last ? result == Z_STREAM_END : z.avail_out != 0) { break; }
+			size_t used = strip.data.size() - z.avail_out;
+			strip.data.resize(strip.data.size() * 2);
+			z.next_out = &strip.data[used];
+			z.avail_out = (uInt)(strip.data.size() - used);
+		}
+		strip.data.resize(strip.data.size() - z.avail_out);
+	}
+	strip.ok = true;
+cleanup:
+	if (initialized) { deflateEnd(&z); }
+	delete [] lines;
+	delete [] prev;
+	delete [] row;
+	delete [] scratch;
+	return strip.ok;
+}
+
+static void put_uint32(unsigned char *p, uLong v) {
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static bool write_chunk(FILE *file, const char *type, const unsigned char *data, size_t n) {
+	unsigned char header[8], footer[4];
+	put_uint32(header, (uLong)n);
+	memcpy(header + 4, type, 4);
+	uLong crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+	if (n) { crc = crc32(crc, data, (uInt)n); }
+	put_uint32(footer, crc);
+	return fwrite(header, 1, 8, file) == 8 && (!n || fwrite(data, 1, n, file) == n) &&
+		fwrite(footer, 1, 4, file) == 4;
+}
+
+bool encode_png(const char *filename, size_t width, size_t height, const Png_Row_Source &source, int level,
+	Png_Filter filter, Progress *pd) {
+	if (!width || !height) { return false; }
+	FILE *file = fopen(filename, "wb");
+	if (!file) { return false; }
+	size_t line_bytes = width * PIXEL_BYTES + 1;
+	size_t strip_rows = MAX(STRIP_BYTES / line_bytes, (size_t)1);
+	size_t num_strips = (height + strip_rows - 1) / strip_rows;
+	// Strips are compressed a batch at a time, so only one batch of compressed data is held at once
+	size_t batch_size = MAX(thread_count(), (size_t)1) * 2;
+	Png_Strip *strips = new(std::nothrow) Png_Strip[batch_size];
+	uLong adler = adler32(0L, Z_NULL, 0);
+	bool success = false;
+	if (!strips) { goto cleanup; }
+	{
+		static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		unsigned char ihdr[13];
+		put_uint32(ihdr, (uLong)width);
+		put_uint32(ihdr + 4, (uLong)height);
+		ihdr[8] = 8; // bit depth
+		ihdr[9] = 6; // RGBA
+		ihdr[10] = ihdr[11] = ihdr[12] = 0; // deflate, adaptive filtering, no interlacing
+		if (fwrite(signature, 1, 8, file) != 8 || !write_chunk(file, "IHDR", ihdr, 13)) { goto cleanup; }
+	}
+	for (size_t b = 0; b < num_strips; b += batch_size) {
+		size_t nb = MIN(batch_size, num_strips - b);
+		for (size_t s = 0; s < nb; s++) {
+			strips[s].y0 = (b + s) * strip_rows;
+			strips[s].y1 = MIN(strips[s].y0 + strip_rows, height);
+		}
+		parallel_for(0, nb, [&](size_t s0, size_t s1) {
+			for (size_t s = s0; s < s1; s++) {
+				encode_strip(strips[s], width, source, level, filter, b + s == num_strips - 1);
+			}
+		});
+		for (size_t s = 0; s < nb; s++) {
+			Png_Strip &strip = strips[s];
+			if (!strip.ok) { goto cleanup; }
+			adler = adler32_combine(adler, strip.adler, (z_off_t)strip.length);
+			if (b + s == 0) {
+				// zlib header: deflate with a 32K window and the level's speed hint, padded to a multiple of 31
+				int level_hint = level < 0 || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+				unsigned char header[2] = {0x78, (unsigned char)(level_hint << 6)};
+				header[1] += (unsigned char)((31 - (header[0] * 256 + header[1]) % 31) % 31);
+				strip.data.insert(strip.data.begin(), header, header + 2);
+			}
+			if (b + s == num_strips - 1) {
+				unsigned char trailer[4];
+				put_uint32(trailer, adler);
+				strip.data.insert(strip.data.end(), trailer, trailer + 4);
+			}
+			if (!write_chunk(file, "IDAT", &strip.data[0], strip.data.size())) { goto cleanup; }
+			std::vector<unsigned char>().swap(strip.data);
+		}
+		if (pd) {
+			pd->progress((float)strips[nb - 1].y1 / height);
+			if (pd->canceled()) { goto cleanup; }
+		}
+	}
+	if (!write_chunk(file, "IEND", NULL, 0)) { goto cleanup; }
+	success = true;
+cleanup:
+	delete [] strips;
+	if (fclose(file)) { success = false; }
+	return success;
+}
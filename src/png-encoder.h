@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdlib>
+#include <functional>
+
+#include "progress.h"
+
+#define PNG_DEFAULT_LEVEL 6
+
+// Per-row PNG filters; ADAPTIVE_FILTER picks whichever filter minimizes each row's sum of absolute differences
+enum Png_Filter { NO_FILTER, SUB_FILTER, UP_FILTER, AVERAGE_FILTER, PAETH_FILTER, ADAPTIVE_FILTER };
+
+// Fills row y with width RGBA pixels; called concurrently from several threads
+typedef std::function<void(size_t y, unsigned char *row)> Png_Row_Source;
+
+// Writes an 8-bit RGBA PNG. Strips of rows are filtered and deflated in parallel, each primed with the tail of the
+// previous strip, and joined into one zlib stream; the output does not depend on the number of threads.
+bool encode_png(const char *filename, size_t width, size_t height, const Png_Row_Source &source, int level,
+	Png_Filter filter, Progress *pd = NULL);
@@ -0,0 +1,22 @@
+#include <cstdlib>
+#include <iostream>
+
+#include "algebra.h"
+#include "progress.h"
+
+#define CONSOLE_PROGRESS_STEP 10
+
+void Console_Progress::message(const char *m) {
+	_percent = 0;
+	if (_quiet) { return; }
+	std::cout << m << std::endl;
+}
+
+void Console_Progress::progress(float p) {
+	// Only print every CONSOLE_PROGRESS_STEP percent to keep logs short
+	int percent = (int)(MIN(p, 1.0f) * 100.0f) / CONSOLE_PROGRESS_STEP * CONSOLE_PROGRESS_STEP;
+	if (percent <= _percent) { return; }
+	_percent = percent;
+	if (_quiet) { return; }
+	std::cout << "  " << percent << "%" << std::endl;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdlib>
+
+// Long-running heightmap operations report progress and check for cancellation through this interface, so that they
+// can run under the GUI's Progress_Dialog or headlessly
+class Progress {
+public:
+	virtual ~Progress() {}
+	virtual void message(const char *m) = 0;
+	virtual void progress(float p) = 0;
+	virtual bool canceled(void) const = 0;
+	virtual void canceled(bool c) = 0;
+};
+
+class Console_Progress : public Progress {
+private:
+	bool _quiet, _canceled;
+	int _percent;
+public:
+	Console_Progress(bool quiet = false) : _quiet(quiet), _canceled(false), _percent(0) {}
+	void message(const char *m);
+	void progress(float p);
+	inline bool canceled(void) const { return _canceled; }
+	inline void canceled(bool c) { _canceled = c; }
+};
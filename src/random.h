@@ -0,0 +1,26 @@
+#pragma once
+
+// Counter-based random numbers: each value is a hash of a seed, a stream naming its use, and a counter such as a
+// column index, so values can be drawn in any order and from any thread, and the same seed always yields the same
+// results. The hash is two rounds of the SplitMix64 finalizer.
+
+inline unsigned long long random_mix(unsigned long long z) {
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+inline unsigned long long random_bits(unsigned int seed, unsigned int stream, unsigned long long counter) {
+	unsigned long long key = random_mix(((unsigned long long)seed << 32 | stream) + 0x9E3779B97F4A7C15ULL);
+	return random_mix(key + counter * 0x9E3779B97F4A7C15ULL);
+}
+
+inline float random01(unsigned int seed, unsigned int stream, unsigned long long counter) {
+	// Random float in [0, 1), from the top 24 bits
+	return (float)(random_bits(seed, stream, counter) >> 40) * (1.0f / 16777216.0f);
+}
+
+inline float random11(unsigned int seed, unsigned int stream, unsigned long long counter) {
+	// Random float in [-1, 1)
+	return random01(seed, stream, counter) * 2.0f - 1.0f;
+}
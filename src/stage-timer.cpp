@@ -0,0 +1,171 @@
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#pragma warning(push, 0)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#pragma warning(pop)
+#else
+#include <chrono>
+#endif
+
+#include "stage-timer.h"
+
+// Records, thread numbers and nesting depths are guarded by one mutex; stages are coarse enough that it is never
+// contended for long
+static std::mutex _stage_mutex;
+static std::vector<Stage_Record> _stage_records;
+static std::map<std::thread::id, size_t> _thread_numbers;
+static std::vector<size_t> _thread_depths;
+static std::atomic<unsigned long long> _allocated_bytes(0);
+
+#ifdef _WIN32
+
+static double now() {
+	// Microseconds since the first call
+	static LARGE_INTEGER frequency, origin;
+	static bool started = false;
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	if (!started) {
+		QueryPerformanceFrequency(&frequency);
+		origin = t;
+		started = true;
+	}
+	return (double)(t.QuadPart - origin.QuadPart) * 1e6 / (double)frequency.QuadPart;
+}
+
+#else
+
+static double now() {
+	// Microseconds since the first call
+	static std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+}
+
+#endif
+
+static size_t thread_number() {
+	// Threads are numbered in the order they first time a stage
+	std::thread::id id = std::this_thread::get_id();
+	std::map<std::thread::id, size_t>::const_iterator it = _thread_numbers.find(id);
+	if (it != _thread_numbers.end()) { return it->second; }
+	size_t n = _thread_numbers.size();
+	_thread_numbers[id] = n;
+	_thread_depths.push_back(0);
+	return n;
+}
+
+Stage_Timer::Stage_Timer(const char *name) : _name(name), _start(0.0), _cells(0), _allocated(_allocated_bytes),
+	_thread(0), _depth(0) {
+	std::lock_guard<std::mutex> lock(_stage_mutex);
+	_thread = thread_number();
+	_depth = _thread_depths[_thread]++;
+	_start = now();
+}
+
+Stage_Timer::~Stage_Timer() {
+	std::lock_guard<std::mutex> lock(_stage_mutex);
+	Stage_Record r;
+	r.name = _name;
+	r.start = _start;
+	r.duration = now() - _start;
+	r.cells = _cells;
+	r.bytes = _allocated_bytes - _allocated;
+	r.thread = _thread;
+	r.depth = _depth;
+	_thread_depths[_thread]--;
+	_stage_records.push_back(r);
+}
+
+void count_allocation(unsigned long long bytes) {
+	_allocated_bytes += bytes;
+}
+
+static bool began_before(const Stage_Record &a, const Stage_Record &b) {
+	// A stage and the first of its steps can begin at the same time, in which case the stage comes first
+	return a.start < b.start || (a.start == b.start && a.depth < b.depth);
+}
+
+std::vector<Stage_Record> stage_records() {
+	std::vector<Stage_Record> records;
+	{
+		std::lock_guard<std::mutex> lock(_stage_mutex);
+		records = _stage_records;
+	}
+	std::stable_sort(records.begin(), records.end(), began_before);
+	return records;
+}
+
+void clear_stage_records() {
+	std::lock_guard<std::mutex> lock(_stage_mutex);
+	_stage_records.clear();
+}
+
+static void describe_stage(std::ostream &os, const Stage_Record &r) {
+	os << std::fixed << std::setprecision(1) << r.duration / 1000.0 << " ms";
+	if (r.cells && r.duration > 0.0) { os << ", " << r.cells / r.duration << " M columns/s"; }
+	if (r.bytes) { os << ", " << r.bytes / 1048576.0 << " MB allocated"; }
+}
+
+std::string stage_report() {
+	std::vector<Stage_Record> records = stage_records();
+	std::ostringstream ss;
+	for (std::vector<Stage_Record>::const_iterator it = records.begin(); it != records.end(); ++it) {
+		ss << std::string(it->depth * 2, ' ') << it->name << ": ";
+		describe_stage(ss, *it);
+		ss << "\n";
+	}
+	return ss.str();
+}
+
+std::string operation_stage_summary() {
+	// Records are kept in the order stages end
+	std::lock_guard<std::mutex> lock(_stage_mutex);
+	for (std::vector<Stage_Record>::const_iterator it = _stage_records.begin(); it != _stage_records.end(); ++it) {
+		if (it->depth) { continue; }
+		std::ostringstream ss;
+		ss << it->name << ": ";
+		describe_stage(ss, *it);
+		return ss.str();
+	}
+	return "";
+}
+
+static std::string json_string(const std::string &s) {
+	std::string quoted = "\"";
+	for (std::string::const_iterator it = s.begin(); it != s.end(); ++it) {
+		if (*it == '"' || *it == '\\') { quoted += '\\'; }
+		quoted += *it;
+	}
+	return quoted + "\"";
+}
+
+bool save_stage_trace(const char *filename) {
+	// Each stage is a complete ("X") event on its thread's track, and the viewer nests events by their times
+	std::vector<Stage_Record> records = stage_records();
+	FILE *file = fopen(filename, "wb");
+	if (!file) { return false; }
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+	for (size_t i = 0; i < records.size(); i++) {
+		const Stage_Record &r = records[i];
+		ss << (i ? ",\n" : "\n") << "{\"name\":" << json_string(r.name) << ",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":" <<
+			r.start << ",\"dur\":" << r.duration << ",\"pid\":1,\"tid\":" << r.thread << ",\"args\":{\"columns\":" <<
+			r.cells << ",\"bytes\":" << r.bytes << "}}";
+	}
+	ss << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	std::string json = ss.str();
+	bool success = fwrite(json.data(), 1, json.size(), file) == json.size();
+	return fclose(file) == 0 && success;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// One timed stage of a heightmap operation: when it began and how long it took, in microseconds since the first stage
+// began, how many columns it processed, and how many bytes of planes it allocated. Stages nest, so an operation's
+// stage contains those of its steps, one level deeper.
+struct Stage_Record {
+	std::string name;
+	double start, duration;
+	unsigned long long cells, bytes;
+	size_t thread, depth;
+};
+
+// Times the stage it names from its construction to its destruction. Records are kept until cleared, and stages may
+// be timed on any thread.
+class Stage_Timer {
+private:
+	const char *_name;
+	double _start;
+	unsigned long long _cells, _allocated;
+	size_t _thread, _depth;
+public:
+	Stage_Timer(const char *name);
+	~Stage_Timer();
+	inline void cells(unsigned long long n) { _cells += n; }
+};
+
+// Large allocations are counted towards every stage running while they are made
+void count_allocation(unsigned long long bytes);
+
+// Recorded stages, in the order they began
+std::vector<Stage_Record> stage_records(void);
+void clear_stage_records(void);
+// A table of the recorded stages, one per line, with their times, throughputs and allocations
+std::string stage_report(void);
+// A one-line summary of the first top-level stage to end since the records were cleared, which is the operation's
+// own stage when they are cleared before each operation, even if others such as normals follow it
+std::string operation_stage_summary(void);
+// Write the recorded stages as a Chrome trace (JSON trace events), which chrome://tracing or Perfetto can show
+bool save_stage_trace(const char *filename);
@@ -6,9 +6,9 @@
 
 class Status_Bar : public Fl_Toolbar {
 private:
-	Fl_Status_Bar_Field *_dimensions, *_num_points;
+	Fl_Status_Bar_Field *_dimensions, *_num_points, *_last_stage;
 public:
 	Status_Bar(int ww, int wh);
-	void status(size_t ww, size_t hh, size_t n);
+	void status(size_t ww, size_t hh, size_t n, const char *stage);
 	void reset(void);
 };
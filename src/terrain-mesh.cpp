@@ -0,0 +1,397 @@
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+#include <new>
+
+#pragma warning(push, 0)
+#include <FL/gl.h>
+#pragma warning(pop)
+
+#include "algebra.h"
+#include "draw-state.h"
+#include "heightmap.h"
+#include "terrain-mesh.h"
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+// Buffer object entry points are not in the OpenGL 1.1 headers, so they are loaded at run time
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STATIC_DRAW 0x88E4
+#endif
+
+typedef void (APIENTRY *Gen_Buffers_Proc)(GLsizei n, GLuint *buffers);
+typedef void (APIENTRY *Delete_Buffers_Proc)(GLsizei n, const GLuint *buffers);
+typedef void (APIENTRY *Bind_Buffer_Proc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY *Buffer_Data_Proc)(GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+typedef void (APIENTRY *Buffer_Sub_Data_Proc)(GLenum target, ptrdiff_t offset, ptrdiff_t size, const void *data);
+
+static Gen_Buffers_Proc gen_buffers = NULL;
+static Delete_Buffers_Proc delete_buffers = NULL;
+static Bind_Buffer_Proc bind_buffer = NULL;
+static Buffer_Data_Proc buffer_data = NULL;
+static Buffer_Sub_Data_Proc buffer_sub_data = NULL;
+
+static void *gl_proc_address(const char *name) {
+#ifdef _WIN32
+	return (void *)wglGetProcAddress(name);
+#else
+	(void)name;
+	return NULL;
+#endif
+}
+
+static bool load_buffer_procs() {
+	// Buffer objects are core in OpenGL 1.5, and available from ARB_vertex_buffer_object before that
+	static bool loaded = false, supported = false;
+	if (loaded) { return supported; }
+	loaded = true;
+	gen_buffers = (Gen_Buffers_Proc)gl_proc_address("glGenBuffers");
+	delete_buffers = (Delete_Buffers_Proc)gl_proc_address("glDeleteBuffers");
+	bind_buffer = (Bind_Buffer_Proc)gl_proc_address("glBindBuffer");
+	buffer_data = (Buffer_Data_Proc)gl_proc_address("glBufferData");
+	buffer_sub_data = (Buffer_Sub_Data_Proc)gl_proc_address("glBufferSubData");
+	if (!gen_buffers || !delete_buffers || !bind_buffer || !buffer_data || !buffer_sub_data) {
+		gen_buffers = (Gen_Buffers_Proc)gl_proc_address("glGenBuffersARB");
+		delete_buffers = (Delete_Buffers_Proc)gl_proc_address("glDeleteBuffersARB");
+		bind_buffer = (Bind_Buffer_Proc)gl_proc_address("glBindBufferARB");
+		buffer_data = (Buffer_Data_Proc)gl_proc_address("glBufferDataARB");
+		buffer_sub_data = (Buffer_Sub_Data_Proc)gl_proc_address("glBufferSubDataARB");
+	}
+	supported = gen_buffers && delete_buffers && bind_buffer && buffer_data && buffer_sub_data;
+	return supported;
+}
+
+static unsigned char color_byte(float v) {
+	// Colors are at least 0.1875 so that unlit slopes stay visible
+	float floor = 0.1875f;
+	if (v < floor) { v = floor; }
+	if (v > 1.0f) { v = 1.0f; }
+	return (unsigned char)(v * 255.0f + 0.5f);
+}
+
+const size_t Terrain_Mesh::CHUNK_SIZE = 64;
+const double Terrain_Mesh::LOD_PIXELS = 4.0;
+
+// Bits of a pattern's snapped edges, for the chunks above, right of, below and left of it
+static const unsigned int COARSER_ABOVE = 1, COARSER_RIGHT = 2, COARSER_BELOW = 4, COARSER_LEFT = 8;
+
+Terrain_Mesh::Terrain_Mesh() : _built(false), _use_buffers(false), _color_scheme(GRAYSCALE), _scale(0.0f),
+	_vertex_buffer(0), _width(0), _height(0), _vertices(NULL), _chunks(), _chunks_x(0), _chunks_y(0), _levels(),
+	_visible(), _patterns() {}
+
+Terrain_Mesh::~Terrain_Mesh() {
+	// Any buffer objects are freed along with their context
+	delete [] _vertices;
+}
+
+void Terrain_Mesh::release() {
+	if (_vertex_buffer) { delete_buffers(1, &_vertex_buffer); }
+	for (std::map<size_t, Pattern>::iterator it = _patterns.begin(); it != _patterns.end(); ++it) {
+		if (it->second.buffer) { delete_buffers(1, &it->second.buffer); }
+	}
+	context_lost();
+}
+
+void Terrain_Mesh::context_lost() {
+	_vertex_buffer = 0;
+	_patterns.clear();
+	delete [] _vertices;
+	_vertices = NULL;
+	_chunks.clear();
+	_chunks_x = _chunks_y = 0;
+	_use_buffers = false;
+	_built = false;
+}
+
+void Terrain_Mesh::fill_vertices(const Heightmap &hm, Color_Scheme cs, float s, size_t y0, size_t y1,
+	Vertex *vertices) {
+	// Fill in the vertices of rows y0 up to y1
+	size_t w = hm.width();
+	const float *elevations = hm.elevations();
+	for (size_t y = y0, i = y0 * w; y < y1; y++) {
+		for (size_t x = 0; x < w; x++, i++) {
+			Vertex &v = *vertices++;
+			v.position[0] = (float)x;
+			v.position[1] = (float)y;
+			v.position[2] = elevations[i] * s;
+			const Vector3 &n = hm.normal(i);
+			v.normal[0] = n.x;
+			v.normal[1] = n.y;
+			v.normal[2] = n.z;
+			float cv[3];
+			column_color(hm.column(i), cs, cv);
+			v.color[0] = color_byte(cv[0]);
+			v.color[1] = color_byte(cv[1]);
+			v.color[2] = color_byte(cv[2]);
+			v.color[3] = 255;
+		}
+	}
+}
+
+void Terrain_Mesh::measure_chunk(const Heightmap &hm, Chunk &c) const {
+	// Bound the elevations of the chunk's vertices, including those it shares with its neighbors
+	float min_e = hm.elevation(c.x, c.y), max_e = min_e;
+	for (size_t y = c.y; y <= c.y + c.h; y++) {
+		for (size_t x = c.x; x <= c.x + c.w; x++) {
+			float e = hm.elevation(x, y);
+			if (e < min_e) { min_e = e; }
+			if (e > max_e) { max_e = e; }
+		}
+	}
+	c.min_z = min_e * _scale;
+	c.max_z = max_e * _scale;
+}
+
+bool Terrain_Mesh::build(const Heightmap &hm, Color_Scheme cs, float s) {
+	release();
+	size_t w = hm.width(), h = hm.height();
+	size_t nv = w * h;
+	if (w < 2 || h < 2) { return false; }
+	_vertices = new(std::nothrow) Vertex[nv];
+	if (!_vertices) {
+		release();
+		return false;
+	}
+	fill_vertices(hm, cs, s, 0, h, _vertices);
+	_color_scheme = cs;
+	_scale = s;
+	_width = w;
+	_height = h;
+	// Split the grid squares into chunks, with smaller ones along the right and bottom edges
+	_chunks_x = (w - 2) / CHUNK_SIZE + 1;
+	_chunks_y = (h - 2) / CHUNK_SIZE + 1;
+	_chunks.resize(_chunks_x * _chunks_y);
+	for (size_t cy = 0, i = 0; cy < _chunks_y; cy++) {
+		for (size_t cx = 0; cx < _chunks_x; cx++, i++) {
+			Chunk &c = _chunks[i];
+			c.x = cx * CHUNK_SIZE;
+			c.y = cy * CHUNK_SIZE;
+			c.w = MIN(CHUNK_SIZE, w - 1 - c.x);
+			c.h = MIN(CHUNK_SIZE, h - 1 - c.y);
+			measure_chunk(hm, c);
+		}
+	}
+	_levels.resize(_chunks.size());
+	_visible.resize(_chunks.size());
+	// Upload the vertices, keeping the client-side array only if the buffer can't hold it
+	if (load_buffer_procs()) {
+		while (glGetError() != GL_NO_ERROR) {}
+		gen_buffers(1, &_vertex_buffer);
+		bind_buffer(GL_ARRAY_BUFFER, _vertex_buffer);
+		buffer_data(GL_ARRAY_BUFFER, (ptrdiff_t)(nv * sizeof(Vertex)), _vertices, GL_STATIC_DRAW);
+		bind_buffer(GL_ARRAY_BUFFER, 0);
+		if (glGetError() == GL_NO_ERROR) {
+			_use_buffers = true;
+			delete [] _vertices;
+			_vertices = NULL;
+		}
+		else {
+			delete_buffers(1, &_vertex_buffer);
+			_vertex_buffer = 0;
+		}
+	}
+	_built = true;
+	return true;
+}
+
+bool Terrain_Mesh::update(const Heightmap &hm, const Heightmap::Region &r) {
+	// Rewrite the vertices of the rows a changed region spans, plus one row and column around it whose normals
+	// depend on it; rows are contiguous in the vertex buffer, so they are uploaded in one piece
+	if (!_built || hm.width() != _width || hm.height() != _height) { return false; }
+	size_t y0 = r.y0 > 0 ? r.y0 - 1 : 0, y1 = MIN(r.y1 + 1, _height);
+	if (y0 >= y1) { return true; }
+	// Re-measure the chunks the region's columns belong to
+	size_t x0 = r.x0 > 0 ? r.x0 - 1 : 0, x1 = MIN(r.x1, _width - 1);
+	for (size_t cy = y0 / CHUNK_SIZE; cy <= (y1 - 1) / CHUNK_SIZE && cy < _chunks_y; cy++) {
+		for (size_t cx = x0 / CHUNK_SIZE; cx <= x1 / CHUNK_SIZE && cx < _chunks_x; cx++) {
+			measure_chunk(hm, _chunks[cy * _chunks_x + cx]);
+		}
+	}
+	if (!_use_buffers) {
+		fill_vertices(hm, _color_scheme, _scale, y0, y1, _vertices + y0 * _width);
+		return true;
+	}
+	size_t nv = (y1 - y0) * _width;
+	Vertex *vertices = new(std::nothrow) Vertex[nv];
+	if (!vertices) { return false; }
+	fill_vertices(hm, _color_scheme, _scale, y0, y1, vertices);
+	while (glGetError() != GL_NO_ERROR) {}
+	bind_buffer(GL_ARRAY_BUFFER, _vertex_buffer);
+	buffer_sub_data(GL_ARRAY_BUFFER, (ptrdiff_t)(y0 * _width * sizeof(Vertex)), (ptrdiff_t)(nv * sizeof(Vertex)),
+		vertices);
+	bind_buffer(GL_ARRAY_BUFFER, 0);
+	delete [] vertices;
+	return glGetError() == GL_NO_ERROR;
+}
+
+static size_t snap(size_t k, size_t n, size_t step) {
+	// The nearest of a coarser edge's columns at or before k, where the edge's last column n is always kept
+	return k == n ? n : k / step * step;
+}
+
+const Terrain_Mesh::Pattern *Terrain_Mesh::pattern(const Chunk &c, size_t level, unsigned int coarser) {
+	size_t key = ((c.w * (CHUNK_SIZE + 1) + c.h) * 8 + level) * 16 + coarser;
+	std::map<size_t, Pattern>::iterator it = _patterns.find(key);
+	if (it != _patterns.end()) { return &it->second; }
+	Pattern &p = _patterns[key];
+	p.buffer = 0;
+	// Visit every step-th vertex, plus the last in each direction
+	size_t step = (size_t)1 << level;
+	std::vector<size_t> xs, ys;
+	for (size_t x = 0; x < c.w; x += step) { xs.push_back(x); }
+	xs.push_back(c.w);
+	for (size_t y = 0; y < c.h; y += step) { ys.push_back(y); }
+	ys.push_back(c.h);
+	for (size_t j = 0; j + 1 < ys.size(); j++) {
+		for (size_t i = 0; i + 1 < xs.size(); i++) {
+			// Split each square into triangles <a, b, d> and <c, b, d>, as the normals are calculated, after snapping
+			// vertices on edges shared with coarser chunks; snapping leaves some triangles degenerate, and they are
+			// dropped
+			GLuint v[4];
+			size_t qx[4] = {xs[i], xs[i+1], xs[i+1], xs[i]}, qy[4] = {ys[j], ys[j], ys[j+1], ys[j+1]};
+			for (int k = 0; k < 4; k++) {
+				size_t x = qx[k], y = qy[k];
+				if ((y == 0 && (coarser & COARSER_ABOVE)) || (y == c.h && (coarser & COARSER_BELOW))) {
+					x = snap(x, c.w, step * 2);
+				}
+				if ((x == 0 && (coarser & COARSER_LEFT)) || (x == c.w && (coarser & COARSER_RIGHT))) {
+					y = snap(y, c.h, step * 2);
+				}
+				v[k] = (GLuint)(y * _width + x);
+			}
+			if (v[0] != v[1] && v[0] != v[3] && v[1] != v[3]) {
+				p.indices.push_back(v[0]); p.indices.push_back(v[1]); p.indices.push_back(v[3]);
+			}
+			if (v[2] != v[1] && v[2] != v[3] && v[1] != v[3]) {
+				p.indices.push_back(v[2]); p.indices.push_back(v[1]); p.indices.push_back(v[3]);
+			}
+		}
+	}
+	if (_use_buffers && !p.indices.empty()) {
+		while (glGetError() != GL_NO_ERROR) {}
+		gen_buffers(1, &p.buffer);
+		bind_buffer(GL_ELEMENT_ARRAY_BUFFER, p.buffer);
+		buffer_data(GL_ELEMENT_ARRAY_BUFFER, (ptrdiff_t)(p.indices.size() * sizeof(GLuint)), &p.indices[0],
+			GL_STATIC_DRAW);
+		bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		if (glGetError() != GL_NO_ERROR) {
+			delete_buffers(1, &p.buffer);
+			p.buffer = 0;
+		}
+	}
+	return &p;
+}
+
+void Terrain_Mesh::select_levels() {
+	// Take the view frustum's planes from the combined projection and modelview matrices (Gribb and Hartmann, 2001),
+	// and the eye's position from the inverse of the modelview matrix, which only rotates and translates
+	GLdouble mv[16], pr[16], m[16];
+	GLint viewport[4];
+	glGetDoublev(GL_MODELVIEW_MATRIX, mv);
+	glGetDoublev(GL_PROJECTION_MATRIX, pr);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	for (int c = 0; c < 4; c++) {
+		for (int r = 0; r < 4; r++) {
+			m[c*4+r] = pr[r] * mv[c*4] + pr[4+r] * mv[c*4+1] + pr[8+r] * mv[c*4+2] + pr[12+r] * mv[c*4+3];
+		}
+	}
+	double planes[6][4];
+	for (int i = 0; i < 3; i++) {
+		for (int k = 0; k < 4; k++) {
+			planes[i*2][k] = m[k*4+3] + m[k*4+i];
+			planes[i*2+1][k] = m[k*4+3] - m[k*4+i];
+		}
+	}
+	double eye[3];
+	for (int j = 0; j < 3; j++) { eye[j] = -(mv[j*4] * mv[12] + mv[j*4+1] * mv[13] + mv[j*4+2] * mv[14]); }
+	// A grid square at distance d spans about pixels_per_unit / d pixels
+	double pixels_per_unit = fabs(pr[5]) * viewport[3] / 2.0;
+	size_t max_level = 0;
+	while (((size_t)1 << (max_level + 1)) <= CHUNK_SIZE) { max_level++; }
+	for (size_t i = 0; i < _chunks.size(); i++) {
+		const Chunk &c = _chunks[i];
+		double lo[3] = {(double)c.x, (double)c.y, c.min_z}, hi[3] = {(double)(c.x + c.w), (double)(c.y + c.h), c.max_z};
+		// A chunk is outside the frustum if the corner of its bounds farthest along some plane's normal is behind it
+		bool visible = true;
+		for (int k = 0; k < 6 && visible; k++) {
+			const double *p = planes[k];
+			double d = p[3];
+			for (int j = 0; j < 3; j++) { d += p[j] * (p[j] > 0.0 ? hi[j] : lo[j]); }
+			visible = d >= 0.0;
+		}
+		_visible[i] = visible;
+		double d2 = 0.0;
+		for (int j = 0; j < 3; j++) {
+			double e = eye[j] < lo[j] ? lo[j] - eye[j] : eye[j] > hi[j] ? eye[j] - hi[j] : 0.0;
+			d2 += e * e;
+		}
+		double max_step = LOD_PIXELS * sqrt(d2) / pixels_per_unit;
+		size_t level = 0;
+		while (level < max_level && (double)((size_t)2 << level) <= max_step) { level++; }
+		_levels[i] = (unsigned char)level;
+	}
+	// Refine chunks until none is more than one level coarser than a neighbor
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t cy = 0, i = 0; cy < _chunks_y; cy++) {
+			for (size_t cx = 0; cx < _chunks_x; cx++, i++) {
+				unsigned char finest = _levels[i];
+				if (cy > 0) { finest = MIN(finest, _levels[i - _chunks_x]); }
+				if (cy < _chunks_y - 1) { finest = MIN(finest, _levels[i + _chunks_x]); }
+				if (cx > 0) { finest = MIN(finest, _levels[i - 1]); }
+				if (cx < _chunks_x - 1) { finest = MIN(finest, _levels[i + 1]); }
+				if (_levels[i] > finest + 1) {
+					_levels[i] = (unsigned char)(finest + 1);
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+void Terrain_Mesh::draw() {
+	if (!_built) { return; }
+	select_levels();
+	// With buffers bound, the array and index pointers are offsets into them
+	const char *base = _use_buffers ? NULL : (const char *)_vertices;
+	if (_use_buffers) { bind_buffer(GL_ARRAY_BUFFER, _vertex_buffer); }
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	for (size_t cy = 0, i = 0; cy < _chunks_y; cy++) {
+		for (size_t cx = 0; cx < _chunks_x; cx++, i++) {
+			if (!_visible[i]) { continue; }
+			unsigned char level = _levels[i];
+			unsigned int coarser = 0;
+			if (cy > 0 && _levels[i - _chunks_x] > level) { coarser |= COARSER_ABOVE; }
+			if (cx < _chunks_x - 1 && _levels[i + 1] > level) { coarser |= COARSER_RIGHT; }
+			if (cy < _chunks_y - 1 && _levels[i + _chunks_x] > level) { coarser |= COARSER_BELOW; }
+			if (cx > 0 && _levels[i - 1] > level) { coarser |= COARSER_LEFT; }
+			const Chunk &c = _chunks[i];
+			const Pattern *p = pattern(c, level, coarser);
+			if (p->indices.empty()) { continue; }
+			// Point the arrays at the chunk's first vertex, which the pattern's indices are relative to
+			const char *first = base + (c.y * _width + c.x) * sizeof(Vertex);
+			glVertexPointer(3, GL_FLOAT, sizeof(Vertex), first + offsetof(Vertex, position));
+			glNormalPointer(GL_FLOAT, sizeof(Vertex), first + offsetof(Vertex, normal));
+			glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), first + offsetof(Vertex, color));
+			if (p->buffer) {
+				bind_buffer(GL_ELEMENT_ARRAY_BUFFER, p->buffer);
+				glDrawElements(GL_TRIANGLES, (GLsizei)p->indices.size(), GL_UNSIGNED_INT, NULL);
+				bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			}
+			else {
+				glDrawElements(GL_TRIANGLES, (GLsizei)p->indices.size(), GL_UNSIGNED_INT, &p->indices[0]);
+			}
+		}
+	}
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	if (_use_buffers) { bind_buffer(GL_ARRAY_BUFFER, 0); }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#pragma warning(push, 0)
+#include <FL/gl.h>
+#pragma warning(pop)
+
+#include "draw-state.h"
+#include "heightmap.h"
+
+// The 3D view's terrain, drawn as square chunks of columns with geometric mipmapping. Chunks outside the view frustum
+// are skipped, and each visible chunk is drawn through every 2^level-th column, with its level growing with its
+// distance from the eye. Neighboring chunks differ by at most one level, and the edges of the finer one snap to the
+// coarser one's columns, so no cracks open between them. The vertices are uploaded into vertex buffer objects when
+// the OpenGL implementation supports them, and kept in client-side vertex arrays otherwise.
+class Terrain_Mesh {
+public:
+	// Grid squares along each side of a chunk, a power of two
+	static const size_t CHUNK_SIZE;
+	// Largest on-screen length of a chunk's grid squares, in pixels, before it is drawn at a finer level
+	static const double LOD_PIXELS;
+private:
+	struct Vertex {
+		float position[3];
+		float normal[3];
+		unsigned char color[4];
+	};
+	// Grid squares x to x+w and y to y+h, whose vertices' scaled elevations range from min_z to max_z
+	struct Chunk {
+		size_t x, y, w, h;
+		float min_z, max_z;
+	};
+	// Triangle indices drawing a chunk of some size at some level, with some of its edges snapped to coarser
+	// neighbors; the indices are relative to the chunk's first vertex, so chunks of the same size share them
+	struct Pattern {
+		std::vector<GLuint> indices;
+		GLuint buffer;
+	};
+private:
+	bool _built, _use_buffers;
+	Color_Scheme _color_scheme;
+	float _scale;
+	GLuint _vertex_buffer;
+	size_t _width, _height;
+	Vertex *_vertices;
+	std::vector<Chunk> _chunks;
+	size_t _chunks_x, _chunks_y;
+	std::vector<unsigned char> _levels, _visible;
+	std::map<size_t, Pattern> _patterns;
+public:
+	Terrain_Mesh();
+	~Terrain_Mesh();
+	inline bool built(Color_Scheme cs, float s) const { return _built && _color_scheme == cs && _scale == s; }
+	inline void invalidate(void) { _built = false; }
+	bool build(const Heightmap &hm, Color_Scheme cs, float s);
+	// Updates the vertices around a changed region, returning false if the mesh must be rebuilt instead
+	bool update(const Heightmap &hm, const Heightmap::Region &r);
+	// Draws the chunks visible with the current projection, modelview and viewport
+	void draw(void);
+	// Buffer objects can only be released while the mesh's OpenGL context is current; when that context has been
+	// replaced, forget them instead
+	void release(void);
+	void context_lost(void);
+private:
+	static void fill_vertices(const Heightmap &hm, Color_Scheme cs, float s, size_t y0, size_t y1, Vertex *vertices);
+	void measure_chunk(const Heightmap &hm, Chunk &c) const;
+	void select_levels(void);
+	const Pattern *pattern(const Chunk &c, size_t level, unsigned int coarser);
+};
@@ -0,0 +1,164 @@
+#include <cstdlib>
+#include <new>
+
+#pragma warning(push, 0)
+#include <FL/gl.h>
+#pragma warning(pop)
+
+#include "algebra.h"
+#include "draw-state.h"
+#include "heightmap.h"
+#include "terrain-texture.h"
+
+const size_t Terrain_Texture::MAX_TILE_SIZE = 2048;
+
+static size_t power_of_two_above(size_t n) {
+	// OpenGL 1.1 textures must have power-of-two dimensions
+	size_t p = 1;
+	while (p < n) { p <<= 1; }
+	return p;
+}
+
+static void column_pixel(const Heightmap &hm, Color_Scheme cs, size_t x, size_t y, unsigned char *p) {
+	// Unknown elevations are transparent
+	if (hm.elevation(x, y) == Heightmap::UNKNOWN_ELEVATION) {
+		p[0] = p[1] = p[2] = p[3] = 0;
+		return;
+	}
+	float cv[3];
+	column_color(hm.column(x, y), cs, cv);
+	p[0] = (unsigned char)(cv[0] * 255.0f);
+	p[1] = (unsigned char)(cv[1] * 255.0f);
+	p[2] = (unsigned char)(cv[2] * 255.0f);
+	p[3] = 255;
+}
+
+Terrain_Texture::Terrain_Texture() : _built(false), _color_scheme(GRAYSCALE), _tiles(NULL), _num_tiles(0),
+	_width(0), _height(0) {}
+
+Terrain_Texture::~Terrain_Texture() {
+	// Any textures are freed along with their context
+	delete [] _tiles;
+}
+
+void Terrain_Texture::release() {
+	for (size_t i = 0; i < _num_tiles; i++) {
+		if (_tiles[i].texture) { glDeleteTextures(1, &_tiles[i].texture); }
+	}
+	delete [] _tiles;
+	_tiles = NULL;
+	_num_tiles = 0;
+	_built = false;
+}
+
+void Terrain_Texture::context_lost() {
+	delete [] _tiles;
+	_tiles = NULL;
+	_num_tiles = 0;
+	_built = false;
+}
+
+bool Terrain_Texture::build(const Heightmap &hm, Color_Scheme cs) {
+	release();
+	size_t w = hm.width(), h = hm.height();
+	if (!w || !h) { return false; }
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	size_t tile_size = MAX_TILE_SIZE;
+	while (tile_size > 64 && tile_size > (size_t)max_size) { tile_size >>= 1; }
+	size_t ntx = (w + tile_size - 1) / tile_size, nty = (h + tile_size - 1) / tile_size;
+	_tiles = new(std::nothrow) Tile[ntx * nty];
+	unsigned char *pixels = new(std::nothrow) unsigned char[tile_size * tile_size * 4];
+	if (!_tiles || !pixels) {
+		delete [] pixels;
+		release();
+		return false;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	while (glGetError() != GL_NO_ERROR) {}
+	for (size_t ty = 0; ty < nty; ty++) {
+		for (size_t tx = 0; tx < ntx; tx++) {
+			Tile &t = _tiles[_num_tiles++];
+			t.x = tx * tile_size; t.y = ty * tile_size;
+			t.w = MIN(tile_size, w - t.x); t.h = MIN(tile_size, h - t.y);
+			t.texture_w = power_of_two_above(t.w); t.texture_h = power_of_two_above(t.h);
+			t.texture = 0;
+			// Color the tile's columns, leaving unknown elevations and the padding transparent
+			for (size_t y = 0; y < t.texture_h; y++) {
+				unsigned char *p = pixels + y * t.texture_w * 4;
+				for (size_t x = 0; x < t.texture_w; x++, p += 4) {
+					if (x >= t.w || y >= t.h) { p[0] = p[1] = p[2] = p[3] = 0; }
+					else { column_pixel(hm, cs, t.x + x, t.y + y, p); }
+				}
+			}
+			glGenTextures(1, &t.texture);
+			glBindTexture(GL_TEXTURE_2D, t.texture);
+			// Magnified columns stay square blocks, as the zoomed point view drew them
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, (GLsizei)t.texture_w, (GLsizei)t.texture_h, 0, GL_RGBA,
+				GL_UNSIGNED_BYTE, pixels);
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	delete [] pixels;
+	if (glGetError() != GL_NO_ERROR) {
+		release();
+		return false;
+	}
+	_color_scheme = cs;
+	_width = w;
+	_height = h;
+	_built = true;
+	return true;
+}
+
+bool Terrain_Texture::update(const Heightmap &hm, const Heightmap::Region &r) {
+	// Recolor the part of a changed region within each tile it overlaps
+	if (!_built || hm.width() != _width || hm.height() != _height) { return false; }
+	size_t rw = MIN(r.x1, _width) - MIN(r.x0, _width), rh = MIN(r.y1, _height) - MIN(r.y0, _height);
+	if (!rw || !rh) { return true; }
+	unsigned char *pixels = new(std::nothrow) unsigned char[MIN(rw, MAX_TILE_SIZE) * MIN(rh, MAX_TILE_SIZE) * 4];
+	if (!pixels) { return false; }
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	while (glGetError() != GL_NO_ERROR) {}
+	for (size_t i = 0; i < _num_tiles; i++) {
+		const Tile &t = _tiles[i];
+		size_t x0 = MAX(r.x0, t.x), y0 = MAX(r.y0, t.y);
+		size_t x1 = MIN(r.x1, t.x + t.w), y1 = MIN(r.y1, t.y + t.h);
+		if (x0 >= x1 || y0 >= y1) { continue; }
+		unsigned char *p = pixels;
+		for (size_t y = y0; y < y1; y++) {
+			for (size_t x = x0; x < x1; x++, p += 4) { column_pixel(hm, _color_scheme, x, y, p); }
+		}
+		glBindTexture(GL_TEXTURE_2D, t.texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, (GLint)(x0 - t.x), (GLint)(y0 - t.y), (GLsizei)(x1 - x0),
+			(GLsizei)(y1 - y0), GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	delete [] pixels;
+	return glGetError() == GL_NO_ERROR;
+}
+
+void Terrain_Texture::draw() const {
+	if (!_built) { return; }
+	glEnable(GL_TEXTURE_2D);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	for (size_t i = 0; i < _num_tiles; i++) {
+		const Tile &t = _tiles[i];
+		// Column (x, y) is centered on (x, y), so each tile's quad extends half a column past its centers
+		double x0 = t.x - 0.5, y0 = t.y - 0.5, x1 = x0 + t.w, y1 = y0 + t.h;
+		float s1 = (float)t.w / t.texture_w, t1 = (float)t.h / t.texture_h;
+		glBindTexture(GL_TEXTURE_2D, t.texture);
+		glBegin(GL_QUADS);
+		glTexCoord2f(0.0f, 0.0f); glVertex2d(x0, y0);
+		glTexCoord2f(s1, 0.0f); glVertex2d(x1, y0);
+		glTexCoord2f(s1, t1); glVertex2d(x1, y1);
+		glTexCoord2f(0.0f, t1); glVertex2d(x0, y1);
+		glEnd();
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdlib>
+
+#pragma warning(push, 0)
+#include <FL/gl.h>
+#pragma warning(pop)
+
+#include "draw-state.h"
+#include "heightmap.h"
+
+// The 2D view's color-mapped heightmap as textures. Heightmaps larger than one texture are split into tiles, each
+// drawn as a quad covering its columns, so panning and zooming only change the modelview matrix.
+class Terrain_Texture {
+private:
+	static const size_t MAX_TILE_SIZE;
+private:
+	struct Tile {
+		GLuint texture;
+		size_t x, y, w, h;
+		size_t texture_w, texture_h;
+	};
+private:
+	bool _built;
+	Color_Scheme _color_scheme;
+	Tile *_tiles;
+	size_t _num_tiles, _width, _height;
+public:
+	Terrain_Texture();
+	~Terrain_Texture();
+	inline bool built(Color_Scheme cs) const { return _built && _color_scheme == cs; }
+	inline void invalidate(void) { _built = false; }
+	bool build(const Heightmap &hm, Color_Scheme cs);
+	// Recolors a changed region, returning false if the textures must be rebuilt instead
+	bool update(const Heightmap &hm, const Heightmap::Region &r);
+	void draw(void) const;
+	// Textures can only be released while their OpenGL context is current; when that context has been replaced,
+	// forget them instead
+	void release(void);
+	void context_lost(void);
+};
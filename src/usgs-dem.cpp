@@ -0,0 +1,137 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+#include "usgs-dem.h"
+
+const size_t Usgs_Dem::BLOCK_SIZE = 1024;
+
+const double Usgs_Dem::VOID_ELEVATION = -32767.0;
+
+// Byte offsets of type A record fields
+static const size_t A_MIN_ELEVATION = 738, A_MAX_ELEVATION = 762, A_RESOLUTION = 816, A_PROFILES = 858;
+// Byte offsets of type B record fields
+static const size_t B_ROWS = 12, B_Y = 48, B_DATUM = 72, B_MIN_ELEVATION = 96, B_MAX_ELEVATION = 120;
+static const size_t B_ELEVATIONS = 144;
+// Widths of integer, real and double-precision real fields
+static const size_t INT_WIDTH = 6, REAL_WIDTH = 12, DOUBLE_WIDTH = 24;
+// Elevations in a profile's first block, and in each continuation block
+static const size_t FIRST_BLOCK_ELEVATIONS = (1024 - B_ELEVATIONS) / INT_WIDTH;
+static const size_t NEXT_BLOCK_ELEVATIONS = 1024 / INT_WIDTH;
+
+static bool parse_real(const char *block, size_t start, size_t width, double &value) {
+	// Fortran reals may use D instead of E for their exponent
+	char field[32];
+	memcpy(field, block + start, width);
+	field[width] = '\0';
+	for (char *c = field; *c; c++) {
+		if (*c == 'D' || *c == 'd') { *c = 'E'; }
+	}
+	char *end;
+	value = strtod(field, &end);
+	return end != field;
+}
+
+static bool parse_int(const char *block, size_t start, long &value) {
+	char field[INT_WIDTH + 1];
+	memcpy(field, block + start, INT_WIDTH);
+	field[INT_WIDTH] = '\0';
+	char *end;
+	value = strtol(field, &end, 10);
+	return end != field;
+}
+
+Usgs_Dem::Usgs_Dem() : _file(NULL), _profiles(), _height(0), _z_resolution(1.0), _min_elevation(0.0),
+	_max_elevation(0.0) {}
+
+Usgs_Dem::~Usgs_Dem() {
+	close();
+}
+
+void Usgs_Dem::close() {
+	if (_file) { fclose(_file); }
+	_file = NULL;
+	_profiles.clear();
+	_height = 0;
+}
+
+bool Usgs_Dem::open(const char *filename) {
+	close();
+	_file = fopen(filename, "rb");
+	if (!_file) { return false; }
+	char block[1024];
+	double resolution[3];
+	long num_profiles;
+	if (fread(block, 1, BLOCK_SIZE, _file) != BLOCK_SIZE ||
+		!parse_real(block, A_RESOLUTION, REAL_WIDTH, resolution[0]) ||
+		!parse_real(block, A_RESOLUTION + REAL_WIDTH, REAL_WIDTH, resolution[1]) ||
+		!parse_real(block, A_RESOLUTION + 2 * REAL_WIDTH, REAL_WIDTH, resolution[2]) ||
+		!parse_int(block, A_PROFILES, num_profiles) || num_profiles <= 0) {
+		close();
+		return false;
+	}
+	_z_resolution = resolution[2] > 0.0 ? resolution[2] : 1.0;
+	double a_min, a_max;
+	if (!parse_real(block, A_MIN_ELEVATION, DOUBLE_WIDTH, a_min) ||
+		!parse_real(block, A_MAX_ELEVATION, DOUBLE_WIDTH, a_max)) {
+		a_min = a_max = 0.0;
+	}
+	// Only the header block of each profile is read here; its elevation count says how many blocks to skip
+	std::vector<double> ys((size_t)num_profiles);
+	double min_y = HUGE_VAL, b_min = HUGE_VAL, b_max = -HUGE_VAL;
+	long offset = (long)BLOCK_SIZE;
+	_profiles.resize((size_t)num_profiles);
+	for (size_t x = 0; x < (size_t)num_profiles; x++) {
+		Profile &p = _profiles[x];
+		long rows;
+		double lo, hi;
+		if (fseek(_file, offset, SEEK_SET) || fread(block, 1, BLOCK_SIZE, _file) != BLOCK_SIZE ||
+			!parse_int(block, B_ROWS, rows) || rows <= 0 ||
+			!parse_real(block, B_Y, DOUBLE_WIDTH, ys[x]) ||
+			!parse_real(block, B_DATUM, DOUBLE_WIDTH, p.datum_elevation)) {
+			close();
+			return false;
+		}
+		if (parse_real(block, B_MIN_ELEVATION, DOUBLE_WIDTH, lo) &&
+			parse_real(block, B_MAX_ELEVATION, DOUBLE_WIDTH, hi) && lo <= hi) {
+			if (lo < b_min) { b_min = lo; }
+			if (hi > b_max) { b_max = hi; }
+		}
+		p.offset = offset;
+		p.rows = (size_t)rows;
+		size_t rest = p.rows > FIRST_BLOCK_ELEVATIONS ? p.rows - FIRST_BLOCK_ELEVATIONS : 0;
+		offset += (long)((1 + (rest + NEXT_BLOCK_ELEVATIONS - 1) / NEXT_BLOCK_ELEVATIONS) * BLOCK_SIZE);
+		if (ys[x] < min_y) { min_y = ys[x]; }
+	}
+	// Profiles of UTM quadrangles start at different northings, so each is placed by its first elevation's y
+	for (size_t x = 0; x < _profiles.size(); x++) {
+		Profile &p = _profiles[x];
+		p.first_row = resolution[1] > 0.0 ? (size_t)floor((ys[x] - min_y) / resolution[1] + 0.5) : 0;
+		if (p.first_row + p.rows > _height) { _height = p.first_row + p.rows; }
+	}
+	// The profiles' own ranges are more reliable than the header's, which some producers leave blank
+	_min_elevation = b_min < b_max ? b_min : a_min;
+	_max_elevation = b_min < b_max ? b_max : a_max;
+	return true;
+}
+
+bool Usgs_Dem::read_profile(size_t x, double *elevations) const {
+	if (!_file || x >= _profiles.size()) { return false; }
+	const Profile &p = _profiles[x];
+	char block[1024];
+	if (fseek(_file, p.offset, SEEK_SET) || fread(block, 1, BLOCK_SIZE, _file) != BLOCK_SIZE) { return false; }
+	size_t pos = B_ELEVATIONS;
+	for (size_t r = 0; r < p.rows; r++, pos += INT_WIDTH) {
+		if (pos + INT_WIDTH > BLOCK_SIZE) {
+			if (fread(block, 1, BLOCK_SIZE, _file) != BLOCK_SIZE) { return false; }
+			pos = 0;
+		}
+		long v;
+		if (!parse_int(block, pos, v)) { return false; }
+		// Stored values are multiples of the z resolution relative to the profile's local datum
+		elevations[r] = v <= (long)VOID_ELEVATION ? VOID_ELEVATION : p.datum_elevation + v * _z_resolution;
+	}
+	return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+
+// Reader for USGS DEM files in the standard 1024-byte logical record layout: one type A header record, then one
+// type B record per profile (a south-to-north column of elevations, continued over further blocks as needed), then
+// an optional type C accuracy record. Profiles are read one at a time, so a file never has to be held in memory.
+class Usgs_Dem {
+public:
+	static const size_t BLOCK_SIZE;
+	static const double VOID_ELEVATION;
+private:
+	struct Profile {
+		long offset;
+		size_t rows, first_row;
+		double datum_elevation;
+	};
+private:
+	FILE *_file;
+	std::vector<Profile> _profiles;
+	size_t _height;
+	double _z_resolution, _min_elevation, _max_elevation;
+public:
+	Usgs_Dem();
+	~Usgs_Dem();
+	bool open(const char *filename);
+	void close(void);
+	inline size_t width(void) const { return _profiles.size(); }
+	inline size_t height(void) const { return _height; }
+	inline double min_elevation(void) const { return _min_elevation; }
+	inline double max_elevation(void) const { return _max_elevation; }
+	// Profile x covers rows [first_row, first_row + rows) counting up from the southernmost row
+	inline size_t profile_rows(size_t x) const { return _profiles[x].rows; }
+	inline size_t profile_first_row(size_t x) const { return _profiles[x].first_row; }
+	// Reads profile x's elevations from south to north, in the file's elevation units or VOID_ELEVATION
+	bool read_profile(size_t x, double *elevations) const;
+};
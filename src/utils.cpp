@@ -10,5 +10,7 @@ Filetype file_type_by_extension(const char *filename) {
 	ext = ext.substr(last_dot + 1);
 	std::transform(ext.begin(), ext.end(), ext.begin(), tolower);
 	if (ext == "png") { return PNG; }
+	if (ext == "fhm") { return FHM; }
+	if (ext == "dem") { return DEM; }
 	return UNKNOWN;
 }
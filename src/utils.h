@@ -1,5 +1,5 @@
 #pragma once
 
-enum Filetype { UNKNOWN, PNG };
+enum Filetype { UNKNOWN, PNG, FHM, DEM };
 
 Filetype file_type_by_extension(const char *filename);
@@ -1,5 +1,7 @@
 #include <cstdlib>
 #include <iostream>
+#include <atomic>
+#include <thread>
 
 #pragma warning(push, 0)
 #include <FL/gl.h>
@@ -14,6 +16,9 @@
 #include "algebra.h"
 #include "draw-state.h"
 #include "heightmap.h"
+#include "stage-timer.h"
+#include "terrain-mesh.h"
+#include "terrain-texture.h"
 #include "workspace.h"
 
 const double Workspace::FOV_Y = 45.0;
@@ -26,28 +31,45 @@ const double Workspace::FOCAL_LENGTH = 5.0;
 const double Workspace::PAN_SCALE = 2.25;
 const double Workspace::ZOOM_SCALE = 1.5;
 
+const double Workspace::BUSY_WAIT_INTERVAL = 0.05;
+
+static unsigned int new_seed() {
+	// Each operation gets its own seed from the rand() sequence seeded at startup, so repeating one varies the terrain
+	return ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+}
+
 Workspace::Workspace(int x, int y, int w, int h) : Fl_Gl_Window(x, y, w, h, NULL), _initialized(false), _opened(false),
-	_dragging(false), _left_mouse(false), _heightmap(), _state(), _prev_state(), _click_coords(), _drag_coords() {
+	_dragging(false), _left_mouse(false), _busy(false), _heightmap(), _mesh(), _texture(), _changed_regions(), _state(), _prev_state(),
+	_click_coords(), _drag_coords() {
 	end();
 }
 
 bool Workspace::create(size_t w, size_t h) {
+	// Each operation starts its own stage records, so the status bar can summarize it and they do not pile up
+	clear_stage_records();
 	close();
 	_opened = _heightmap.create(w, h);
+	invalidate_terrain();
 	redraw();
 	return _opened;
 }
 
 bool Workspace::open(const char *filename) {
+	clear_stage_records();
 	close();
-	_opened = _heightmap.open(filename);
-	if (_state.render_3d()) { calculate_normals(); }
+	_opened = _heightmap.open(filename, new_seed());
+	if (_state.render_3d() && !_heightmap.normals_valid()) { _heightmap.calculate_normals(); }
+	invalidate_terrain();
 	redraw();
 	return _opened;
 }
 
 bool Workspace::save(const char *filename, Progress_Dialog *pd) {
-	return _heightmap.save(filename, _state.color_scheme(), pd);
+	clear_stage_records();
+	bool success = false;
+	Color_Scheme cs = _state.color_scheme();
+	run_in_background([&]() { success = _heightmap.save(filename, cs, pd); });
+	return success;
 }
 
 void Workspace::close() {
@@ -55,6 +77,7 @@ void Workspace::close() {
 	_state.reset();
 	_prev_state = _state;
 	_opened = false;
+	invalidate_terrain();
 	redraw();
 }
 
@@ -135,40 +158,114 @@ void Workspace::zoom_reset(int cx, int cy) {
 
 void Workspace::decimate(bool random, double thresh, Progress_Dialog *pd) {
 	if (!_opened) { return; }
-	_heightmap.decimate(random, thresh, pd);
+	clear_stage_records();
+	unsigned int seed = new_seed();
+	run_in_background([&]() { _heightmap.decimate(random, thresh, seed, pd); });
+	refresh_terrain();
 	redraw();
 }
 
 bool Workspace::expand(size_t power, Progress_Dialog *pd) {
 	if (!_opened) { return true; }
-	bool success = _heightmap.expand(power, pd);
+	clear_stage_records();
+	bool success = false;
+	run_in_background([&]() { success = _heightmap.expand(power, pd); });
+	refresh_terrain();
 	redraw();
 	return success;
 }
 
 void Workspace::interpolate(bool mdbu, float I, bool md, float H, float rt, float rs, Progress_Dialog *pd) {
 	if (!_opened) { return; }
-	_heightmap.interpolate(mdbu, I, md, H, rt, rs, pd);
-	if (_state.render_3d()) { calculate_normals(pd); }
+	clear_stage_records();
+	bool normals = _state.render_3d();
+	unsigned int seed = new_seed();
+	run_in_background([&]() {
+		_heightmap.interpolate(mdbu, I, md, H, rt, rs, seed, pd);
+		if (normals) { _heightmap.calculate_normals(pd); }
+	});
+	refresh_terrain();
 	redraw();
 }
 
-void Workspace::erode(size_t nts, bool thermal, float Kt, float Ka, float Ki, bool hydraulic, float Kc, float Kd,
-	float Ks, float Ke, float W0, float Wmin, Progress_Dialog *pd) {
+void Workspace::erode(size_t nts, bool resume, bool thermal, float Kt, float Ka, float Ki, bool hydraulic, float Kc,
+	float Kd, float Ks, float Ke, float W0, float Wmin, float tolerance, bool skip_settled, Progress_Dialog *pd) {
 	if (!_opened) { return; }
-	_heightmap.erode(nts, thermal, Kt, Ka, Ki, hydraulic, Kc, Kd, Ks, Ke, W0, Wmin, pd);
-	if (_state.render_3d()) { calculate_normals(pd); }
+	clear_stage_records();
+	bool normals = _state.render_3d();
+	run_in_background([&]() {
+		if (!resume) { _heightmap.discard_erosion(); }
+		_heightmap.erode(nts, thermal, Kt, Ka, Ki, hydraulic, Kc, Kd, Ks, Ke, W0, Wmin, tolerance, skip_settled, pd);
+		if (normals) { _heightmap.calculate_normals(pd); }
+	});
+	refresh_terrain();
+	redraw();
+}
+
+void Workspace::erode_droplets(double density, size_t lifetime, float inertia, float capacity, float deposition,
+	float dissolution, float evaporation, Progress_Dialog *pd) {
+	if (!_opened) { return; }
+	clear_stage_records();
+	bool normals = _state.render_3d();
+	unsigned int seed = new_seed();
+	run_in_background([&]() {
+		_heightmap.erode_droplets(density, lifetime, inertia, capacity, deposition, dissolution, evaporation, seed, pd);
+		if (normals) { _heightmap.calculate_normals(pd); }
+	});
+	refresh_terrain();
 	redraw();
 }
 
 bool Workspace::calculate_normals(Progress_Dialog *pd) {
 	if (!_opened) { return true; }
-	bool success = _heightmap.calculate_normals(pd);
-	invalidate();
+	clear_stage_records();
+	bool success = false;
+	if (pd) { run_in_background([&]() { success = _heightmap.calculate_normals(pd); }); }
+	else { success = _heightmap.calculate_normals(); }
+	refresh_terrain();
 	redraw();
 	return success;
 }
 
+void Workspace::invalidate_terrain() {
+	_mesh.invalidate();
+	_texture.invalidate();
+	_changed_regions.clear();
+	_heightmap.take_dirty_regions(_changed_regions);
+	_changed_regions.clear();
+}
+
+void Workspace::refresh_terrain() {
+	// The regions an operation changed are updated in the built mesh and texture the next time they are drawn
+	_heightmap.take_dirty_regions(_changed_regions);
+}
+
+void Workspace::update_terrain() {
+	// A view that can't update a region in place is rebuilt instead
+	Color_Scheme cs = _state.color_scheme();
+	float scale = _state.scale();
+	for (size_t i = 0; i < _changed_regions.size(); i++) {
+		const Heightmap::Region &r = _changed_regions[i];
+		if (_mesh.built(cs, scale) && !_mesh.update(_heightmap, r)) { _mesh.invalidate(); }
+		if (_texture.built(cs) && !_texture.update(_heightmap, r)) { _texture.invalidate(); }
+	}
+	_changed_regions.clear();
+}
+
+void Workspace::run_in_background(const std::function<void(void)> &f) {
+	// Run f on a worker thread while this thread keeps handling events, so that the progress dialog stays responsive;
+	// the heightmap must not be drawn until f is done with it
+	_busy = true;
+	std::atomic<bool> done(false);
+	std::thread worker([&]() {
+		f();
+		done = true;
+	});
+	while (!done) { Fl::wait(BUSY_WAIT_INTERVAL); }
+	worker.join();
+	_busy = false;
+}
+
 void Workspace::render_3d(bool r) {
 	_state.reset();
 	_state.render_3d(r);
@@ -244,6 +341,10 @@ void Workspace::draw() {
 		refresh_gl();
 		_initialized = true;
 	}
+	if (!context_valid()) {
+		_mesh.context_lost();
+		_texture.context_lost();
+	}
 	if (!valid()) {
 		refresh_projection();
 		valid(1);
@@ -251,7 +352,12 @@ void Workspace::draw() {
 	refresh_view();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	//gl_draw(" ", 1); // fix for erratic FLTK font drawing <http://www.fltk.org/newsgroups.php?gfltk.opengl+v:17>
-	if (_opened) {
+	if (!_opened) {
+		_mesh.release();
+		_texture.release();
+	}
+	else if (!_busy) {
+		update_terrain();
 		if (_state.render_3d()) {
 			draw_heightmap_3d();
 		}
@@ -262,6 +368,27 @@ void Workspace::draw() {
 }
 
 void Workspace::draw_heightmap_2d() {
+	// The texture is only rebuilt when the heightmap or color scheme has changed; panning and zooming just move it
+	Color_Scheme cs = _state.color_scheme();
+	size_t ww = _heightmap.width(), hh = _heightmap.height();
+	if (_texture.built(cs) || _texture.build(_heightmap, cs)) {
+		_texture.draw();
+	}
+	else {
+		draw_heightmap_points();
+	}
+	// Draw box around points
+	glColor3f(1.0f, 1.0f, 1.0f);
+	glBegin(GL_LINE_LOOP);
+	glVertex3d(-0.5, -0.5, 0.0);
+	glVertex3d(ww - 0.5, -0.5, 0.0);
+	glVertex3d(ww - 0.5, hh - 0.5, 0.0);
+	glVertex3d(-0.5, hh - 0.5, 0.0);
+	glEnd();
+}
+
+void Workspace::draw_heightmap_points() {
+	// Fallback for when the heightmap can't be held in textures: draw each visible column as a point
 	double zoom = _state.zoom();
 	glPointSize(MAX((float)ceil(zoom), 1.0f));
 	size_t ww = _heightmap.width(), hh = _heightmap.height();
@@ -274,7 +401,7 @@ void Workspace::draw_heightmap_2d() {
 	glBegin(GL_POINTS);
 	for (size_t y = min_y; y <= max_y; y++) {
 		for (size_t x = min_x; x <= max_x; x++) {
-			Column &c = _heightmap.column(x, y);
+			Column c = _heightmap.column(x, y);
 			float h = c.elevation;
 			if (h == Heightmap::UNKNOWN_ELEVATION) { continue; }
 			float cv[3];
@@ -284,48 +411,14 @@ void Workspace::draw_heightmap_2d() {
 		}
 	}
 	glEnd();
-	// Draw box around points
-	glColor3f(1.0f, 1.0f, 1.0f);
-	glBegin(GL_LINE_LOOP);
-	glVertex3d(-0.5, -0.5, 0.0);
-	glVertex3d(ww - 0.5, -0.5, 0.0);
-	glVertex3d(ww - 0.5, hh - 0.5, 0.0);
-	glVertex3d(-0.5, hh - 0.5, 0.0);
-	glEnd();
-}
-
-static void color_floor(float *cv) {
-	float floor = 0.1875f;
-	if (cv[0] < floor) { cv[0] = floor; }
-	if (cv[1] < floor) { cv[1] = floor; }
-	if (cv[2] < floor) { cv[2] = floor; }
 }
 
 void Workspace::draw_heightmap_3d() {
-	size_t ww = _heightmap.width(), hh = _heightmap.height();
+	// The mesh is only rebuilt when the heightmap, color scheme or scale has changed
 	Color_Scheme cs = _state.color_scheme();
-	for (size_t y = 0; y < hh - 1; y++) {
-		glBegin(GL_TRIANGLE_STRIP);
-		for (size_t x = 0; x < ww; x++) {
-			Column &c1 = _heightmap.column(x, y);
-			float h1 = c1.elevation * _state.scale();
-			float cv1[3];
-			column_color(c1, cs, cv1);
-			color_floor(cv1);
-			glColor3fv(cv1);
-			glNormal3fv(c1.normal.xyz);
-			glVertex3f((float)x, (float)y, h1);
-			Column &c2 = _heightmap.column(x, y + 1);
-			float h2 = c2.elevation * _state.scale();
-			float cv2[3];
-			column_color(c2, cs, cv2);
-			color_floor(cv2);
-			glColor3fv(cv2);
-			glNormal3fv(c2.normal.xyz);
-			glVertex3f((float)x, (float)(y + 1), h2);
-		}
-		glEnd();
-	}
+	float scale = _state.scale();
+	if (!_mesh.built(cs, scale) && !_mesh.build(_heightmap, cs, scale)) { return; }
+	_mesh.draw();
 }
 
 int Workspace::handle(int event) {
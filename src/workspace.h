@@ -1,5 +1,8 @@
 #pragma once
 
+#include <functional>
+#include <vector>
+
 #pragma warning(push, 0)
 #include <FL/gl.h>
 #include <FL/glu.h>
@@ -9,6 +12,8 @@
 #include "heightmap.h"
 #include "draw-state.h"
 #include "modal-dialogs.h"
+#include "terrain-mesh.h"
+#include "terrain-texture.h"
 
 class Workspace : public Fl_Gl_Window {
 private:
@@ -16,14 +21,19 @@ private:
 	static const double NEAR_PLANE, FAR_PLANE;
 	static const double FOCAL_LENGTH;
 	static const double PAN_SCALE, ZOOM_SCALE;
+	static const double BUSY_WAIT_INTERVAL;
 private:
-	bool _initialized, _opened, _dragging, _left_mouse;
+	bool _initialized, _opened, _dragging, _left_mouse, _busy;
 	Heightmap _heightmap;
+	Terrain_Mesh _mesh;
+	Terrain_Texture _texture;
+	std::vector<Heightmap::Region> _changed_regions;
 	Draw_State _state, _prev_state;
 	int _click_coords[2], _drag_coords[2];
 public:
 	Workspace(int x, int y, int w, int h);
 	inline bool opened(void) const { return _opened; }
+	inline bool busy(void) const { return _busy; }
 	inline const Heightmap &heightmap(void) const { return _heightmap; }
 	inline const Draw_State &draw_state(void) const { return _state; }
 	bool create(size_t w, size_t h);
@@ -38,8 +48,10 @@ public:
 	void decimate(bool random, double thresh, Progress_Dialog *pd = NULL);
 	bool expand(size_t power, Progress_Dialog *pd = NULL);
 	void interpolate(bool mdbu, float I, bool md, float H, float rt, float rs, Progress_Dialog *pd = NULL);
-	void erode(size_t nts, bool thermal, float Kt, float Ka, float Ki, bool hydraulic, float Kc, float Kd, float Ks,
-		float Ke, float W0, float Wmin, Progress_Dialog *pd = NULL);
+	void erode(size_t nts, bool resume, bool thermal, float Kt, float Ka, float Ki, bool hydraulic, float Kc, float Kd,
+		float Ks, float Ke, float W0, float Wmin, float tolerance, bool skip_settled, Progress_Dialog *pd = NULL);
+	void erode_droplets(double density, size_t lifetime, float inertia, float capacity, float deposition,
+		float dissolution, float evaporation, Progress_Dialog *pd = NULL);
 	bool calculate_normals(Progress_Dialog *pd = NULL);
 	void render_3d(bool r);
 	inline void color_scheme(Color_Scheme cs) { _state.color_scheme(cs); invalidate(); redraw(); }
@@ -49,9 +61,14 @@ protected:
 	int handle(int event);
 private:
 	static void refresh_gl(void);
+	void invalidate_terrain(void);
+	void refresh_terrain(void);
+	void update_terrain(void);
+	void run_in_background(const std::function<void(void)> &f);
 	void refresh_projection(void) const;
 	void refresh_view(void);
 	void draw_heightmap_2d(void);
+	void draw_heightmap_points(void);
 	void draw_heightmap_3d(void);
 	int handle_2d(int event);
 	int handle_3d(int event);